@@ -0,0 +1,840 @@
+/*
+  aot.cpp - Compiling programs to C++
+
+  Each lambda becomes a function with the CCProcedure signature, whose
+  parameters and temporaries are C++ locals; the variables it uses from
+  enclosing lambdas are copied into its closure when it is made. The
+  program's forms are run in order by run_unit(), after init_unit() has
+  made their symbols, quoted data and case tables.
+
+  Globals are looked up by name when first used, as they would be when
+  the code using them is compiled. Calls to a procedure defined once at
+  toplevel by name go straight to its function, and calls to a few
+  primitives are open-coded, each guarded by the value of the binding,
+  as inlined calls in the interpreter are; a procedure calling itself
+  in tail position loops. Record accessors, mutators and vector-ref are
+  tested for when called, not when compiled, as the bindings they were
+  inlined for are made at run time.
+*/
+
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "lisp.h"
+#include "aot.h"
+#include "native.h"
+#include "parse.h"
+#include "srcloc.h"
+#include "util.h"
+
+/* generated code, built up a piece at a time */
+class Text {
+	char *data;
+	size_t len, cap;
+	Text(const Text&);
+	Text &operator=(const Text&);
+public:
+	Text() : data(0), len(0), cap(0) {}
+	~Text() { free(data); }
+	const char *str() const { return data ? data : ""; }
+	void put(const char *s, size_t n);
+	void add(const Text &t) { put(t.data, t.len); }
+	void printf(const char *fmt, ...)
+		__attribute__((format(printf, 2, 3)));
+};
+
+void
+Text::put(const char *s, size_t n)
+{
+	if (len + n + 1 > cap) {
+		cap = cap ? cap : 256;
+		while (len + n + 1 > cap)
+			cap *= 2;
+		data = (char *) realloc(data, cap);
+	}
+	memcpy(data + len, s, n);
+	len += n;
+	data[len] = 0;
+}
+
+void
+Text::printf(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if ((size_t) n < sizeof(buf)) {
+		put(buf, n);
+		return;
+	}
+	malloc_ptr<char> p = (char *) malloc(n + 1);
+	va_start(ap, fmt);
+	vsnprintf(p, n + 1, fmt, ap);
+	va_end(ap);
+	put(p, n);
+}
+
+/* a C++ string literal; ? is escaped against trigraphs */
+static void
+put_cstring(Text &t, const char *s, size_t n)
+{
+	t.put("\"", 1);
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\' || c == '?')
+			t.printf("\\%c", c);
+		else if (c >= ' ' && c < 127)
+			t.put(s + i, 1);
+		else
+			t.printf("\\%03o", c);
+	}
+	t.put("\"", 1);
+}
+
+/* primitives open-coded where the binding still holds them */
+enum InlineOp {
+	OP_ADD, OP_SUB, OP_MUL, OP_LT, OP_GT, OP_EQV, OP_NOT, NUM_OPS
+};
+
+static const struct {
+	const char *name;
+	int arity;
+} inline_ops[NUM_OPS] = {
+	{"+", ~2}, {"-", ~2}, {"*", ~2}, {"<", 2}, {">", 2},
+	{"eqv?", 2}, {"not", 1},
+};
+
+/* a lambda, or the toplevel, being compiled */
+struct AotFn {
+	AotFn *up;
+	unsigned id;
+	int arity;
+	Value caps;        /* ((level . offset) ...), last captured first */
+	unsigned ncaps, ntemps, depth;
+	bool toplevel, loops;
+	Text body;
+	AotFn(AotFn *up, unsigned id, int arity, bool toplevel = false)
+		: up(up), id(id), arity(arity), caps(NIL), ncaps(0), ntemps(0),
+		depth(1), toplevel(toplevel), loops(false) {}
+	unsigned nparams() const { return arity >= 0 ? arity : ~arity + 1; }
+	unsigned temp() { return ntemps++; }
+	void line(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+
+void
+AotFn::line(const char *fmt, ...)
+{
+	char buf[256];
+	for (unsigned i = 0; i < depth; i++)
+		body.put("\t", 1);
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if ((size_t) n < sizeof(buf))
+		body.put(buf, n);
+	else {
+		malloc_ptr<char> p = (char *) malloc(n + 1);
+		va_start(ap, fmt);
+		vsnprintf(p, n + 1, fmt, ap);
+		va_end(ap);
+		body.put(p, n);
+	}
+	body.put("\n", 1);
+}
+
+/* where a value goes, other than into a variable */
+static const char to_discard[] = "(void) ", to_return[] = "return ";
+
+class AotUnit {
+	Module *mod;
+	Text protos, funcs, init;
+	AotFn top;
+	HashTable *syms, *globs, *lits, *procs;
+	unsigned nsyms, nglobs, nlits, ncases, nprims, nfns, nprocs;
+	int prim_slot[NUM_OPS];
+	Expr **forms;      /* collectable, as the program may be large */
+	unsigned nforms, maxforms;
+	Abs **proc_abs;
+	Define *proc_def;  /* the definition of the procedure proc_id */
+	unsigned proc_id;
+
+	unsigned symbol(Symbol *sym);
+	unsigned global(Symbol *sym);
+	unsigned prim(InlineOp op);
+	unsigned lit_slot(Value x);
+	void literal(Value x, Text &out, bool nested);
+	void local(AotFn *fn, unsigned level, unsigned offset, Text &out);
+	void leaf(AotFn *fn, Expr *exp, Text &out);
+	void into(AotFn *fn, Expr *exp, const char *var);
+	void emit(AotFn *fn, Expr *exp, const char *dest);
+	void emit_app(AotFn *fn, App *app, const char *dest);
+	void emit_case(AotFn *fn, Case *c, const char *dest);
+	void emit_abs(AotFn *fn, Abs *abs, const char *dest);
+	void function(AotFn *fn, Abs *abs, Symbol *name);
+public:
+	AotUnit(Module *mod);
+	void add(Expr *exp);
+	void finish();
+	void write(FILE *out);
+};
+
+AotUnit::AotUnit(Module *mod)
+	: mod(mod), top(0, 0, 0, true),
+	syms(new HashTable(HASH_EQV, false)),
+	globs(new HashTable(HASH_EQV, false)),
+	lits(new HashTable(HASH_EQV, false)),
+	procs(new HashTable(HASH_EQV, false)),
+	nsyms(0), nglobs(0), nlits(0), ncases(0), nprims(0), nfns(0),
+	nprocs(0), forms(0), nforms(0), maxforms(0), proc_abs(0),
+	proc_def(0), proc_id(0)
+{
+	for (unsigned i = 0; i < NUM_OPS; i++)
+		prim_slot[i] = -1;
+}
+
+static bool
+is_proc_define(Expr *exp)
+{
+	return exp->type == Expr::DEFINE
+	    && ((Define *) exp)->value->type == Expr::ABS;
+}
+
+/* a name defined more than once gets no direct calls */
+void
+AotUnit::add(Expr *exp)
+{
+	if (nforms == maxforms) {
+		maxforms = maxforms ? 2 * maxforms : 64;
+		Expr **p = (Expr **) GC_MALLOC(maxforms * sizeof(Expr *));
+		Abs **q = (Abs **) GC_MALLOC(maxforms * sizeof(Abs *));
+		for (unsigned i = 0; i < nforms; i++)
+			p[i] = forms[i];
+		for (unsigned i = 0; i < nprocs; i++)
+			q[i] = proc_abs[i];
+		forms = p;
+		proc_abs = q;
+	}
+	forms[nforms++] = exp;
+	if (!is_proc_define(exp))
+		return;
+	Define *def = (Define *) exp;
+	Value *slot = procs->lookup(def->name);
+	if (slot)
+		*slot = _F;
+	else
+		procs->insert(def->name, make_fixnum(nprocs));
+	proc_abs[nprocs++] = (Abs *) def->value;
+}
+
+unsigned
+AotUnit::symbol(Symbol *sym)
+{
+	Value *slot = syms->lookup(sym);
+	if (slot)
+		return as_fixnum(*slot);
+	init.printf("\tsym[%u] = make_symbol(", nsyms);
+	put_cstring(init, sym->value, sym->len);
+	init.printf(", %u);\n", (unsigned) sym->len);
+	syms->insert(sym, make_fixnum(nsyms));
+	return nsyms++;
+}
+
+unsigned
+AotUnit::global(Symbol *sym)
+{
+	Value *slot = globs->lookup(sym);
+	if (slot)
+		return as_fixnum(*slot);
+	globs->insert(sym, make_fixnum(nglobs));
+	return nglobs++;
+}
+
+unsigned
+AotUnit::prim(InlineOp op)
+{
+	if (prim_slot[op] < 0) {
+		prim_slot[op] = nprims;
+		init.printf("\tprim[%u] = primitive(\"%s\");\n",
+		            nprims++, inline_ops[op].name);
+	}
+	return prim_slot[op];
+}
+
+/* quoted data is made once, by init_unit() */
+unsigned
+AotUnit::lit_slot(Value x)
+{
+	Value *slot = lits->lookup(x);
+	if (slot)
+		return as_fixnum(*slot);
+
+	Text items;
+	unsigned n = 0;
+	if (is_pair(x)) {
+		Value p = x;
+		for (; is_pair(p); p = cdr(p), n++) {
+			if (n)
+				items.put(", ", 2);
+			literal(car(p), items, true);
+		}
+		Text tail;
+		literal(p, tail, true);
+		init.printf("\t{\n\t\tValue v[] = {%s};\n", items.str());
+		init.printf("\t\tlit[%u] = native_list(%u, v, %s);\n\t}\n",
+		            nlits, n, tail.str());
+	}
+	else if (is_vector(x) && as_vector(x)->len) {
+		Vector *v = as_vector(x);
+		for (; n < v->len; n++) {
+			if (n)
+				items.put(", ", 2);
+			literal(v->items[n], items, true);
+		}
+		init.printf("\t{\n\t\tValue v[] = {%s};\n", items.str());
+		init.printf("\t\tlit[%u] = native_vector(%u, v);\n\t}\n",
+		            nlits, n);
+	}
+	else if (is_vector(x))
+		init.printf("\tlit[%u] = native_vector(0, 0);\n", nlits);
+	else if (is_string(x)) {
+		init.printf("\tlit[%u] = make_string(", nlits);
+		put_cstring(init, as_string(x)->value, as_string(x)->len);
+		init.printf(", %u);\n", (unsigned) as_string(x)->len);
+	}
+	else if (is_bignum(x))
+		init.printf("\tlit[%u] = native_bignum(\"%s\");\n", nlits,
+		            bignum_to_string(as_bignum(x)));
+	else
+		error(Error(), "compile-to-cpp: value cannot be compiled");
+	lits->insert(x, make_fixnum(nlits));
+	return nlits++;
+}
+
+/*
+  A procedure spliced into code by a macro is found by its global name,
+  as in a fasl file, which it can't be inside quoted data made before
+  the program runs.
+*/
+void
+AotUnit::literal(Value x, Text &out, bool nested)
+{
+	if (is_nil(x))
+		out.printf("NIL");
+	else if (x == _T)
+		out.printf("_T");
+	else if (x == _F)
+		out.printf("_F");
+	else if (is_eof(x))
+		out.printf("_EOF");
+	else if (is_undefined(x))
+		out.printf("UNDEFINED");
+	else if (is_fixnum(x))
+		out.printf("make_fixnum(%lldLL)", (long long) as_fixnum(x));
+	else if (is_char(x))
+		out.printf("make_char(%u)", (unsigned) as_char(x));
+	else if (is_flonum(x)) {
+		double d = as_flonum(x);
+		if (isnan(d))
+			out.printf("make_flonum(NAN)");
+		else if (isinf(d))
+			out.printf("make_flonum(%sHUGE_VAL)", d < 0 ? "-" : "");
+		else
+			out.printf("make_flonum(%.17g)", d);
+	}
+	else if (is_symbol(x))
+		out.printf("sym[%u]", symbol(as_symbol(x)));
+	else if (!nested && is_procedure(x) && as_procedure(x)->name
+	         && mod->lookup(as_procedure(x)->name)->value == x) {
+		Symbol *name = as_procedure(x)->name;
+		out.printf("native_global(mod, &glob[%u], sym[%u])",
+		           global(name), symbol(name));
+	}
+	else
+		out.printf("lit[%u]", lit_slot(x));
+}
+
+/* a parameter, or a copy of a variable captured from an outer lambda */
+void
+AotUnit::local(AotFn *fn, unsigned level, unsigned offset, Text &out)
+{
+	if (fn->toplevel)
+		error(Error(), "compile-to-cpp: variable outside any lambda");
+	if (level == 0) {
+		out.printf("a%u", offset);
+		return;
+	}
+	unsigned i = fn->ncaps;
+	for (Value p = fn->caps; is_pair(p); p = cdr(p)) {
+		i--;
+		if (as_fixnum(car(car(p))) == (Fixnum) level
+		    && as_fixnum(cdr(car(p))) == (Fixnum) offset)
+			goto found;
+	}
+	i = fn->ncaps++;
+	fn->caps = cons(cons(make_fixnum(level), make_fixnum(offset)),
+	                fn->caps);
+found:
+	out.printf("cap[%u]", i);
+}
+
+static bool
+is_leaf(Expr *exp)
+{
+	return exp->type == Expr::LIT || exp->type == Expr::LOCAL_REF
+	    || exp->type == Expr::MODULE_REF || exp->type == Expr::MACRO_REF;
+}
+
+void
+AotUnit::leaf(AotFn *fn, Expr *exp, Text &out)
+{
+	switch (exp->type) {
+	case Expr::LIT:
+		literal(((Lit *) exp)->value, out, false);
+		break;
+	case Expr::LOCAL_REF: {
+		LocalRef *ref = (LocalRef *) exp;
+		local(fn, ref->level, ref->offset, out);
+		break;
+		}
+	case Expr::MODULE_REF: {
+		Symbol *name = ((ModuleRef *) exp)->name;
+		out.printf("native_global(mod, &glob[%u], sym[%u])",
+		           global(name), symbol(name));
+		break;
+		}
+	case Expr::MACRO_REF:
+		out.printf("native_macro(mod, sym[%u])",
+		           symbol(((ModuleRef *) exp)->name));
+		break;
+	default:
+		break;
+	}
+}
+
+/* declares var holding the value of exp */
+void
+AotUnit::into(AotFn *fn, Expr *exp, const char *var)
+{
+	if (is_leaf(exp)) {
+		Text x;
+		leaf(fn, exp, x);
+		fn->line("Value %s = %s;", var, x.str());
+		return;
+	}
+	char dest[32];
+	snprintf(dest, sizeof(dest), "%s = ", var);
+	fn->line("Value %s;", var);
+	emit(fn, exp, dest);
+}
+
+/* the code for exp, its value going to dest */
+void
+AotUnit::emit(AotFn *fn, Expr *exp, const char *dest)
+{
+	char a[32], b[32], c[32];
+	unsigned t = 0;
+
+	switch (exp->type) {
+	case Expr::LIT:
+	case Expr::LOCAL_REF:
+	case Expr::MODULE_REF:
+	case Expr::MACRO_REF: {
+		if (dest == to_discard && (exp->type == Expr::LIT
+		                        || exp->type == Expr::LOCAL_REF))
+			return;
+		Text x;
+		leaf(fn, exp, x);
+		fn->line("%s%s;", dest, x.str());
+		return;
+		}
+	case Expr::COND: {
+		Cond *cond = (Cond *) exp;
+		snprintf(a, sizeof(a), "t%u", fn->temp());
+		into(fn, cond->pred, a);
+		fn->line("if (%s != _F) {", a);
+		fn->depth++;
+		emit(fn, cond->then, dest);
+		fn->depth--;
+		fn->line("}");
+		fn->line("else {");
+		fn->depth++;
+		emit(fn, cond->other, dest);
+		fn->depth--;
+		fn->line("}");
+		return;
+		}
+	case Expr::SEQ: {
+		Seq *seq = (Seq *) exp;
+		if (seq->count == 0) {
+			if (dest != to_discard)
+				fn->line("%sNIL;", dest);
+			return;
+		}
+		for (unsigned i = 0; i + 1 < seq->count; i++)
+			emit(fn, seq->expr[i], to_discard);
+		emit(fn, seq->expr[seq->count - 1], dest);
+		return;
+		}
+	case Expr::APP:
+		emit_app(fn, (App *) exp, dest);
+		return;
+	case Expr::ABS:
+		emit_abs(fn, (Abs *) exp, dest);
+		return;
+	case Expr::DEFINE: {
+		Define *def = (Define *) exp;
+		snprintf(a, sizeof(a), "t%u", fn->temp());
+		into(fn, def->value, a);
+		if (def == proc_def)
+			fn->line("fobj[%u] = %s;", proc_id, a);
+		fn->line("glob[%u] = native_define(mod, sym[%u], %s);",
+		         global(def->name), symbol(def->name), a);
+		if (dest != to_discard)
+			fn->line("%s%s;", dest, a);
+		return;
+		}
+	case Expr::DEFINE_MACRO: {
+		DefineMacro *def = (DefineMacro *) exp;
+		snprintf(a, sizeof(a), "t%u", fn->temp());
+		into(fn, def->body, a);
+		fn->line("%snative_define_macro(mod, sym[%u], %s);", dest,
+		         symbol(def->name), a);
+		return;
+		}
+	case Expr::SLOT_REF: {
+		SlotRef *sref = (SlotRef *) exp;
+		t = fn->temp();
+		snprintf(a, sizeof(a), "f%u", t);
+		snprintf(b, sizeof(b), "r%u", t);
+		into(fn, sref->fun, a);
+		into(fn, sref->rec, b);
+		fn->line("%snative_slot_ref(%s, %s);", dest, a, b);
+		return;
+		}
+	case Expr::SLOT_SET: {
+		SlotSet *sset = (SlotSet *) exp;
+		t = fn->temp();
+		snprintf(a, sizeof(a), "f%u", t);
+		snprintf(b, sizeof(b), "r%u", t);
+		snprintf(c, sizeof(c), "v%u", t);
+		into(fn, sset->fun, a);
+		into(fn, sset->rec, b);
+		into(fn, sset->value, c);
+		fn->line("%snative_slot_set(%s, %s, %s);", dest, a, b, c);
+		return;
+		}
+	case Expr::VECTOR_REF: {
+		VectorRef *vref = (VectorRef *) exp;
+		t = fn->temp();
+		snprintf(a, sizeof(a), "f%u", t);
+		snprintf(b, sizeof(b), "v%u", t);
+		snprintf(c, sizeof(c), "i%u", t);
+		into(fn, vref->fun, a);
+		into(fn, vref->vec, b);
+		into(fn, vref->index, c);
+		fn->line("%snative_vector_ref(%s, %s, %s);", dest, a, b, c);
+		return;
+		}
+	case Expr::FUSED:
+		emit(fn, ((Fused *) exp)->unfused, dest);
+		return;
+	case Expr::CASE:
+		emit_case(fn, (Case *) exp, dest);
+		return;
+	case Expr::LAZY:
+		emit(fn, compile_lazy((Lazy *) exp), dest);
+		return;
+	}
+}
+
+/*
+  Arguments go into an array on the stack, as the CCProcedure entry
+  points take them. A self call in tail position assigns the
+  parameters and jumps back to the start of the function.
+*/
+void
+AotUnit::emit_app(AotFn *fn, App *app, const char *dest)
+{
+	unsigned n = app->args->count, t = fn->temp();
+	char f[32], av[32], argv[32];
+	snprintf(f, sizeof(f), "f%u", t);
+	snprintf(av, sizeof(av), "av%u", t);
+	snprintf(argv, sizeof(argv), "%s", n ? av : "0");
+
+	into(fn, app->fun, f);
+	if (n)
+		fn->line("Value %s[%u];", av, n);
+	for (unsigned i = 0; i < n; i++) {
+		char d[40];
+		snprintf(d, sizeof(d), "%s[%u] = ", av, i);
+		emit(fn, app->args->expr[i], d);
+	}
+
+	Symbol *name = app->fun->type == Expr::MODULE_REF
+		? ((ModuleRef *) app->fun)->name : 0;
+	for (unsigned op = 0; name && op < NUM_OPS; op++) {
+		if (name->len != strlen(inline_ops[op].name)
+		    || memcmp(name->value, inline_ops[op].name, name->len) != 0)
+			continue;
+		if (!native_arity_ok(inline_ops[op].arity, n))
+			break;
+		Text x;
+		switch (op) {
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL: {
+			const char *fun = op == OP_ADD ? "num_add"
+				: op == OP_SUB ? "num_sub" : "num_mul";
+			for (unsigned i = 1; i < n; i++)
+				x.printf("%s(", fun);
+			x.printf("%s[0]", av);
+			for (unsigned i = 1; i < n; i++)
+				x.printf(", %s[%u])", av, i);
+			break;
+			}
+		case OP_LT:
+		case OP_GT: {
+			const char *cmp = op == OP_LT ? "<" : ">";
+			x.printf("make_bool(is_fixnum(%s[0]) && is_fixnum(%s[1])"
+			         " ? as_fixnum(%s[0]) %s as_fixnum(%s[1])"
+			         " : compare(%s[0], %s[1]) %s 0)",
+			         av, av, av, cmp, av, av, av, cmp);
+			break;
+			}
+		case OP_EQV:
+			x.printf("make_bool(%s[0] == %s[1]"
+			         " || num_eqv(%s[0], %s[1]))", av, av, av, av);
+			break;
+		case OP_NOT:
+			x.printf("make_bool(%s[0] == _F)", av);
+			break;
+		}
+		fn->line("%s(%s == prim[%u] ? %s : native_call(%s, %u, %s));",
+		         dest, f, prim((InlineOp) op), x.str(), f, n, argv);
+		return;
+	}
+
+	Value *slot = name ? procs->lookup(name) : 0;
+	if (slot && is_fixnum(*slot)) {
+		unsigned id = as_fixnum(*slot);
+		Abs *abs = proc_abs[id];
+		if (dest == to_return && id == fn->id && !fn->toplevel
+		    && abs->arity >= 0 && n == (unsigned) abs->arity) {
+			fn->line("if (%s == fobj[%u]) {", f, id);
+			for (unsigned i = 0; i < n; i++)
+				fn->line("\ta%u = %s[%u];", i, av, i);
+			fn->line("\tgoto top;");
+			fn->line("}");
+			fn->loops = true;
+		}
+		else if (native_arity_ok(abs->arity, n)) {
+			fn->line("%s(%s == fobj[%u] ? fn%u(as_ptr(%s), %u, %s)"
+			         " : native_call(%s, %u, %s));", dest, f, id, id,
+			         f, n, argv, f, n, argv);
+			return;
+		}
+	}
+	fn->line("%snative_call(%s, %u, %s);", dest, f, n, argv);
+}
+
+/* the arms of the case, numbered, are chosen by native_case_arm() */
+void
+AotUnit::emit_case(AotFn *fn, Case *c, const char *dest)
+{
+	char key[32];
+	snprintf(key, sizeof(key), "k%u", fn->temp());
+	into(fn, c->key, key);
+
+	Text keys;
+	literal(c->keys, keys, true);
+	init.printf("\tcases[%u] = native_case(%s, %u);\n", ncases,
+	            keys.str(), c->arms->count);
+
+	fn->line("switch (native_case_arm(cases[%u], %s)) {", ncases++, key);
+	for (unsigned i = 0; i <= c->arms->count; i++) {
+		if (i < c->arms->count)
+			fn->line("case %u: {", i);
+		else
+			fn->line("default: {");
+		fn->depth++;
+		emit(fn, i < c->arms->count ? c->arms->expr[i] : c->other, dest);
+		if (dest != to_return)
+			fn->line("break;");
+		fn->depth--;
+		fn->line("}");
+	}
+	fn->line("}");
+}
+
+/* the function is written out first, then the closure made here */
+void
+AotUnit::emit_abs(AotFn *fn, Abs *abs, const char *dest)
+{
+	AotFn sub(fn, proc_def && abs == proc_def->value ? proc_id : nfns++,
+	          abs->arity);
+	function(&sub, abs, proc_def && abs == proc_def->value
+	                    ? proc_def->name : 0);
+
+	char caps[32] = "0";
+	if (sub.ncaps) {
+		Text x;
+		unsigned i = 0;
+		for (Value p = reverse(sub.caps); is_pair(p); p = cdr(p), i++) {
+			if (i)
+				x.put(", ", 2);
+			local(fn, as_fixnum(car(car(p))) - 1,
+			      as_fixnum(cdr(car(p))), x);
+		}
+		snprintf(caps, sizeof(caps), "c%u", fn->temp());
+		fn->line("Value %s[] = {%s};", caps, x.str());
+	}
+	fn->line("%snative_closure(fn%u, %d, %u, %s);", dest, sub.id,
+	         abs->arity, sub.ncaps, caps);
+}
+
+void
+AotUnit::function(AotFn *fn, Abs *abs, Symbol *name)
+{
+	Expr *body = abs->body;
+	if (body->type == Expr::LAZY)
+		body = compile_lazy((Lazy *) body);
+	emit(fn, body, to_return);
+
+	protos.printf("static Value fn%u(void *, unsigned, Value *);\n",
+	              fn->id);
+	if (name && !strstr(name->value, "*/"))
+		funcs.printf("/* %.*s */\n", (int) name->len, name->value);
+	funcs.printf("static Value\nfn%u(UNUSED void *self, "
+	             "UNUSED unsigned nargs, UNUSED Value *arg)\n{\n", fn->id);
+	if (fn->ncaps)
+		funcs.printf("\tValue *cap = ((NativeProcedure *) self)->cap;\n");
+	unsigned n = fn->nparams();
+	for (unsigned i = 0; i < n; i++) {
+		if (abs->arity < 0 && i == n - 1)
+			funcs.printf("\tValue a%u UNUSED = native_rest(nargs, arg, %u);\n",
+			             i, i);
+		else
+			funcs.printf("\tValue a%u UNUSED = arg[%u];\n", i, i);
+	}
+	if (fn->loops)
+		funcs.printf("top:\n");
+	funcs.add(fn->body);
+	funcs.printf("}\n\n");
+}
+
+/* toplevel procedures are numbered first, in the order added */
+void
+AotUnit::finish()
+{
+	nfns = nprocs;
+	unsigned id = 0;
+	for (unsigned i = 0; i < nforms; i++) {
+		proc_def = is_proc_define(forms[i]) ? (Define *) forms[i] : 0;
+		proc_id = id;
+		if (proc_def)
+			id++;
+		emit(&top, forms[i], to_discard);
+	}
+	proc_def = 0;
+}
+
+static void
+table(FILE *out, const char *decl, unsigned n)
+{
+	if (n)
+		fprintf(out, "static %s[%u];\n", decl, n);
+}
+
+void
+AotUnit::write(FILE *out)
+{
+	fputs("/* compiled by amp --compile-to-cpp */\n\n"
+	      "#include \"native.h\"\n\n"
+	      "static Module *mod;\n", out);
+	table(out, "Symbol *sym", nsyms);
+	table(out, "ModuleRef *glob", nglobs);
+	table(out, "Value lit", nlits);
+	table(out, "Value prim", nprims);
+	table(out, "Value fobj", nprocs);
+	table(out, "Case *cases", ncases);
+	fprintf(out, "\n%s\n%s", protos.str(), funcs.str());
+	fprintf(out, "static void\nrun_unit(void)\n{\n%s}\n\n", top.body.str());
+	fprintf(out, "static void\ninit_unit(Module *m)\n{\n"
+	             "\tmod = m;\n%s}\n\n", init.str());
+	fputs("int\nmain(int argc, char *argv[])\n{\n"
+	      "\treturn native_main(argc, argv, init_unit, run_unit);\n}\n",
+	      out);
+}
+
+/*
+  Definitions of macros and procedures are run as they are compiled,
+  so that macros and the procedures they call are there to expand the
+  forms after them.
+*/
+/* what later forms may need to expand: macros and definitions, those a
+   macro expands to inside a begin included; nothing else is run */
+static void
+run_definitions(Expr *exp)
+{
+	switch (exp->type) {
+	case Expr::DEFINE:
+	case Expr::DEFINE_MACRO:
+		execute(exp);
+		break;
+	case Expr::SEQ: {
+		Seq *seq = (Seq *) exp;
+		for (unsigned i = 0; i < seq->count; i++)
+			run_definitions(seq->expr[i]);
+		break;
+		}
+	default:
+		break;
+	}
+}
+
+bool
+compile_to_cpp(Module *mod, int nfiles, const char *const files[],
+               const char *output)
+{
+	AotUnit unit(mod);
+	try {
+		for (int i = 0; i < nfiles; i++) {
+			FileParser p(files[i]);
+			SourceMap *sources = new SourceMap(
+				make_string(files[i], strlen(files[i])));
+			p.track(sources);
+			while (!p.eof()) {
+				Expr *exp = compile(p.parse(), mod, sources);
+				unit.add(exp);
+				run_definitions(exp);
+			}
+		}
+		unit.finish();
+	}
+	catch (Error&) {
+		return false;
+	}
+	catch (Exit&) {
+		fprintf(stderr, "amp: %s: exit while compiling\n", output);
+		return false;
+	}
+
+	FILE *out = fopen(output, "w");
+	if (!out) {
+		perror(output);
+		return false;
+	}
+	unit.write(out);
+	if (fclose(out) != 0) {
+		perror(output);
+		unlink(output);
+		return false;
+	}
+	return true;
+}
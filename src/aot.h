@@ -0,0 +1,17 @@
+#ifndef SRC_AOT_H
+#define SRC_AOT_H
+
+/*
+  Ahead-of-time compilation of a program to a C++ source file, which
+  built against libamp.a with native.h is a standalone executable
+  running the same forms in the same order, boot.lisp's included.
+  Files are compiled as they are loaded, in the module given, and their
+  macros and definitions, those inside a begin included, are also run,
+  so that later forms expand as they would in the interpreter. Nothing
+  else runs while compiling.
+*/
+extern bool
+compile_to_cpp(Module *mod, int nfiles, const char *const files[],
+               const char *output);
+
+#endif /* SRC_AOT_H */
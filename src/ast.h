@@ -1,7 +1,8 @@
 struct Expr : GC_object {
 	enum ExprType {
 		APP, ABS, SEQ, COND, LIT, LOCAL_REF, MODULE_REF,
-		MACRO_REF, DEFINE, DEFINE_MACRO
+		MACRO_REF, DEFINE, DEFINE_MACRO, SLOT_REF, SLOT_SET, LAZY,
+		VECTOR_REF, FUSED, CASE
 	} type;
 	Expr(ExprType type) : type(type) {}
 };
@@ -19,11 +20,22 @@ struct App : Expr {
 
 struct Abs : Expr {
 	int arity;
-	Seq *body;
-	Abs(unsigned arity, Seq *body)
+	Expr *body;
+	Abs(unsigned arity, Expr *body)
 		: Expr(ABS), arity(arity), body(body)  {}
 };
 
+/* toplevel procedure body, compiled on first application */
+struct Lazy : Expr {
+	Module *mod;
+	Value formals, source;
+	SourceMap *sources;
+	Seq *body;
+	Lazy(Module *mod, Value formals, Value source, SourceMap *sources)
+		: Expr(LAZY), mod(mod), formals(formals), source(source),
+		sources(sources), body(0) {}
+};
+
 struct Cond : Expr {
 	Expr *pred, *then, *other;
 	Cond(Expr *pred, Expr *then, Expr *other)
@@ -64,3 +76,100 @@ struct DefineMacro : Expr {
 	DefineMacro(Module *mod, Symbol *name, Abs *body)
 		: Expr(DEFINE_MACRO), mod(mod), name(name), body(body) {}
 };
+
+/* inlined call to a record accessor, guarded by the binding's value */
+struct SlotRef : Expr {
+	ModuleRef *fun;
+	Accessor *proc;
+	Expr *rec;
+	SlotRef(ModuleRef *fun, Accessor *proc, Expr *rec)
+		: Expr(SLOT_REF), fun(fun), proc(proc), rec(rec) {}
+};
+
+/* inlined call to a record mutator, guarded by the binding's value */
+struct SlotSet : Expr {
+	ModuleRef *fun;
+	Mutator *proc;
+	Expr *rec, *value;
+	SlotSet(ModuleRef *fun, Mutator *proc, Expr *rec, Expr *value)
+		: Expr(SLOT_SET), fun(fun), proc(proc), rec(rec), value(value) {}
+};
+
+/* inlined vector-ref, guarded by the binding's value */
+struct VectorRef : Expr {
+	ModuleRef *fun;
+	Value proc;
+	Expr *vec, *index;
+	VectorRef(ModuleRef *fun, Value proc, Expr *vec, Expr *index)
+		: Expr(VECTOR_REF), fun(fun), proc(proc), vec(vec), index(index) {}
+};
+
+/* operator of a fused pipeline, guarded by the binding's value */
+struct FusedOp {
+	ModuleRef *ref;
+	Value proc;
+	ListOp op;
+	Expr *fun;
+};
+
+/*
+  Fold over a chain of map and filter stages, fed by a range or a list,
+  run as one loop. The operators are held outermost first. If the
+  outermost is not a fold the result is collected into a list. The
+  unfused form runs instead when any binding has changed.
+*/
+struct Fused : Expr {
+	Expr *unfused;
+	Expr *init;
+	Expr *list, *from, *to;
+	unsigned nops;
+	FusedOp op[];
+};
+
+/*
+  Branch on a key compared with constants. When every constant is a
+  fixnum in a small range the key indexes the jump table directly;
+  otherwise the constants are placed in a table by a multiplicative
+  hash of their bits, with a multiplier chosen to put each in its own
+  slot where one can be found. Boxed numbers, which are eqv? without
+  being identical, are searched in a list instead.
+*/
+struct Case : Expr {
+	Expr *key, *other;
+	Seq *arms;
+	Value keys;       /* ((constant . arm) ...) as written */
+	Value boxed;      /* ((number . arm) ...) */
+	Value *slot;      /* hashed constants, or 0 for a dense table */
+	Expr **jump;
+	Fixnum min;
+	uintptr_t mult;
+	unsigned shift, size, probe;
+	Case(Expr *key, Seq *arms, Value keys, Expr *other)
+		: Expr(CASE), key(key), other(other), arms(arms), keys(keys),
+		boxed(NIL), slot(0), jump(0), min(0), mult(0), shift(0),
+		size(0), probe(0) {}
+};
+
+static inline uintptr_t
+case_hash(const Case *c, Value key)
+{
+	return key._bits() * c->mult >> c->shift;
+}
+
+extern Seq *
+make_seq(unsigned count);
+
+extern Case *
+make_case(Expr *key, Seq *arms, Value keys, Expr *other);
+
+extern Expr *
+case_branch(Case *c, Value key);
+
+extern Fused *
+make_fused(unsigned nops);
+
+extern Expr *
+unfuse(Fused *fused);
+
+extern Seq *
+compile_lazy(Lazy *lazy);
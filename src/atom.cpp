@@ -11,13 +11,14 @@ static Dict symbols;
 Symbol
 	*sym_quote, *sym_quasiquote, *sym_unquote, *sym_unquote_splicing,
 	*sym_lambda, *sym_if, *sym_begin, *sym_define, *sym_define_macro,
+	*sym_and, *sym_or, *sym_cond, *sym_when, *sym_assert, *sym_case,
 	*sym_at_lambda, *sym_at_constructor, *sym_at_accessor, *sym_at_mutator,
 	*sym_this_module;
 
 String::String(const char *str, size_t len, TypeCode typecode)
 	: Object(typecode), len(len)
 {
-	if (is_static(str))
+	if (is_static(str) && str[len] == 0)
 		this->value = str;
 	else {
 		char *p = (char *) GC_MALLOC_ATOMIC(len+1);
@@ -42,6 +43,18 @@ make_symbol(const char *str)
 	return sym;
 }
 
+/* symbol named by the len bytes at str, from a span of source text */
+Symbol *
+make_symbol(const char *str, size_t len)
+{
+	Symbol *sym = (Symbol *) symbols.lookup(str, len);
+	if (!sym) {
+		sym = new Symbol(str, len);
+		symbols.define(sym->value, sym);
+	}
+	return sym;
+}
+
 INIT {
 	sym_quote = make_symbol("quote");
 	sym_quasiquote = make_symbol("quasiquote");
@@ -52,6 +65,12 @@ INIT {
 	sym_begin = make_symbol("begin");
 	sym_define = make_symbol("define");
 	sym_define_macro = make_symbol("define-macro");
+	sym_and = make_symbol("and");
+	sym_or = make_symbol("or");
+	sym_cond = make_symbol("cond");
+	sym_when = make_symbol("when");
+	sym_assert = make_symbol("assert");
+	sym_case = make_symbol("case");
 	sym_at_lambda = make_symbol("@lambda");
 	sym_at_constructor = make_symbol("@constructor");
 	sym_at_accessor = make_symbol("@accessor");
@@ -0,0 +1,555 @@
+/*
+  bignum.cpp - Arbitrary precision integers
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include "lisp.h"
+#include "number.h"
+#include "util.h"
+
+typedef uint32_t digit_t;
+typedef uint64_t ddigit_t;
+
+#define DIGIT_BITS 32
+#define KARATSUBA_CUTOFF 32
+
+/* integer operand as sign and magnitude; fixnums use the inline buffer */
+struct Int {
+	const digit_t *d;
+	size_t len;
+	bool neg;
+	digit_t buf[sizeof(Fixnum) / sizeof(digit_t)];
+	Int(Value x);
+};
+
+Int::Int(Value x)
+{
+	if (is_fixnum(x)) {
+		Fixnum n = as_fixnum(x);
+		ddigit_t m = n < 0 ? -(ddigit_t)n : (ddigit_t)n;
+		neg = n < 0;
+		for (len = 0; m; m >>= DIGIT_BITS)
+			buf[len++] = (digit_t)m;
+		d = buf;
+	}
+	else {
+		Bignum *b = as_bignum(x);
+		d = b->digit;
+		len = b->len;
+		neg = b->neg;
+	}
+}
+
+static Bignum *
+make_bignum(size_t len, bool neg)
+{
+	Bignum *b = (Bignum *) Object::new_atomic(
+		sizeof(Bignum) + len * sizeof(digit_t));
+	b->init_hdr(TC_BIGNUM);
+	b->len = len;
+	b->neg = neg;
+	return b;
+}
+
+/* strip leading zeros and demote to a fixnum if it fits */
+static Value
+normalize(Bignum *b)
+{
+	while (b->len && !b->digit[b->len-1])
+		b->len--;
+	if (b->len <= 2) {
+		ddigit_t m = 0;
+		for (size_t i = b->len; i-- > 0; )
+			m = m << DIGIT_BITS | b->digit[i];
+		if (m <= (ddigit_t)FIXNUM_MAX)
+			return make_fixnum(b->neg ? -(Fixnum)m : (Fixnum)m);
+		if (b->neg && m == (ddigit_t)FIXNUM_MAX + 1)
+			return make_fixnum(FIXNUM_MIN);
+	}
+	return b;
+}
+
+/*
+  Magnitude operations on little-endian digit arrays.
+*/
+
+static int
+mag_cmp(const digit_t *a, size_t al, const digit_t *b, size_t bl)
+{
+	while (al && !a[al-1])
+		al--;
+	while (bl && !b[bl-1])
+		bl--;
+	if (al != bl)
+		return al < bl ? -1 : 1;
+	while (al--)
+		if (a[al] != b[al])
+			return a[al] < b[al] ? -1 : 1;
+	return 0;
+}
+
+/* r[0..al] = a + b, al >= bl */
+static void
+mag_add(digit_t *r, const digit_t *a, size_t al, const digit_t *b, size_t bl)
+{
+	ddigit_t carry = 0;
+	size_t i;
+
+	for (i = 0; i < bl; i++) {
+		carry += (ddigit_t)a[i] + b[i];
+		r[i] = (digit_t)carry;
+		carry >>= DIGIT_BITS;
+	}
+	for (; i < al; i++) {
+		carry += a[i];
+		r[i] = (digit_t)carry;
+		carry >>= DIGIT_BITS;
+	}
+	r[al] = (digit_t)carry;
+}
+
+/* r[0..al) = a - b, a >= b */
+static void
+mag_sub(digit_t *r, const digit_t *a, size_t al, const digit_t *b, size_t bl)
+{
+	digit_t borrow = 0;
+	size_t i;
+
+	for (i = 0; i < bl; i++) {
+		ddigit_t t = (ddigit_t)a[i] - b[i] - borrow;
+		r[i] = (digit_t)t;
+		borrow = (t >> DIGIT_BITS) & 1;
+	}
+	for (; i < al; i++) {
+		ddigit_t t = (ddigit_t)a[i] - borrow;
+		r[i] = (digit_t)t;
+		borrow = (t >> DIGIT_BITS) & 1;
+	}
+}
+
+/* r[0..rl) += a[0..al), carry propagating within r */
+static void
+mag_add_into(digit_t *r, size_t rl, const digit_t *a, size_t al)
+{
+	ddigit_t carry = 0;
+	size_t i;
+
+	while (al && !a[al-1])
+		al--;
+	for (i = 0; i < al; i++) {
+		carry += (ddigit_t)r[i] + a[i];
+		r[i] = (digit_t)carry;
+		carry >>= DIGIT_BITS;
+	}
+	for (; carry && i < rl; i++) {
+		carry += r[i];
+		r[i] = (digit_t)carry;
+		carry >>= DIGIT_BITS;
+	}
+}
+
+static void
+mag_mul_school(digit_t *r, const digit_t *a, size_t al,
+               const digit_t *b, size_t bl)
+{
+	memset(r, 0, (al + bl) * sizeof(digit_t));
+	for (size_t i = 0; i < al; i++) {
+		ddigit_t carry = 0;
+		for (size_t j = 0; j < bl; j++) {
+			carry += (ddigit_t)a[i] * b[j] + r[i+j];
+			r[i+j] = (digit_t)carry;
+			carry >>= DIGIT_BITS;
+		}
+		r[i+bl] = (digit_t)carry;
+	}
+}
+
+static digit_t *
+alloc_digits(size_t n)
+{
+	digit_t *p = (digit_t *) malloc(n * sizeof(digit_t));
+	if (!p)
+		error(FatalError(), "out of memory");
+	return p;
+}
+
+/* r[0..al+bl) = a * b, Karatsuba above the cutoff */
+static void
+mag_mul(digit_t *r, const digit_t *a, size_t al, const digit_t *b, size_t bl)
+{
+	if (al < bl) {
+		const digit_t *t = a; a = b; b = t;
+		size_t tl = al; al = bl; bl = tl;
+	}
+	if (bl < KARATSUBA_CUTOFF) {
+		mag_mul_school(r, a, al, b, bl);
+		return;
+	}
+
+	size_t m = (al + 1) / 2;
+	if (bl <= m) {
+		/* unbalanced: multiply b by bl-sized chunks of a */
+		malloc_ptr<digit_t> t = alloc_digits(2 * bl);
+		memset(r, 0, (al + bl) * sizeof(digit_t));
+		for (size_t k = 0; k < al; k += bl) {
+			size_t n = al - k < bl ? al - k : bl;
+			mag_mul(t, a + k, n, b, bl);
+			mag_add_into(r + k, al + bl - k, t, n + bl);
+		}
+		return;
+	}
+
+	/* a*b = z2 B^2m + (z1 - z2 - z0) B^m + z0 */
+	malloc_ptr<digit_t> sa = alloc_digits(m + 1);
+	malloc_ptr<digit_t> sb = alloc_digits(m + 1);
+	malloc_ptr<digit_t> z1 = alloc_digits(2 * m + 2);
+	mag_add(sa, a, m, a + m, al - m);
+	mag_add(sb, b, m, b + m, bl - m);
+	mag_mul(z1, sa, m + 1, sb, m + 1);
+	mag_mul(r, a, m, b, m);
+	mag_mul(r + 2*m, a + m, al - m, b + m, bl - m);
+	mag_sub(z1, z1, 2*m + 2, r, 2*m);
+	mag_sub(z1, z1, 2*m + 2, r + 2*m, al + bl - 2*m);
+	mag_add_into(r + m, al + bl - m, z1, 2*m + 2);
+}
+
+/* q = u / v for a single digit v, returning the remainder */
+static digit_t
+mag_divmod1(digit_t *q, const digit_t *u, size_t ul, digit_t v)
+{
+	ddigit_t rem = 0;
+	for (size_t i = ul; i-- > 0; ) {
+		rem = rem << DIGIT_BITS | u[i];
+		q[i] = (digit_t)(rem / v);
+		rem %= v;
+	}
+	return (digit_t)rem;
+}
+
+/*
+  Knuth's algorithm D: q[0..m-n] = u / v, r[0..n) = u % v,
+  where m >= n >= 2 and v has no leading zero.
+*/
+static void
+mag_divmod(digit_t *q, digit_t *r, const digit_t *u, size_t m,
+           const digit_t *v, size_t n)
+{
+	const ddigit_t B = (ddigit_t)1 << DIGIT_BITS;
+	int s = __builtin_clz(v[n-1]);
+	malloc_ptr<digit_t> vn = alloc_digits(n);
+	malloc_ptr<digit_t> un = alloc_digits(m + 1);
+
+	/* normalise so the top digit of v has its high bit set */
+	for (size_t i = n-1; i > 0; i--)
+		vn[i] = (digit_t)(((ddigit_t)v[i] << DIGIT_BITS | v[i-1])
+		                  >> (DIGIT_BITS - s));
+	vn[0] = v[0] << s;
+	un[m] = (digit_t)((ddigit_t)u[m-1] >> (DIGIT_BITS - s));
+	for (size_t i = m-1; i > 0; i--)
+		un[i] = (digit_t)(((ddigit_t)u[i] << DIGIT_BITS | u[i-1])
+		                  >> (DIGIT_BITS - s));
+	un[0] = u[0] << s;
+
+	for (size_t j = m - n + 1; j-- > 0; ) {
+		ddigit_t num = (ddigit_t)un[j+n] << DIGIT_BITS | un[j+n-1];
+		ddigit_t qhat = num / vn[n-1];
+		ddigit_t rhat = num - qhat * vn[n-1];
+		while (qhat >= B || qhat * vn[n-2]
+		                    > (rhat << DIGIT_BITS | un[j+n-2])) {
+			qhat--;
+			rhat += vn[n-1];
+			if (rhat >= B)
+				break;
+		}
+
+		/* multiply and subtract */
+		int64_t k = 0, t;
+		for (size_t i = 0; i < n; i++) {
+			ddigit_t p = qhat * vn[i];
+			t = (int64_t)un[i+j] - k - (int64_t)(p & 0xFFFFFFFF);
+			un[i+j] = (digit_t)t;
+			k = (int64_t)(p >> DIGIT_BITS) - (t >> DIGIT_BITS);
+		}
+		t = (int64_t)un[j+n] - k;
+		un[j+n] = (digit_t)t;
+
+		q[j] = (digit_t)qhat;
+		if (t < 0) {
+			/* add back */
+			q[j]--;
+			ddigit_t c = 0;
+			for (size_t i = 0; i < n; i++) {
+				c += (ddigit_t)un[i+j] + vn[i];
+				un[i+j] = (digit_t)c;
+				c >>= DIGIT_BITS;
+			}
+			un[j+n] += (digit_t)c;
+		}
+	}
+
+	for (size_t i = 0; i < n; i++)
+		r[i] = (digit_t)(((ddigit_t)un[i+1] << DIGIT_BITS | un[i]) >> s);
+}
+
+/*
+  Signed operations.
+*/
+
+static void
+check_integer(Value x, const char *op)
+{
+	if (!is_integer(x))
+		type_error(op);
+}
+
+static bool
+check_flonum_args(Value x, Value y, const char *op)
+{
+	if (!is_number(x) || !is_number(y))
+		type_error(op);
+	return is_flonum(x) || is_flonum(y);
+}
+
+double
+num_to_double(Value x)
+{
+	if (is_fixnum(x))
+		return as_fixnum(x);
+	if (is_flonum(x))
+		return as_flonum(x);
+	check_integer(x, "exact->inexact");
+	Bignum *b = as_bignum(x);
+	double d = 0;
+	for (size_t i = b->len; i-- > 0; )
+		d = ldexp(d, DIGIT_BITS) + b->digit[i];
+	return b->neg ? -d : d;
+}
+
+/* integer part of a finite double */
+Value
+num_from_double(double d)
+{
+	if (!std::isfinite(d))
+		type_error("inexact->exact");
+	d = trunc(d);
+	if (d >= -(double)FIXNUM_MAX && d <= (double)FIXNUM_MAX)
+		return make_fixnum((Fixnum)d);
+	int exp;
+	double m = frexp(fabs(d), &exp);
+	size_t len = (exp + DIGIT_BITS - 1) / DIGIT_BITS;
+	Bignum *r = make_bignum(len, d < 0);
+	memset(r->digit, 0, len * sizeof(digit_t));
+	/* peel off digits from the top, keeping the mantissa exact */
+	for (size_t i = len; i-- > 0 && m != 0; ) {
+		int shift = exp - (int)i * DIGIT_BITS;
+		double top = floor(ldexp(m, shift));
+		r->digit[i] = (digit_t)top;
+		m -= ldexp(top, -shift);
+	}
+	return normalize(r);
+}
+
+Value
+num_from_int64(int64_t n)
+{
+	if (n >= -(int64_t)FIXNUM_MAX && n <= (int64_t)FIXNUM_MAX)
+		return make_fixnum((Fixnum)n);
+	uint64_t m = n < 0 ? -(uint64_t)n : (uint64_t)n;
+	Bignum *r = make_bignum(2, n < 0);
+	r->digit[0] = (digit_t)m;
+	r->digit[1] = (digit_t)(m >> DIGIT_BITS);
+	return normalize(r);
+}
+
+/* integer in the range of int64_t */
+bool
+num_to_int64(Value x, int64_t *n)
+{
+	if (is_fixnum(x)) {
+		*n = as_fixnum(x);
+		return true;
+	}
+	if (!is_bignum(x) || as_bignum(x)->len > 2)
+		return false;
+	Bignum *b = as_bignum(x);
+	uint64_t m = 0;
+	for (size_t i = b->len; i-- > 0; )
+		m = m << DIGIT_BITS | b->digit[i];
+	if (m > (uint64_t)INT64_MAX + b->neg)
+		return false;
+	*n = b->neg ? (int64_t)-m : (int64_t)m;
+	return true;
+}
+
+/* a + b, with the sign of b given separately */
+static Value
+add_signed(const Int &a, const Int &b, bool bneg)
+{
+	if (a.neg == bneg) {
+		const Int &x = a.len >= b.len ? a : b;
+		const Int &y = a.len >= b.len ? b : a;
+		Bignum *r = make_bignum(x.len + 1, a.neg);
+		mag_add(r->digit, x.d, x.len, y.d, y.len);
+		return normalize(r);
+	}
+	if (mag_cmp(a.d, a.len, b.d, b.len) >= 0) {
+		Bignum *r = make_bignum(a.len, a.neg);
+		mag_sub(r->digit, a.d, a.len, b.d, b.len);
+		return normalize(r);
+	}
+	Bignum *r = make_bignum(b.len, bneg);
+	mag_sub(r->digit, b.d, b.len, a.d, a.len);
+	return normalize(r);
+}
+
+Value
+num_add_slow(Value x, Value y)
+{
+	if (check_flonum_args(x, y, "+"))
+		return make_flonum(num_to_double(x) + num_to_double(y));
+	Int a(x), b(y);
+	return add_signed(a, b, b.neg);
+}
+
+Value
+num_sub_slow(Value x, Value y)
+{
+	if (check_flonum_args(x, y, "-"))
+		return make_flonum(num_to_double(x) - num_to_double(y));
+	Int a(x), b(y);
+	return add_signed(a, b, !b.neg);
+}
+
+Value
+num_mul_slow(Value x, Value y)
+{
+	if (check_flonum_args(x, y, "*"))
+		return make_flonum(num_to_double(x) * num_to_double(y));
+	Int a(x), b(y);
+	if (!a.len || !b.len)
+		return make_fixnum(0);
+	Bignum *r = make_bignum(a.len + b.len, a.neg != b.neg);
+	mag_mul(r->digit, a.d, a.len, b.d, b.len);
+	return normalize(r);
+}
+
+/* truncating division, like C */
+static void
+divmod(Value x, Value y, const char *op, Value *quo, Value *rem)
+{
+	check_integer(x, op);
+	check_integer(y, op);
+	Int a(x), b(y);
+	if (!b.len)
+		error(Error(), "division by zero");
+	if (mag_cmp(a.d, a.len, b.d, b.len) < 0) {
+		*quo = make_fixnum(0);
+		*rem = x;
+		return;
+	}
+	Bignum *q = make_bignum(a.len - b.len + 1, a.neg != b.neg);
+	Bignum *r = make_bignum(b.len, a.neg);
+	if (b.len == 1)
+		r->digit[0] = mag_divmod1(q->digit, a.d, a.len, b.d[0]);
+	else
+		mag_divmod(q->digit, r->digit, a.d, a.len, b.d, b.len);
+	*quo = normalize(q);
+	*rem = normalize(r);
+}
+
+Value
+num_div_slow(Value x, Value y)
+{
+	if (check_flonum_args(x, y, "/"))
+		return make_flonum(num_to_double(x) / num_to_double(y));
+	Value q, r;
+	divmod(x, y, "/", &q, &r);
+	return q;
+}
+
+Value
+num_rem_slow(Value x, Value y)
+{
+	if (check_flonum_args(x, y, "remainder"))
+		return make_flonum(fmod(num_to_double(x), num_to_double(y)));
+	Value q, r;
+	divmod(x, y, "remainder", &q, &r);
+	return r;
+}
+
+Value
+num_neg_slow(Value x)
+{
+	if (is_flonum(x))
+		return make_flonum(-as_flonum(x));
+	check_integer(x, "negate");
+	Int a(x);
+	Bignum *r = make_bignum(a.len, !a.neg);
+	memcpy(r->digit, a.d, a.len * sizeof(digit_t));
+	return normalize(r);
+}
+
+int
+num_compare(Value x, Value y)
+{
+	if (is_fixnum(x) && is_fixnum(y))
+		return as_fixnum(x) < as_fixnum(y) ? -1
+		     : as_fixnum(x) > as_fixnum(y);
+	if (check_flonum_args(x, y, "compare")) {
+		double a = num_to_double(x), b = num_to_double(y);
+		return a < b ? -1 : a > b;
+	}
+	Int a(x), b(y);
+	if (a.neg != b.neg)
+		return a.neg ? -1 : 1;
+	int c = mag_cmp(a.d, a.len, b.d, b.len);
+	return a.neg ? -c : c;
+}
+
+/* eqv? on numbers which need not be identical values */
+bool
+num_eqv(Value x, Value y)
+{
+	if (is_bignum(x) && is_bignum(y))
+		return num_compare(x, y) == 0;
+	if (is_flonum(x) && is_flonum(y))
+		return Value::double_bits(as_flonum(x))
+		    == Value::double_bits(as_flonum(y));
+	return false;
+}
+
+/*
+  Decimal representation, converted nine digits at a time. Each pass
+  divides the whole magnitude, so the cost is quadratic in its length;
+  doing better needs division faster than schoolbook, which is not
+  worth it for numbers of the sizes that get printed.
+*/
+char *
+bignum_to_string(Bignum *b)
+{
+	const digit_t CHUNK = 1000000000;
+	size_t len = b->len;
+	malloc_ptr<digit_t> t = alloc_digits(len);
+	malloc_ptr<digit_t> chunks = alloc_digits(len * 10 / 9 + 2);
+	size_t n = 0;
+
+	memcpy(t, b->digit, len * sizeof(digit_t));
+	do {
+		chunks[n++] = mag_divmod1(t, t, len, CHUNK);
+		while (len && !t[len-1])
+			len--;
+	} while (len);
+
+	size_t size = n * 9 + 2;
+	char *s = (char *) GC_MALLOC_ATOMIC(size);
+	char *p = s, *end = s + size;
+	if (b->neg)
+		*p++ = '-';
+	p += snprintf(p, end - p, "%u", (unsigned) chunks[--n]);
+	while (n)
+		p += snprintf(p, end - p, "%09u", (unsigned) chunks[--n]);
+	return s;
+}
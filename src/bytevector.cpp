@@ -0,0 +1,370 @@
+/*
+  bytevector.cpp - Byte buffers, slices and file mappings
+*/
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lisp.h"
+#include "number.h"
+#include "prim.h"
+#include "util.h"
+
+/*
+  A bytevector's bytes live outside the object: in an atomic heap block
+  the collector never scans, in a read-only file mapping, or inside the
+  buffer of another bytevector it is a slice of. Slices keep the root
+  bytevector alive through parent; a mapping is unmapped by a finaliser
+  on its root once nothing refers to it.
+*/
+
+static Bytevector *
+make_bytevector(size_t len)
+{
+	Bytevector *bv = new Bytevector;
+	bv->data = (uint8_t *) GC_MALLOC_ATOMIC(len ? len : 1);
+	bv->len = len;
+	return bv;
+}
+
+static Bytevector *
+check_bytevector(Value x, const char *op)
+{
+	if (!is_bytevector(x))
+		type_error(op);
+	return as_bytevector(x);
+}
+
+static Bytevector *
+check_writable(Value x, const char *op)
+{
+	Bytevector *bv = check_bytevector(x, op);
+	if (bv->readonly)
+		errorf(Error(), "%s: bytevector is read-only", op);
+	return bv;
+}
+
+/* offset of a size-byte field at arg i */
+static size_t
+check_offset(Bytevector *bv, Value i, size_t size, const char *op)
+{
+	if (!is_fixnum(i))
+		type_error(op);
+	if (as_fixnum(i) < 0 || (size_t) as_fixnum(i) > bv->len
+	    || bv->len - as_fixnum(i) < size)
+		errorf(Error(), "%s: index out of range", op);
+	return as_fixnum(i);
+}
+
+/* optional start and end arguments from arg[first] on */
+static void
+check_range(size_t len, unsigned nargs, Value *arg, unsigned first,
+            size_t *start, size_t *end, const char *op)
+{
+	if (nargs > first + 2)
+		errorf(ArityError(), "arity error: %s", op);
+	*start = 0;
+	*end = len;
+	if (nargs > first) {
+		if (!is_fixnum(arg[first]))
+			type_error(op);
+		*start = as_fixnum(arg[first]);
+	}
+	if (nargs > first + 1) {
+		if (!is_fixnum(arg[first+1]))
+			type_error(op);
+		*end = as_fixnum(arg[first+1]);
+	}
+	if (*end > len || *start > *end)
+		errorf(Error(), "%s: index out of range", op);
+}
+
+/* optional endianness argument, 'little (the default) or 'big */
+static bool
+swap_bytes(unsigned nargs, Value *arg, unsigned i, const char *op)
+{
+	static Symbol *sym_big = make_symbol("big");
+	static Symbol *sym_little = make_symbol("little");
+	if (nargs > i + 1)
+		errorf(ArityError(), "arity error: %s", op);
+	bool big = false;
+	if (nargs > i) {
+		if (arg[i] != sym_big && arg[i] != sym_little)
+			errorf(Error(), "%s: endianness must be big or little", op);
+		big = arg[i] == sym_big;
+	}
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return !big;
+#else
+	return big;
+#endif
+}
+
+static inline uint16_t bswap(uint16_t x) { return __builtin_bswap16(x); }
+static inline uint32_t bswap(uint32_t x) { return __builtin_bswap32(x); }
+static inline uint64_t bswap(uint64_t x) { return __builtin_bswap64(x); }
+
+/* unaligned load or store of a T at byte offset i */
+template <class T>
+static T
+load(Bytevector *bv, size_t i, bool swap)
+{
+	T x;
+	memcpy(&x, bv->data + i, sizeof(T));
+	return swap ? bswap(x) : x;
+}
+
+template <class T>
+static void
+store(Bytevector *bv, size_t i, T x, bool swap)
+{
+	if (swap)
+		x = bswap(x);
+	memcpy(bv->data + i, &x, sizeof(T));
+}
+
+static void
+finalize_mapping(void *obj, UNUSED void *data)
+{
+	Bytevector *bv = (Bytevector *) ((uintptr_t *) obj + 1);
+	munmap(bv->data, bv->len);
+}
+
+/* (make-bytevector n [fill]) */
+DEF_PRIM(prim_make_bytevector, "make-bytevector", ~1)
+{
+	if (nargs > 2)
+		error(ArityError(), "arity error: make-bytevector");
+	if (!is_fixnum(arg[0]) || as_fixnum(arg[0]) < 0)
+		type_error("make-bytevector");
+	int fill = 0;
+	if (nargs > 1) {
+		if (!is_fixnum(arg[1]) || (uintptr_t) as_fixnum(arg[1]) > 0xFF)
+			type_error("make-bytevector");
+		fill = as_fixnum(arg[1]);
+	}
+	Bytevector *bv = make_bytevector(as_fixnum(arg[0]));
+	memset(bv->data, fill, bv->len);
+	return bv;
+}
+
+DEF_PRIM(prim_bytevector, "bytevector", ~0)
+{
+	Bytevector *bv = make_bytevector(nargs);
+	for (unsigned i = 0; i < nargs; i++) {
+		if (!is_fixnum(arg[i]) || (uintptr_t) as_fixnum(arg[i]) > 0xFF)
+			type_error("bytevector");
+		bv->data[i] = as_fixnum(arg[i]);
+	}
+	return bv;
+}
+
+DEF_PRIM(prim_is_bytevector, "bytevector?", 1)
+{
+	return make_bool(is_bytevector(arg[0]));
+}
+
+DEF_PRIM(prim_bytevector_length, "bytevector-length", 1)
+{
+	return make_fixnum(check_bytevector(arg[0], "bytevector-length")->len);
+}
+
+DEF_PRIM(prim_bytevector_u8_ref, "bytevector-u8-ref", 2)
+{
+	Bytevector *bv = check_bytevector(arg[0], "bytevector-u8-ref");
+	return make_fixnum(bv->data[
+		check_offset(bv, arg[1], 1, "bytevector-u8-ref")]);
+}
+
+DEF_PRIM(prim_bytevector_u8_set, "bytevector-u8-set!", 3)
+{
+	Bytevector *bv = check_writable(arg[0], "bytevector-u8-set!");
+	size_t i = check_offset(bv, arg[1], 1, "bytevector-u8-set!");
+	if (!is_fixnum(arg[2]) || (uintptr_t) as_fixnum(arg[2]) > 0xFF)
+		type_error("bytevector-u8-set!");
+	bv->data[i] = as_fixnum(arg[2]);
+	return arg[2];
+}
+
+#define DEF_UINT_ACCESS(bits, max)                                      \
+DEF_PRIM(prim_bytevector_u##bits##_ref,                                 \
+         "bytevector-u" #bits "-ref", ~2)                               \
+{                                                                       \
+	const char *op = "bytevector-u" #bits "-ref";                   \
+	Bytevector *bv = check_bytevector(arg[0], op);                  \
+	size_t i = check_offset(bv, arg[1], bits / 8, op);              \
+	bool swap = swap_bytes(nargs, arg, 2, op);                      \
+	return num_from_int64(load<uint##bits##_t>(bv, i, swap));       \
+}                                                                       \
+                                                                        \
+DEF_PRIM(prim_bytevector_u##bits##_set,                                 \
+         "bytevector-u" #bits "-set!", ~3)                              \
+{                                                                       \
+	const char *op = "bytevector-u" #bits "-set!";                  \
+	Bytevector *bv = check_writable(arg[0], op);                    \
+	size_t i = check_offset(bv, arg[1], bits / 8, op);              \
+	bool swap = swap_bytes(nargs, arg, 3, op);                      \
+	int64_t x;                                                      \
+	if (!num_to_int64(arg[2], &x) || x < 0 || x > (max))            \
+		type_error(op);                                         \
+	store<uint##bits##_t>(bv, i, x, swap);                          \
+	return arg[2];                                                  \
+}
+
+DEF_UINT_ACCESS(16, 0xFFFF)
+DEF_UINT_ACCESS(32, 0xFFFFFFFFLL)
+
+DEF_PRIM(prim_bytevector_s64_ref, "bytevector-s64-ref", ~2)
+{
+	const char *op = "bytevector-s64-ref";
+	Bytevector *bv = check_bytevector(arg[0], op);
+	size_t i = check_offset(bv, arg[1], 8, op);
+	bool swap = swap_bytes(nargs, arg, 2, op);
+	return num_from_int64((int64_t) load<uint64_t>(bv, i, swap));
+}
+
+DEF_PRIM(prim_bytevector_s64_set, "bytevector-s64-set!", ~3)
+{
+	const char *op = "bytevector-s64-set!";
+	Bytevector *bv = check_writable(arg[0], op);
+	size_t i = check_offset(bv, arg[1], 8, op);
+	bool swap = swap_bytes(nargs, arg, 3, op);
+	int64_t x;
+	if (!num_to_int64(arg[2], &x))
+		type_error(op);
+	store<uint64_t>(bv, i, x, swap);
+	return arg[2];
+}
+
+DEF_PRIM(prim_bytevector_f64_ref, "bytevector-f64-ref", ~2)
+{
+	const char *op = "bytevector-f64-ref";
+	Bytevector *bv = check_bytevector(arg[0], op);
+	size_t i = check_offset(bv, arg[1], 8, op);
+	bool swap = swap_bytes(nargs, arg, 2, op);
+	uint64_t bits = load<uint64_t>(bv, i, swap);
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return make_flonum(d);
+}
+
+DEF_PRIM(prim_bytevector_f64_set, "bytevector-f64-set!", ~3)
+{
+	const char *op = "bytevector-f64-set!";
+	Bytevector *bv = check_writable(arg[0], op);
+	size_t i = check_offset(bv, arg[1], 8, op);
+	bool swap = swap_bytes(nargs, arg, 3, op);
+	if (!is_number(arg[2]))
+		type_error(op);
+	double d = num_to_double(arg[2]);
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	store<uint64_t>(bv, i, bits, swap);
+	return arg[2];
+}
+
+/* (bytevector-slice bv [start end]) shares the bytes of bv */
+DEF_PRIM(prim_bytevector_slice, "bytevector-slice", ~1)
+{
+	Bytevector *bv = check_bytevector(arg[0], "bytevector-slice");
+	size_t start, end;
+	check_range(bv->len, nargs, arg, 1, &start, &end, "bytevector-slice");
+	Bytevector *s = new Bytevector;
+	s->data = bv->data + start;
+	s->len = end - start;
+	s->parent = is_nil(bv->parent) ? Value(bv) : bv->parent;
+	s->readonly = bv->readonly;
+	return s;
+}
+
+/* (bytevector-copy bv [start end]) into a fresh writable bytevector */
+DEF_PRIM(prim_bytevector_copy, "bytevector-copy", ~1)
+{
+	Bytevector *bv = check_bytevector(arg[0], "bytevector-copy");
+	size_t start, end;
+	check_range(bv->len, nargs, arg, 1, &start, &end, "bytevector-copy");
+	Bytevector *r = make_bytevector(end - start);
+	memcpy(r->data, bv->data + start, r->len);
+	return r;
+}
+
+/* (utf8->string bv [start end]) */
+DEF_PRIM(prim_utf8_to_string, "utf8->string", ~1)
+{
+	Bytevector *bv = check_bytevector(arg[0], "utf8->string");
+	size_t start, end;
+	check_range(bv->len, nargs, arg, 1, &start, &end, "utf8->string");
+	return make_string((const char *) bv->data + start, end - start);
+}
+
+DEF_PRIM(prim_string_to_utf8, "string->utf8", 1)
+{
+	if (!is_string(arg[0]))
+		type_error("string->utf8");
+	String *s = as_string(arg[0]);
+	Bytevector *bv = make_bytevector(s->len);
+	memcpy(bv->data, s->value, s->len);
+	return bv;
+}
+
+/* (mmap-file path), a read-only bytevector over the file's pages */
+DEF_PRIM(prim_mmap_file, "mmap-file", 1)
+{
+	if (!is_string(arg[0]))
+		type_error("mmap-file");
+	const char *path = as_string(arg[0])->value;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		errorf(Error(), "mmap-file: %s: %s", path, strerror(errno));
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+		close(fd);
+		errorf(Error(), "mmap-file: %s: %s", path, strerror(err));
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		Bytevector *bv = make_bytevector(0);
+		bv->readonly = true;
+		return bv;
+	}
+	void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int err = errno;
+	close(fd);
+	if (p == MAP_FAILED)
+		errorf(Error(), "mmap-file: %s: %s", path, strerror(err));
+	Bytevector *bv = new Bytevector;
+	bv->data = (uint8_t *) p;
+	bv->len = st.st_size;
+	bv->readonly = true;
+	GC_register_finalizer_no_order(bv->_hdr(), finalize_mapping, 0, 0, 0);
+	return bv;
+}
+
+const prim_info
+bytevector_prims[] = {
+	_prim_make_bytevector,
+	_prim_bytevector,
+	_prim_is_bytevector,
+	_prim_bytevector_length,
+	_prim_bytevector_u8_ref,
+	_prim_bytevector_u8_set,
+	_prim_bytevector_u16_ref,
+	_prim_bytevector_u16_set,
+	_prim_bytevector_u32_ref,
+	_prim_bytevector_u32_set,
+	_prim_bytevector_s64_ref,
+	_prim_bytevector_s64_set,
+	_prim_bytevector_f64_ref,
+	_prim_bytevector_f64_set,
+	_prim_bytevector_slice,
+	_prim_bytevector_copy,
+	_prim_utf8_to_string,
+	_prim_string_to_utf8,
+	_prim_mmap_file,
+};
+
+const unsigned bytevector_nprims = NELEMS(bytevector_prims);
@@ -1,22 +1,26 @@
 #include "lisp.h"
 #include "ast.h"
+#include "srcloc.h"
 
 class Cenv {
 	Cenv *const up;
 	Module *const mod;
+	SourceMap *const map;
 	Value const vars;
 	int nvars;
 public:
-	explicit Cenv(Module *mod) : up(0), mod(mod), vars(NIL), nvars(0) {}
+	explicit Cenv(Module *mod, SourceMap *map = 0)
+		: up(0), mod(mod), map(map), vars(NIL), nvars(0) {}
 	Cenv(Cenv *up, Value vars);
 	Expr *lookup(Symbol *name) const;
 	Module *module() const { return mod; }
+	SourceMap *sources() const { return map; }
 	bool toplevel() const { return !up; }
 	int arity() const { return nvars; }
 };
 
 Cenv::Cenv(Cenv *up, Value vars)
-	: up(up), mod(up->mod), vars(vars), nvars(0)
+	: up(up), mod(up->mod), map(up->map), vars(vars), nvars(0)
 {
 	Value p = vars;
 	for (; is_pair(p); p = cdr(p), nvars++)
@@ -85,14 +89,21 @@ eval_if(Value exp, Cenv *env)
 	return new Cond(eval(pred, env), eval(then, env), eval(other, env));
 }
 
-static Seq *
-eval_seq(Value exp, Cenv *env)
+Seq *
+make_seq(unsigned count)
 {
-	unsigned count = length(exp);
 	Seq *seq = (Seq *) Seq::operator new(
 		sizeof(Seq) + count * sizeof(Expr *));
 	seq->type = Expr::SEQ;
 	seq->count = count;
+	return seq;
+}
+
+static Seq *
+eval_seq(Value exp, Cenv *env)
+{
+	unsigned count = length(exp);
+	Seq *seq = make_seq(count);
 	for (unsigned i = 0; i < count; i++, exp = cdr(exp))
 		seq->expr[i] = eval(car(exp), env);
 	if (!is_nil(exp))
@@ -100,6 +111,22 @@ eval_seq(Value exp, Cenv *env)
 	return seq;
 }
 
+/*
+  Toplevel procedure bodies are kept as source and compiled when first
+  applied, so that definitions which are never called cost nothing
+  beyond checking their formals.
+*/
+static Abs *
+make_abs(Value formals, Value body, Cenv *env)
+{
+	Cenv subenv(env, formals);
+	if (env->toplevel())
+		return new Abs(subenv.arity(),
+			new Lazy(env->module(), formals, body,
+			         env->sources()));
+	return new Abs(subenv.arity(), eval_seq(body, &subenv));
+}
+
 static Abs *
 eval_lambda(Value exp, Cenv *env)
 {
@@ -110,8 +137,7 @@ eval_lambda(Value exp, Cenv *env)
 		syntax_error("lambda: no body");
 	Value body = exp;
 
-	Cenv subenv(env, formals);
-	return new Abs(subenv.arity(), eval_seq(body, &subenv));
+	return make_abs(formals, body, env);
 }
 
 static Define *
@@ -132,9 +158,8 @@ eval_define(Value exp, Cenv *env)
 		value = eval(car(exp), env);
 	}
 	else {
-		Cenv subenv(env, cdr(name));
+		value = make_abs(cdr(name), exp, env);
 		name = car(name);
-		value = new Abs(subenv.arity(), eval_seq(exp, &subenv));
 	}
 	if (!is_symbol(name))
 		syntax_error("define: name must be a symbol");
@@ -162,6 +187,531 @@ eval_define_macro(Value exp, Cenv *env)
 	return new DefineMacro(env->module(), as_symbol(car(name)), body);
 }
 
+/* (and x ...) and (or x ...) give true or false unless the last x decides */
+static Expr *
+eval_and(Value exp, Cenv *env)
+{
+	if (is_nil(exp))
+		return eval_lit(_T);
+	if (!is_pair(exp))
+		syntax_error("and");
+	if (is_nil(cdr(exp)))
+		return eval(car(exp), env);
+	return new Cond(eval(car(exp), env), eval_and(cdr(exp), env),
+	                eval_lit(_F));
+}
+
+static Expr *
+eval_or(Value exp, Cenv *env)
+{
+	if (is_nil(exp))
+		return eval_lit(_F);
+	if (!is_pair(exp))
+		syntax_error("or");
+	if (is_nil(cdr(exp)))
+		return eval(car(exp), env);
+	return new Cond(eval(car(exp), env), eval_lit(_T),
+	                eval_or(cdr(exp), env));
+}
+
+/* (cond pred expr ... default) */
+static Expr *
+eval_cond(Value exp, Cenv *env)
+{
+	if (!is_pair(exp))
+		syntax_error("cond");
+	if (!is_pair(cdr(exp)))
+		return eval(car(exp), env);
+	return new Cond(eval(car(exp), env), eval(car(cdr(exp)), env),
+	                eval_cond(cdr(cdr(exp)), env));
+}
+
+static Expr *
+eval_when(Value exp, Cenv *env)
+{
+	if (!is_pair(exp) || !is_pair(cdr(exp)))
+		syntax_error("when");
+	return new Cond(eval(car(exp), env), eval_seq(cdr(exp), env),
+	                eval_lit(NIL));
+}
+
+static Expr *
+eval_assert(Value exp, Cenv *env)
+{
+	if (is_nil(exp))
+		return eval_lit(NIL);
+	if (!is_pair(exp))
+		syntax_error("assert");
+	Seq *args = make_seq(2);
+	args->expr[0] = eval_lit(make_string("assertion failed:", 17));
+	args->expr[1] = eval_lit(car(exp));
+	Expr *fail = new App(env->lookup(make_symbol("error")), args);
+	return new Cond(eval(car(exp), env), eval_assert(cdr(exp), env),
+	                fail);
+}
+
+static Expr *
+case_arm(Case *c, Value entry)
+{
+	return c->arms->expr[as_fixnum(cdr(entry))];
+}
+
+/* fixnums spanning at most this many more values than there are keys */
+#define CASE_DENSE_SLACK 8
+
+static bool
+case_dense(Case *c, Value keys, unsigned n)
+{
+	Fixnum min = 0, max = 0;
+	for (Value p = keys; is_pair(p); p = cdr(p)) {
+		Value k = car(car(p));
+		if (!is_fixnum(k))
+			return false;
+		if (p == keys || as_fixnum(k) < min)
+			min = as_fixnum(k);
+		if (p == keys || as_fixnum(k) > max)
+			max = as_fixnum(k);
+	}
+	if (!n || (uintptr_t) max - (uintptr_t) min >= 2 * n + CASE_DENSE_SLACK)
+		return false;
+	c->min = min;
+	c->size = max - min + 1;
+	c->jump = (Expr **) GC_MALLOC(c->size * sizeof(Expr *));
+	for (Value p = keys; is_pair(p); p = cdr(p)) {
+		uintptr_t i = as_fixnum(car(car(p))) - min;
+		if (!c->jump[i])
+			c->jump[i] = case_arm(c, car(p));
+	}
+	for (unsigned i = 0; i < c->size; i++)
+		if (!c->jump[i])
+			c->jump[i] = c->other;
+	return true;
+}
+
+/* linear probing, where the first of repeated keys wins; gives the
+   longest probe */
+static unsigned
+case_place(Case *c, Value keys)
+{
+	unsigned probe = 0;
+	for (unsigned i = 0; i < c->size; i++)
+		c->slot[i] = NULL_VALUE;
+	for (Value p = keys; is_pair(p); p = cdr(p)) {
+		Value k = car(car(p));
+		uintptr_t i = case_hash(c, k);
+		unsigned d = 0;
+		for (; c->slot[i] != NULL_VALUE; d++) {
+			if (c->slot[i] == k)
+				break;
+			i = (i + 1) & (c->size - 1);
+		}
+		if (c->slot[i] == k)
+			continue;
+		c->slot[i] = k;
+		c->jump[i] = case_arm(c, car(p));
+		if (d > probe)
+			probe = d;
+	}
+	return probe;
+}
+
+static void
+case_size(Case *c, unsigned bits)
+{
+	c->size = 1u << bits;
+	c->shift = 8 * sizeof(uintptr_t) - bits;
+	c->slot = (Value *) GC_MALLOC(c->size * sizeof(Value));
+	c->jump = (Expr **) GC_MALLOC(c->size * sizeof(Expr *));
+}
+
+/*
+  Try a few multipliers at each of three table sizes from twice the
+  number of keys, taking the first which leaves no key displaced. Large
+  sets seldom have one, and keep whichever probed least.
+*/
+#define CASE_TRIES 32
+
+static void
+case_hash_table(Case *c, Value keys, unsigned n)
+{
+	unsigned bits = 1;
+	while ((1u << bits) < 2 * n)
+		bits++;
+	uintptr_t mult = (uintptr_t) 0x9e3779b97f4a7c15ULL;
+	uintptr_t best_mult = mult | 1;
+	unsigned best_bits = bits, best_probe = ~0u;
+	for (unsigned b = bits; b < bits + 3; b++) {
+		case_size(c, b);
+		for (unsigned i = 0; i < CASE_TRIES; i++) {
+			c->mult = mult | 1;
+			mult = mult * (uintptr_t) 6364136223846793005ULL
+			       + (uintptr_t) 1442695040888963407ULL;
+			c->probe = case_place(c, keys);
+			if (c->probe == 0)
+				return;
+			if (c->probe < best_probe) {
+				best_probe = c->probe;
+				best_mult = c->mult;
+				best_bits = b;
+			}
+		}
+	}
+	case_size(c, best_bits);
+	c->mult = best_mult;
+	c->probe = case_place(c, keys);
+}
+
+Case *
+make_case(Expr *key, Seq *arms, Value keys, Expr *other)
+{
+	Case *c = new Case(key, arms, keys, other);
+	Value table = NIL;
+	unsigned n = 0;
+	for (Value p = keys; is_pair(p); p = cdr(p)) {
+		if (is_ptr(car(car(p))) && is_number(car(car(p))))
+			c->boxed = cons(car(p), c->boxed);
+		else {
+			table = cons(car(p), table);
+			n++;
+		}
+	}
+	c->boxed = reverse(c->boxed);
+	table = reverse(table);
+	if (!case_dense(c, table, n))
+		case_hash_table(c, table, n);
+	return c;
+}
+
+/*
+  (case key constants expr ... default), where constants is one datum
+  or a list of them, compared with the key by eqv? and not evaluated.
+*/
+static Expr *
+eval_case(Value exp, Cenv *env)
+{
+	if (!is_pair(exp))
+		syntax_error("case");
+	Value p = cdr(exp);
+	unsigned narms = 0;
+	for (; is_pair(p) && is_pair(cdr(p)); p = cdr(cdr(p)))
+		narms++;
+	if (!is_pair(p) || !is_nil(cdr(p)))
+		syntax_error("case");
+
+	Seq *arms = make_seq(narms);
+	Value keys = NIL;
+	p = cdr(exp);
+	for (unsigned i = 0; i < narms; i++, p = cdr(cdr(p))) {
+		Value k = car(p);
+		if (!is_pair(k))
+			k = cons(k, NIL);
+		for (; is_pair(k); k = cdr(k))
+			keys = cons(cons(car(k), make_fixnum(i)), keys);
+		if (!is_nil(k))
+			syntax_error("case");
+		arms->expr[i] = eval(car(cdr(p)), env);
+	}
+	return make_case(eval(car(exp), env), arms, reverse(keys),
+	                 eval(car(p), env));
+}
+
+/*
+  Quasiquote templates compile to the code that builds them. A subtree
+  with nothing unquoted at its level is shared as a literal; otherwise
+  each run of elements is one call to list*, making exactly the pairs
+  it needs, and spliced lists are copied by %append. Both are called
+  as the primitives themselves, whatever their names are bound to.
+*/
+static Expr *
+qq_template(Value x, int depth, Cenv *env);
+
+static bool
+is_qq_keyword(Value x)
+{
+	return x == sym_quasiquote || x == sym_unquote
+	    || x == sym_unquote_splicing;
+}
+
+/* the operand of (unquote x) or (unquote-splicing x) */
+static Value
+qq_operand(Value x, const char *what)
+{
+	if (!is_pair(cdr(x)) || !is_nil(cdr(cdr(x))))
+		errorf(SyntaxError(), "syntax error: %s", what);
+	return car(cdr(x));
+}
+
+static Expr *
+qq_call(const char *name, Expr **args, unsigned nargs, Expr *last)
+{
+	Seq *seq = make_seq(nargs + 1);
+	for (unsigned i = 0; i < nargs; i++)
+		seq->expr[i] = args[i];
+	seq->expr[nargs] = last;
+	return new App(eval_lit(primitive(name)), seq);
+}
+
+/* a list template, or 0 when it is constant */
+static Expr *
+qq_list(Value x, int depth, Cenv *env)
+{
+	unsigned n = 0;
+	Value p = x;
+	for (; is_pair(p) && (p == x || !is_qq_keyword(car(p))); p = cdr(p))
+		n++;
+	/* a dotted unquote, as in (a . ,b), is a tail template */
+	Expr *tail = is_pair(p) ? qq_template(p, depth, env) : 0;
+	bool constant = !tail;
+
+	Expr **item = (Expr **) GC_MALLOC(n * sizeof(Expr *));
+	bool *splice = (bool *) GC_MALLOC_ATOMIC(n ? n : 1);
+	Value q = x;
+	for (unsigned i = 0; i < n; i++, q = cdr(q)) {
+		Value elem = car(q);
+		splice[i] = false;
+		if (is_pair(elem) && car(elem) == sym_unquote_splicing) {
+			if (depth == 0) {
+				item[i] = eval(qq_operand(elem,
+					"unquote-splicing"), env);
+				splice[i] = true;
+			}
+			else
+				item[i] = qq_list(elem, depth - 1, env);
+		}
+		else
+			item[i] = qq_template(elem, depth, env);
+		if (item[i])
+			constant = false;
+		else
+			item[i] = eval_lit(elem);
+	}
+	if (constant)
+		return 0;
+
+	Expr *acc = tail ? tail : eval_lit(p);
+	for (unsigned end = n; end > 0; ) {
+		unsigned start = end;
+		bool spliced = splice[end-1];
+		while (start > 0 && splice[start-1] == spliced)
+			start--;
+		acc = qq_call(spliced ? "%append" : "list*",
+		              item + start, end - start, acc);
+		end = start;
+	}
+	return acc;
+}
+
+static Expr *
+qq_template(Value x, int depth, Cenv *env)
+{
+	if (!is_pair(x))
+		return 0;
+	if (car(x) == sym_unquote) {
+		if (depth == 0)
+			return eval(qq_operand(x, "unquote"), env);
+		return qq_list(x, depth - 1, env);
+	}
+	if (car(x) == sym_quasiquote)
+		return qq_list(x, depth + 1, env);
+	if (car(x) == sym_unquote_splicing && depth == 0)
+		syntax_error("unquote-splicing: not inside list");
+	return qq_list(x, depth, env);
+}
+
+static Expr *
+eval_quasiquote(Value exp, Cenv *env)
+{
+	if (!is_pair(exp) || !is_nil(cdr(exp)))
+		syntax_error("quasiquote");
+	Expr *exp1 = qq_template(car(exp), 0, env);
+	return exp1 ? exp1 : eval_lit(car(exp));
+}
+
+/* proper argument list of exactly n elements? */
+static bool
+has_nargs(Value args, unsigned n)
+{
+	for (; n && is_pair(args); n--)
+		args = cdr(args);
+	return n == 0 && is_nil(args);
+}
+
+/*
+  Nested calls to the boot bindings of range, map, filter and the folds
+  over them are compiled to a single Fused loop, so that pipelines like
+  (sum (map f (filter p (range 1 n)))) build no intermediate lists.
+  Only single-list map is fused. The node keeps the unfused form, made
+  from the same subexpressions, to run if any binding has changed.
+*/
+#define FUSE_MAX 16
+
+struct PipeCall {
+	ModuleRef *ref;
+	ListOp op;
+	Value args;
+};
+
+static unsigned
+pipe_nargs(ListOp op)
+{
+	switch (op) {
+	case LIST_OP_SUM:
+	case LIST_OP_PRODUCT:
+	case LIST_OP_LENGTH:
+		return 1;
+	case LIST_OP_RANGE:
+	case LIST_OP_MAP:
+	case LIST_OP_FILTER:
+		return 2;
+	case LIST_OP_FOLDL:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+/* call to a global bound to a list operation, with the right arguments? */
+static bool
+pipe_call(Value exp, Cenv *env, PipeCall *call)
+{
+	if (!is_pair(exp) || !is_symbol(car(exp)))
+		return false;
+	Symbol *name = as_symbol(car(exp));
+	if (env->module()->macro_lookup(name))
+		return false;
+	Expr *fun = env->lookup(name);
+	if (fun->type != Expr::MODULE_REF)
+		return false;
+	call->ref = (ModuleRef *) fun;
+	call->op = list_op(call->ref->value);
+	call->args = cdr(exp);
+	return call->op != LIST_OP_NONE
+	    && has_nargs(call->args, pipe_nargs(call->op));
+}
+
+static Value
+last_arg(Value args)
+{
+	while (is_pair(cdr(args)))
+		args = cdr(args);
+	return car(args);
+}
+
+static App *
+make_app(Expr *fun, unsigned nargs, Expr **args)
+{
+	Seq *seq = make_seq(nargs);
+	for (unsigned i = 0; i < nargs; i++)
+		seq->expr[i] = args[i];
+	return new App(fun, seq);
+}
+
+Fused *
+make_fused(unsigned nops)
+{
+	Fused *fused = (Fused *) Fused::operator new(
+		sizeof(Fused) + nops * sizeof(FusedOp));
+	fused->type = Expr::FUSED;
+	fused->unfused = 0;
+	fused->init = fused->list = fused->from = fused->to = 0;
+	fused->nops = nops;
+	return fused;
+}
+
+/* the pipeline as plain applications of the same subexpressions */
+Expr *
+unfuse(Fused *fused)
+{
+	Expr *inner = fused->list;
+	for (unsigned i = fused->nops; i-- > 0;) {
+		FusedOp *op = &fused->op[i];
+		Expr *argv[3];
+		unsigned k = 0;
+		if (op->fun)
+			argv[k++] = op->fun;
+		if (op->op == LIST_OP_FOLDL)
+			argv[k++] = fused->init;
+		if (op->op == LIST_OP_RANGE) {
+			argv[k++] = fused->from;
+			argv[k++] = fused->to;
+		}
+		else
+			argv[k++] = inner;
+		inner = make_app(op->ref, k, argv);
+	}
+	return inner;
+}
+
+static Expr *
+eval_fused(ModuleRef *ref, Value args, Cenv *env)
+{
+	PipeCall call[FUSE_MAX];
+	unsigned n = 0;
+
+	call[0].ref = ref;
+	call[0].op = list_op(ref->value);
+	call[0].args = args;
+	if (call[0].op == LIST_OP_NONE || call[0].op == LIST_OP_RANGE
+	    || !has_nargs(args, pipe_nargs(call[0].op)))
+		return 0;
+	for (n = 1; n < FUSE_MAX && call[n-1].op != LIST_OP_RANGE; n++) {
+		if (!pipe_call(last_arg(call[n-1].args), env, &call[n]))
+			break;
+		ListOp op = call[n].op;
+		if (op != LIST_OP_MAP && op != LIST_OP_FILTER
+		    && op != LIST_OP_RANGE)
+			break;
+	}
+	if (n < 2)
+		return 0;
+
+	Fused *fused = make_fused(n);
+	for (unsigned i = 0; i < n; i++) {
+		FusedOp *op = &fused->op[i];
+		Value a = call[i].args;
+		op->ref = call[i].ref;
+		op->proc = call[i].ref->value;
+		op->op = call[i].op;
+		op->fun = 0;
+		if (op->op == LIST_OP_RANGE) {
+			fused->from = eval(car(a), env);
+			fused->to = eval(car(cdr(a)), env);
+		}
+		else if (pipe_nargs(op->op) > 1)
+			op->fun = eval(car(a), env);
+		if (op->op == LIST_OP_FOLDL)
+			fused->init = eval(car(cdr(a)), env);
+	}
+	if (call[n-1].op != LIST_OP_RANGE)
+		fused->list = eval(last_arg(call[n-1].args), env);
+
+	fused->unfused = unfuse(fused);
+	return fused;
+}
+
+/*
+  Calls to globals currently bound to record accessors and mutators
+  or to vector-ref are compiled to inline access. The node re-checks
+  the binding when executed, so redefinition falls back to a normal
+  application.
+*/
+static Expr *
+eval_inline(ModuleRef *ref, Value args, Cenv *env)
+{
+	Value fun = ref->value;
+
+	if (is_accessor(fun) && has_nargs(args, 1))
+		return new SlotRef(ref, as_accessor(fun),
+			eval(car(args), env));
+	if (is_mutator(fun) && has_nargs(args, 2))
+		return new SlotSet(ref, as_mutator(fun),
+			eval(car(args), env), eval(car(cdr(args)), env));
+	if (is_vector_ref_prim(fun) && has_nargs(args, 2))
+		return new VectorRef(ref, fun,
+			eval(car(args), env), eval(car(cdr(args)), env));
+	return eval_fused(ref, args, env);
+}
+
 static Expr *
 eval_apply(Value exp, Cenv *env)
 {
@@ -172,17 +722,19 @@ eval_apply(Value exp, Cenv *env)
 			return eval(apply_arglist(
 				as_procedure(ref->value), cdr(exp)), env);
 	}
-	return new App(eval(car(exp), env), eval_seq(cdr(exp), env));
+	Expr *fun = eval(car(exp), env);
+	if (fun->type == Expr::MODULE_REF) {
+		Expr *exp1 = eval_inline((ModuleRef *) fun, cdr(exp), env);
+		if (exp1)
+			return exp1;
+	}
+	return new App(fun, eval_seq(cdr(exp), env));
 }
 
 static Expr *
-eval(Value exp, Cenv *env)
+eval_form(Value exp, Cenv *env)
 {
-	if (is_symbol(exp))
-		return env->lookup(as_symbol(exp));
-	else if (!is_pair(exp))
-		return eval_lit(exp);
-	else if (car(exp) == sym_quote)
+	if (car(exp) == sym_quote)
 		return eval_quote(cdr(exp));
 	else if (car(exp) == sym_if)
 		return eval_if(cdr(exp), env);
@@ -194,13 +746,87 @@ eval(Value exp, Cenv *env)
 		return eval_define(cdr(exp), env);
 	else if (car(exp) == sym_define_macro)
 		return eval_define_macro(cdr(exp), env);
+	else if (car(exp) == sym_quasiquote)
+		return eval_quasiquote(cdr(exp), env);
+	else if (car(exp) == sym_and)
+		return eval_and(cdr(exp), env);
+	else if (car(exp) == sym_or)
+		return eval_or(cdr(exp), env);
+	else if (car(exp) == sym_cond)
+		return eval_cond(cdr(exp), env);
+	else if (car(exp) == sym_when)
+		return eval_when(cdr(exp), env);
+	else if (car(exp) == sym_assert)
+		return eval_assert(cdr(exp), env);
+	else if (car(exp) == sym_case)
+		return eval_case(cdr(exp), env);
+	else if (car(exp) == sym_unquote)
+		syntax_error("unquote: not inside quasiquote");
+	else if (car(exp) == sym_unquote_splicing)
+		syntax_error("unquote-splicing: not inside quasiquote");
 	else
 		return eval_apply(exp, env);
 }
 
+/*
+  A procedure holds the body of its lambda, so the body is given the
+  lambda's line too. References to globals are shared and get none.
+*/
+static void
+note_form(Expr *x, String *file, unsigned line)
+{
+	if (x->type == Expr::MODULE_REF || x->type == Expr::MACRO_REF)
+		return;
+	note_source(x, file, line);
+	if (x->type == Expr::DEFINE)
+		x = ((Define *) x)->value;
+	if (x->type == Expr::ABS)
+		note_source(((Abs *) x)->body, file, line);
+}
+
+/* a compile error is reported at the innermost form with a line */
+static Expr *
+eval(Value exp, Cenv *env)
+{
+	if (is_symbol(exp))
+		return env->lookup(as_symbol(exp));
+	if (!is_pair(exp))
+		return eval_lit(exp);
+	unsigned line = env->sources() ? env->sources()->line(exp) : 0;
+	if (!line)
+		return eval_form(exp, env);
+	Expr *x;
+	try {
+		x = eval_form(exp, env);
+	}
+	catch (Error& e) {
+		if (!e.located)
+			print_source(env->sources()->file, line);
+		e.located = true;
+		throw;
+	}
+	note_form(x, env->sources()->file, line);
+	return x;
+}
+
 Expr *
-compile(Value exp, Module *mod)
+compile(Value exp, Module *mod, SourceMap *sources)
 {
-	Cenv env(mod);
+	Cenv env(mod, sources);
 	return eval(exp, &env);
 }
+
+Seq *
+compile_lazy(Lazy *lazy)
+{
+	if (!lazy->body) {
+		Cenv env(lazy->mod, lazy->sources);
+		Cenv subenv(&env, lazy->formals);
+		lazy->body = eval_seq(lazy->source, &subenv);
+		String *file;
+		unsigned line;
+		if (source_of(lazy, &file, &line))
+			note_source(lazy->body, file, line);
+	}
+	return lazy->body;
+}
@@ -11,17 +11,25 @@ struct tstnode_t : public GC_object {
 	tstnode_t(int ch) : ch(ch), lo(0), eq(0), hi(0) {}
 };
 
+/* links are only stored when they change, leaving shared pages clean */
+#define SET_LINK(link, x) do { \
+	tstnode_t *_x = (x);   \
+	if (link != _x)        \
+		link = _x;     \
+} while (0)
+
 static tstnode_t *
 tst_insert(tstnode_t *p, const char *s, const void *v)
 {
 	if (!p)
 		p = new tstnode_t(*s);
 	if (*s < p->ch)
-		p->lo = tst_insert(p->lo, s, v);
+		SET_LINK(p->lo, tst_insert(p->lo, s, v));
 	else if (*s > p->ch)
-		p->hi = tst_insert(p->hi, s, v);
+		SET_LINK(p->hi, tst_insert(p->hi, s, v));
 	else
-		p->eq = *s ? tst_insert(p->eq, s+1, v) : (tstnode_t *) v;
+		SET_LINK(p->eq, *s ? tst_insert(p->eq, s+1, v)
+		                   : (tstnode_t *) v);
 	return p;
 }
 
@@ -42,6 +50,39 @@ tst_lookup(tstnode_t *p, const char *s)
 	return NULL;
 }
 
+/* lookup of the len bytes at s, which need not be null-terminated */
+static void *
+tst_lookup(tstnode_t *p, const char *s, size_t len)
+{
+	while (p) {
+		int ch = len ? *s : 0;
+		if (ch < p->ch)
+			p = p->lo;
+		else if (ch > p->ch)
+			p = p->hi;
+		else {
+			if (ch == 0)
+				return (void *) p->eq;
+			s++;
+			len--;
+			p = p->eq;
+		}
+	}
+	return NULL;
+}
+
+static void
+tst_each(tstnode_t *p, void (*fn)(void *, void *), void *data)
+{
+	for (; p; p = p->hi) {
+		tst_each(p->lo, fn, data);
+		if (p->ch == 0)
+			fn(p->eq, data);
+		else
+			tst_each(p->eq, fn, data);
+	}
+}
+
 void
 Dict::define(const char *key, const void *value)
 {
@@ -54,3 +95,15 @@ Dict::lookup(const char *key)
 {
 	return tst_lookup(root, key);
 }
+
+void *
+Dict::lookup(const char *key, size_t len)
+{
+	return tst_lookup(root, key, len);
+}
+
+void
+Dict::each(void (*fn)(void *value, void *data), void *data)
+{
+	tst_each(root, fn, data);
+}
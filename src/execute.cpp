@@ -1,5 +1,7 @@
 #include "lisp.h"
 #include "ast.h"
+#include "number.h"
+#include "srcloc.h"
 
 struct Frame {
 	Frame *up;
@@ -21,6 +23,34 @@ fetch(Frame *f, unsigned level, unsigned offset)
 	return f->slot[offset];
 }
 
+/* compile the body of a lazily compiled procedure if necessary */
+Expr *
+ast_procedure_body(AstProcedure *proc)
+{
+	if (proc->body->type == Expr::LAZY)
+		proc->body = compile_lazy((Lazy *) proc->body);
+	return proc->body;
+}
+
+/* make the frame of a call to an AST procedure, returning its body */
+static inline Expr *
+enter(AstProcedure *proc, Frame *args, int nargs)
+{
+	int arity = proc->arity;
+	if (arity >= 0 ? nargs != arity : nargs < ~arity)
+		arity_error(proc);
+
+	/* cons-up variable args */
+	if (arity < 0) {
+		Value varargs = NIL;
+		while (nargs-- > ~arity)
+			varargs = cons(args->slot[nargs], varargs);
+		args->slot[~arity] = varargs;
+	}
+	args->up = proc->env;
+	return ast_procedure_body(proc);
+}
+
 static Value
 apply(Value fun, Frame *args, int nargs)
 {
@@ -28,6 +58,8 @@ apply(Value fun, Frame *args, int nargs)
 
 	if (!is_procedure(fun))
 		goto err;
+	if (is_ast_procedure(fun))
+		return execute(enter(as_ast_procedure(fun), args, nargs), args);
 
 	arity = as_procedure(fun)->arity;
 	if (arity >= 0 && nargs != arity)
@@ -35,17 +67,6 @@ apply(Value fun, Frame *args, int nargs)
 	if (arity < 0 && nargs < ~arity)
 		arity_error(as_procedure(fun));
 
-	if (is_ast_procedure(fun)) {
-		/* cons-up variable args */
-		if (arity < 0) {
-			Value varargs = NIL;
-			while (nargs-- > ~arity)
-				varargs = cons(args->slot[nargs], varargs);
-			args->slot[~arity] = varargs;
-		}
-		args->up = as_ast_procedure(fun)->env;
-		return execute(as_ast_procedure(fun)->body, args);
-	}
 	if (is_c_procedure(fun))
 		return as_c_procedure(fun)->proc(nargs, args->slot);
 	if (is_cc_procedure(fun))
@@ -65,66 +86,276 @@ frame_size(Value fun, int nargs)
 	return nargs;
 }
 
-Value
-execute(Expr *exp, Frame *env)
+struct FusedLoop {
+	FusedOp *op;
+	Value *fun;
+	unsigned first, last;
+	ListOp fold;
+	Value acc;
+	void feed(Value x);
+};
+
+/* pass x through the stages, innermost first, into the fold */
+void
+FusedLoop::feed(Value x)
 {
-	switch (exp->type) {
-	case Expr::LIT:
-		return ((Lit *)exp)->value;
-	case Expr::LOCAL_REF: {
-		LocalRef *lref = (LocalRef *) exp;
-		return fetch(env, lref->level, lref->offset);
-		}
-	case Expr::MACRO_REF:
-	case Expr::MODULE_REF: {
-		ModuleRef *mref = (ModuleRef *) exp;
-		if (mref->value == UNDEFINED)
-			unbound_error(mref->name);
-		return mref->value;
-		}
-	case Expr::COND: {
-		Cond *cond = (Cond *) exp;
-		return execute(execute(cond->pred, env) != _F
-		               ? cond->then : cond->other, env);
-		}
-	case Expr::SEQ: {
-		Seq *seq = (Seq *) exp;
-		Value ret = NIL;
-		for (unsigned i = 0; i < seq->count; i++)
-			ret = execute(seq->expr[i], env);
-		return ret;
+	for (unsigned i = last; i-- > first;) {
+		if (op[i].op == LIST_OP_MAP)
+			x = apply_argv(fun[i], 1, &x);
+		else if (apply_argv(fun[i], 1, &x) == _F)
+			return;
+	}
+	switch (fold) {
+	case LIST_OP_SUM:
+		acc = num_add(acc, x);
+		break;
+	case LIST_OP_PRODUCT:
+		acc = num_mul(acc, x);
+		break;
+	case LIST_OP_LENGTH:
+		acc = make_fixnum(as_fixnum(acc) + 1);
+		break;
+	case LIST_OP_FOLDL: {
+		Value argv[2] = {acc, x};
+		acc = apply_argv(fun[0], 2, argv);
+		break;
 		}
-	case Expr::APP: {
-		App *app = (App *) exp;
-		unsigned nargs = app->args->count;
-		Value fun = execute(app->fun, env);
-		Frame *args = make_frame(frame_size(fun, nargs));
-		for (unsigned i = 0; i < nargs; i++)
-			args->slot[i] = execute(app->args->expr[i], env);
-		return apply(fun, args, nargs);
+	default:
+		acc = cons(x, acc);
+	}
+}
+
+/* kept out of line so as not to enlarge execute()'s frame, which every
+   level of non-tail recursion pays for */
+static NOINLINE Value
+execute_fused(Fused *fused, Frame *env)
+{
+	unsigned n = fused->nops;
+	for (unsigned i = 0; i < n; i++)
+		if (execute(fused->op[i].ref, env) != fused->op[i].proc)
+			return execute(fused->unfused, env);
+
+	Value *fun = (Value *) GC_MALLOC(n * sizeof(Value));
+	FusedLoop loop;
+	loop.op = fused->op;
+	loop.fun = fun;
+	loop.fold = fused->op[0].op;
+	loop.first = 1;
+	loop.last = fused->list ? n : n - 1;
+	switch (loop.fold) {
+	case LIST_OP_SUM:
+	case LIST_OP_LENGTH:
+		loop.acc = make_fixnum(0);
+		break;
+	case LIST_OP_PRODUCT:
+		loop.acc = make_fixnum(1);
+		break;
+	case LIST_OP_FOLDL:
+		break;
+	default:
+		loop.first = 0;
+		loop.acc = NIL;
+	}
+	for (unsigned i = 0; i < n; i++) {
+		fun[i] = fused->op[i].fun ? execute(fused->op[i].fun, env) : NIL;
+		if (fused->op[i].op == LIST_OP_FOLDL)
+			loop.acc = execute(fused->init, env);
+	}
+
+	if (fused->list) {
+		Value p = execute(fused->list, env);
+		for (; is_pair(p); p = cdr(p))
+			loop.feed(car(p));
+		if (!is_nil(p))
+			type_error(fused->op[n-1].op == LIST_OP_MAP
+			           ? "map" : "filter");
+	}
+	else {
+		Value from = execute(fused->from, env);
+		Value to = execute(fused->to, env);
+		if (!is_number(from) || !is_number(to))
+			type_error("range");
+		if (is_fixnum(from) && is_fixnum(to))
+			for (Fixnum i = as_fixnum(from); i <= as_fixnum(to); i++)
+				loop.feed(make_fixnum(i));
+		else
+			for (Value i = from; num_compare(i, to) <= 0;
+			     i = num_add(i, make_fixnum(1)))
+				loop.feed(i);
+	}
+	return loop.first ? loop.acc : reverse(loop.acc);
+}
+
+Expr *
+case_branch(Case *c, Value key)
+{
+	if (!c->slot) {
+		if (is_fixnum(key)) {
+			uintptr_t i = as_fixnum(key) - c->min;
+			if (i < c->size)
+				return c->jump[i];
 		}
-	case Expr::ABS: {
-		Abs *abs = (Abs *) exp;
-		return make_ast_procedure(sym_at_lambda, abs->arity,
-		                          abs->body, env);
+	}
+	else {
+		uintptr_t i = case_hash(c, key);
+		for (unsigned n = 0; n <= c->probe; n++) {
+			if (c->slot[i] == key)
+				return c->jump[i];
+			if (c->slot[i] == NULL_VALUE)
+				break;
+			i = (i + 1) & (c->size - 1);
 		}
-	case Expr::DEFINE: {
-		Define *def = (Define *) exp;
-		Value value = execute(def->value, env);
-		def->mod->define(def->name, value);
-		if (is_procedure(value))
-			as_procedure(value)->name = def->name;
-		return value;
+	}
+	for (Value p = c->boxed; is_pair(p); p = cdr(p))
+		if (num_eqv(key, car(car(p))))
+			return c->arms->expr[as_fixnum(cdr(car(p)))];
+	return c->other;
+}
+
+/*
+  Expressions in tail position, calls to AST procedures included, are
+  run by the same call, so the stack grows only with non-tail calls
+  and the handler never stands in the way of a tail call. An error is
+  reported at the innermost expression with a known line as it passes
+  out; the handler costs nothing until something is thrown.
+*/
+Value
+execute(Expr *exp, Frame *env)
+{
+	try {
+		while (1) switch (exp->type) {
+		case Expr::LIT:
+			return ((Lit *)exp)->value;
+		case Expr::LOCAL_REF: {
+			LocalRef *lref = (LocalRef *) exp;
+			return fetch(env, lref->level, lref->offset);
+			}
+		case Expr::MACRO_REF:
+		case Expr::MODULE_REF: {
+			ModuleRef *mref = (ModuleRef *) exp;
+			if (mref->value == UNDEFINED)
+				unbound_error(mref->name);
+			return mref->value;
+			}
+		case Expr::COND: {
+			Cond *cond = (Cond *) exp;
+			exp = execute(cond->pred, env) != _F ? cond->then : cond->other;
+			continue;
+			}
+		case Expr::SEQ: {
+			Seq *seq = (Seq *) exp;
+			if (seq->count == 0)
+				return NIL;
+			for (unsigned i = 0; i + 1 < seq->count; i++)
+				execute(seq->expr[i], env);
+			exp = seq->expr[seq->count - 1];
+			continue;
+			}
+		case Expr::APP: {
+			App *app = (App *) exp;
+			unsigned nargs = app->args->count;
+			Value fun = execute(app->fun, env);
+			Frame *args = make_frame(frame_size(fun, nargs));
+			for (unsigned i = 0; i < nargs; i++)
+				args->slot[i] = execute(app->args->expr[i], env);
+			if (is_ast_procedure(fun)) {
+				exp = enter(as_ast_procedure(fun), args, nargs);
+				env = args;
+				continue;
+			}
+			return apply(fun, args, nargs);
+			}
+		case Expr::SLOT_REF: {
+			SlotRef *sref = (SlotRef *) exp;
+			Value fun = execute(sref->fun, env);
+			Value rec = execute(sref->rec, env);
+			if (fun != sref->proc) {
+				Frame *args = make_frame(frame_size(fun, 1));
+				args->slot[0] = rec;
+				return apply(fun, args, 1);
+			}
+			if (!is_ptr(rec) || as_ptr(rec)->typecode() != sref->proc->typecode)
+				type_error(sref->proc->name->value);
+			return as_record(rec)->get(sref->proc->kind, sref->proc->offset);
+			}
+		case Expr::SLOT_SET: {
+			SlotSet *sset = (SlotSet *) exp;
+			Value fun = execute(sset->fun, env);
+			Value rec = execute(sset->rec, env);
+			Value value = execute(sset->value, env);
+			if (fun != sset->proc) {
+				Frame *args = make_frame(frame_size(fun, 2));
+				args->slot[0] = rec;
+				args->slot[1] = value;
+				return apply(fun, args, 2);
+			}
+			if (!is_ptr(rec) || as_ptr(rec)->typecode() != sset->proc->typecode)
+				type_error(sset->proc->name->value);
+			if (!as_record(rec)->set(sset->proc->kind, sset->proc->offset,
+			                         value))
+				type_error(sset->proc->name->value);
+			return NIL;
+			}
+		case Expr::VECTOR_REF: {
+			VectorRef *vref = (VectorRef *) exp;
+			Value fun = execute(vref->fun, env);
+			Value vec = execute(vref->vec, env);
+			Value index = execute(vref->index, env);
+			if (fun != vref->proc) {
+				Frame *args = make_frame(frame_size(fun, 2));
+				args->slot[0] = vec;
+				args->slot[1] = index;
+				return apply(fun, args, 2);
+			}
+			/* one unsigned compare covers negative indices */
+			if (is_vector(vec) && is_fixnum(index)
+			    && (size_t) as_fixnum(index) < as_vector(vec)->len)
+				return as_vector(vec)->items[as_fixnum(index)];
+			return vector_ref(vec, index);
+			}
+		case Expr::FUSED:
+			return execute_fused((Fused *) exp, env);
+		case Expr::CASE: {
+			Case *c = (Case *) exp;
+			exp = case_branch(c, execute(c->key, env));
+			continue;
+			}
+		case Expr::LAZY:
+			exp = compile_lazy((Lazy *) exp);
+			continue;
+		case Expr::ABS: {
+			Abs *abs = (Abs *) exp;
+			return make_ast_procedure(sym_at_lambda, abs->arity,
+			                          abs->body, env);
+			}
+		case Expr::DEFINE: {
+			Define *def = (Define *) exp;
+			Value value = execute(def->value, env);
+			def->mod->define(def->name, value);
+			if (is_procedure(value))
+				as_procedure(value)->name = def->name;
+			return value;
+			}
+		case Expr::DEFINE_MACRO: {
+			DefineMacro *def = (DefineMacro *) exp;
+			Procedure *proc = as_procedure(execute(def->body, env));
+			def->mod->macro_define(def->name, proc);
+			proc->name = def->name;
+			return proc;
+			}
+		default:
+			return NIL;
 		}
-	case Expr::DEFINE_MACRO: {
-		DefineMacro *def = (DefineMacro *) exp;
-		Procedure *proc = as_procedure(execute(def->body, env));
-		def->mod->macro_define(def->name, proc);
-		proc->name = def->name;
-		return proc;
+	}
+	catch (Error& e) {
+		String *file;
+		unsigned line;
+		if (!e.located && source_of(exp, &file, &line)) {
+			print_source(file, line);
+			e.located = true;
 		}
+		throw;
 	}
-	return NIL;
 }
 
 Value
@@ -142,3 +373,12 @@ apply_arglist(Value fun, Value arglist)
 		args->slot[i] = car(arglist);
 	return apply(fun, args, nargs);
 }
+
+Value
+apply_argv(Value fun, unsigned nargs, const Value *argv)
+{
+	Frame *args = make_frame(frame_size(fun, nargs));
+	for (unsigned i = 0; i < nargs; i++)
+		args->slot[i] = argv[i];
+	return apply(fun, args, nargs);
+}
@@ -0,0 +1,680 @@
+/*
+  fasl.cpp - Cached compiled forms
+
+  A fasl file is a header followed by a payload of a symbol table and
+  the compiled forms of the source, in order:
+
+    "AMPFASL\0"  version  runtime signature  source hash
+    payload length  payload hash
+    nsyms  (len bytes)*  nforms  expr*
+
+  An expression or list read from a known line of the source is
+  preceded by that line, as a flag on the expression's type byte or as
+  a V_LINE value before the list.
+
+  The source hash covers the file and, before it, every file loaded
+  earlier in the process, boot.lisp first, as their macros decide how
+  the file expands.
+
+  Integers in the payload are LEB128 varints, signed ones zigzagged.
+  Global references are stored by name and looked up again as each
+  form is loaded, just before it runs, so they resolve as compiling
+  it then would have. Inlined calls are rebuilt against the bindings
+  found at load time. The forms are written once the file has run, and
+  a toplevel procedure whose body was compiled by then, when it was
+  first applied, is written with that body; the rest stay as source
+  to be compiled when first applied, as they are from source. A body
+  loaded compiled resolves its globals at load time rather than at its
+  first application, which differs only for a name defined before the
+  procedure and defined again after it.
+*/
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lisp.h"
+#include "ast.h"
+#include "fasl.h"
+#include "number.h"
+#include "parse.h"
+#include "srcloc.h"
+#include "util.h"
+
+#define FASL_MAGIC "AMPFASL"
+#define FASL_VERSION 3
+
+/* on an expression's type, which is followed by its line */
+#define FASL_LINE 0x80
+
+struct FaslHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+	uint64_t runtime;
+	uint64_t source_hash;
+	uint64_t payload_len;
+	uint64_t payload_hash;
+};
+
+enum {
+	V_NIL, V_TRUE, V_FALSE, V_EOF, V_UNDEFINED, V_FIXNUM, V_CHAR,
+	V_FLONUM, V_BIGNUM, V_STRING, V_SYMBOL, V_LIST, V_VECTOR, V_GLOBAL,
+	V_LINE
+};
+
+/* raised while writing a form that holds a literal with no encoding */
+struct Unfaslable {};
+
+uint64_t
+fasl_hash(const char *s, size_t n, uint64_t seed)
+{
+	return hash64(s, n, seed);
+}
+
+void
+FaslWriter::Buffer::put(const void *p, size_t n)
+{
+	if (n == 0)
+		return;
+	if (cap - len < n) {
+		while (cap - len < n)
+			cap = cap ? cap * 2 : 4096;
+		data = (char *) realloc(data, cap);
+	}
+	memcpy(data + len, p, n);
+	len += n;
+}
+
+FaslWriter::FaslWriter(Module *mod, uint64_t hash, SourceMap *sources)
+	: mod(mod), sources(sources), symtab(new HashTable(HASH_EQV, false)),
+	pending(0), nsyms(0), nforms(0), maxforms(0), hash(hash) {}
+
+void
+FaslWriter::put_uint(Buffer &b, uint64_t x)
+{
+	while (x >= 0x80) {
+		put_byte(b, (x & 0x7F) | 0x80);
+		x >>= 7;
+	}
+	put_byte(b, x);
+}
+
+void
+FaslWriter::put_int(Buffer &b, int64_t x)
+{
+	put_uint(b, ((uint64_t) x << 1) ^ (uint64_t) (x >> 63));
+}
+
+void
+FaslWriter::put_symbol(Buffer &b, Symbol *sym)
+{
+	Value *slot = symtab->lookup(sym);
+	if (slot) {
+		put_uint(b, as_fixnum(*slot));
+		return;
+	}
+	symtab->insert(sym, make_fixnum(nsyms));
+	put_uint(syms, sym->len);
+	syms.put(sym->value, sym->len);
+	put_uint(b, nsyms++);
+}
+
+void
+FaslWriter::put_value(Buffer &b, Value x)
+{
+	if (is_nil(x))
+		put_byte(b, V_NIL);
+	else if (x == _T)
+		put_byte(b, V_TRUE);
+	else if (x == _F)
+		put_byte(b, V_FALSE);
+	else if (is_eof(x))
+		put_byte(b, V_EOF);
+	else if (is_undefined(x))
+		put_byte(b, V_UNDEFINED);
+	else if (is_fixnum(x)) {
+		put_byte(b, V_FIXNUM);
+		put_int(b, as_fixnum(x));
+	}
+	else if (is_char(x)) {
+		put_byte(b, V_CHAR);
+		put_uint(b, as_char(x));
+	}
+	else if (is_flonum(x)) {
+		uint64_t bits = Value::double_bits(as_flonum(x));
+		put_byte(b, V_FLONUM);
+		b.put(&bits, sizeof(bits));
+	}
+	else if (is_bignum(x)) {
+		const char *s = bignum_to_string(as_bignum(x));
+		put_byte(b, V_BIGNUM);
+		put_uint(b, strlen(s));
+		b.put(s, strlen(s));
+	}
+	else if (is_symbol(x)) {
+		put_byte(b, V_SYMBOL);
+		put_symbol(b, as_symbol(x));
+	}
+	else if (is_string(x)) {
+		put_byte(b, V_STRING);
+		put_uint(b, as_string(x)->len);
+		b.put(as_string(x)->value, as_string(x)->len);
+	}
+	else if (is_pair(x)) {
+		/* lists iteratively, so long ones don't recurse deeply */
+		unsigned n = 0, line = sources ? sources->line(x) : 0;
+		Value p = x;
+		for (; is_pair(p); p = cdr(p))
+			n++;
+		if (line) {
+			put_byte(b, V_LINE);
+			put_uint(b, line);
+		}
+		put_byte(b, V_LIST);
+		put_uint(b, n);
+		for (p = x; is_pair(p); p = cdr(p))
+			put_value(b, car(p));
+		put_value(b, p);
+	}
+	else if (is_vector(x)) {
+		Vector *v = as_vector(x);
+		put_byte(b, V_VECTOR);
+		put_uint(b, v->len);
+		for (size_t i = 0; i < v->len; i++)
+			put_value(b, v->items[i]);
+	}
+	/* procedures spliced into code by macros, by their global name */
+	else if (is_procedure(x) && as_procedure(x)->name
+	         && mod->lookup(as_procedure(x)->name)->value == x) {
+		put_byte(b, V_GLOBAL);
+		put_symbol(b, as_procedure(x)->name);
+	}
+	else
+		throw Unfaslable();
+}
+
+void
+FaslWriter::put_expr(Buffer &b, Expr *exp)
+{
+	String *file;
+	unsigned line;
+	if (sources && source_of(exp, &file, &line) && file == sources->file) {
+		put_byte(b, exp->type | FASL_LINE);
+		put_uint(b, line);
+	}
+	else
+		put_byte(b, exp->type);
+	switch (exp->type) {
+	case Expr::APP:
+		put_expr(b, ((App *) exp)->fun);
+		put_expr(b, ((App *) exp)->args);
+		break;
+	case Expr::ABS: {
+		Expr *body = ((Abs *) exp)->body;
+		if (body->type == Expr::LAZY && ((Lazy *) body)->body)
+			body = ((Lazy *) body)->body;
+		put_int(b, ((Abs *) exp)->arity);
+		put_expr(b, body);
+		break;
+		}
+	case Expr::SEQ: {
+		Seq *seq = (Seq *) exp;
+		put_uint(b, seq->count);
+		for (unsigned i = 0; i < seq->count; i++)
+			put_expr(b, seq->expr[i]);
+		break;
+		}
+	case Expr::COND:
+		put_expr(b, ((Cond *) exp)->pred);
+		put_expr(b, ((Cond *) exp)->then);
+		put_expr(b, ((Cond *) exp)->other);
+		break;
+	case Expr::LIT:
+		put_value(b, ((Lit *) exp)->value);
+		break;
+	case Expr::LOCAL_REF:
+		put_uint(b, ((LocalRef *) exp)->level);
+		put_uint(b, ((LocalRef *) exp)->offset);
+		break;
+	case Expr::MODULE_REF:
+	case Expr::MACRO_REF:
+		put_symbol(b, ((ModuleRef *) exp)->name);
+		break;
+	case Expr::DEFINE:
+		put_symbol(b, ((Define *) exp)->name);
+		put_expr(b, ((Define *) exp)->value);
+		break;
+	case Expr::DEFINE_MACRO:
+		put_symbol(b, ((DefineMacro *) exp)->name);
+		put_expr(b, ((DefineMacro *) exp)->body);
+		break;
+	case Expr::SLOT_REF:
+		put_symbol(b, ((SlotRef *) exp)->fun->name);
+		put_expr(b, ((SlotRef *) exp)->rec);
+		break;
+	case Expr::SLOT_SET:
+		put_symbol(b, ((SlotSet *) exp)->fun->name);
+		put_expr(b, ((SlotSet *) exp)->rec);
+		put_expr(b, ((SlotSet *) exp)->value);
+		break;
+	case Expr::VECTOR_REF:
+		put_symbol(b, ((VectorRef *) exp)->fun->name);
+		put_expr(b, ((VectorRef *) exp)->vec);
+		put_expr(b, ((VectorRef *) exp)->index);
+		break;
+	case Expr::LAZY:
+		put_value(b, ((Lazy *) exp)->formals);
+		put_value(b, ((Lazy *) exp)->source);
+		break;
+	case Expr::FUSED: {
+		Fused *fused = (Fused *) exp;
+		put_uint(b, fused->nops);
+		for (unsigned i = 0; i < fused->nops; i++) {
+			FusedOp *op = &fused->op[i];
+			put_symbol(b, op->ref->name);
+			put_byte(b, op->op);
+			put_byte(b, op->fun != 0);
+			if (op->fun)
+				put_expr(b, op->fun);
+		}
+		Expr *parts[4] = {fused->init, fused->list, fused->from, fused->to};
+		for (unsigned i = 0; i < NELEMS(parts); i++) {
+			put_byte(b, parts[i] != 0);
+			if (parts[i])
+				put_expr(b, parts[i]);
+		}
+		break;
+		}
+	case Expr::CASE:
+		/* the tables hold addresses, so are built again on loading */
+		put_expr(b, ((Case *) exp)->key);
+		put_expr(b, ((Case *) exp)->arms);
+		put_value(b, ((Case *) exp)->keys);
+		put_expr(b, ((Case *) exp)->other);
+		break;
+	}
+}
+
+/* a compiled toplevel form, to be written when the file has run */
+void
+FaslWriter::add(Expr *exp)
+{
+	if (nforms == maxforms) {
+		maxforms = maxforms ? 2 * maxforms : 64;
+		Expr **p = (Expr **) GC_MALLOC(maxforms * sizeof(Expr *));
+		for (unsigned i = 0; i < nforms; i++)
+			p[i] = pending[i];
+		pending = p;
+	}
+	pending[nforms++] = exp;
+}
+
+/*
+  Written to a temporary and renamed, so readers never see a partial
+  file. Nothing is written if any form holds a literal with no encoding.
+*/
+void
+FaslWriter::save(const char *filename)
+{
+	try {
+		for (unsigned i = 0; i < nforms; i++)
+			put_expr(forms, pending[i]);
+	}
+	catch (Unfaslable&) {
+		return;
+	}
+	Buffer payload;
+	put_uint(payload, nsyms);
+	payload.put(syms.data, syms.len);
+	put_uint(payload, nforms);
+	payload.put(forms.data, forms.len);
+
+	FaslHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, FASL_MAGIC, sizeof(FASL_MAGIC));
+	h.version = FASL_VERSION;
+	h.runtime = primitives_signature();
+	h.source_hash = hash;
+	h.payload_len = payload.len;
+	h.payload_hash = fasl_hash(payload.data, payload.len);
+
+	size_t n = strlen(filename);
+	malloc_ptr<char> path = (char *) malloc(n + 6);
+	malloc_ptr<char> tmp = (char *) malloc(n + 32);
+	sprintf(path, "%s.fasl", filename);
+	sprintf(tmp, "%s.fasl.%ld", filename, (long) getpid());
+	FILE *f = fopen(tmp, "wb");
+	if (!f)
+		return;
+	bool written = fwrite(&h, sizeof(h), 1, f) == 1
+	    && fwrite(payload.data, 1, payload.len, f) == payload.len;
+	if (fclose(f) != 0 || !written || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+class FaslReader {
+	const uint8_t *p, *end;
+	Module *mod;
+	SourceMap *sources;
+	Symbol **syms;
+	size_t nsyms;
+
+	NORETURN void corrupt() { error(Error(), "fasl: corrupt file"); }
+	int get_byte() { if (p == end) corrupt(); return *p++; }
+	uint64_t get_uint();
+	int64_t get_int();
+	const char *get_bytes(size_t n);
+	Symbol *get_symbol();
+	ModuleRef *get_ref() { return mod->lookup(get_symbol()); }
+	Value get_value();
+	Expr *get_form(int type);
+	Expr *get_expr();
+public:
+	FaslReader(const void *data, size_t len, Module *mod,
+	           SourceMap *sources);
+	~FaslReader() { free(syms); }
+	void run();
+};
+
+FaslReader::FaslReader(const void *data, size_t len, Module *mod,
+                       SourceMap *sources)
+	: p((const uint8_t *) data), end((const uint8_t *) data + len),
+	mod(mod), sources(sources), syms(0), nsyms(0) {}
+
+uint64_t
+FaslReader::get_uint()
+{
+	uint64_t x = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		int c = get_byte();
+		x |= (uint64_t) (c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return x;
+	}
+	corrupt();
+}
+
+int64_t
+FaslReader::get_int()
+{
+	uint64_t u = get_uint();
+	return (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+}
+
+const char *
+FaslReader::get_bytes(size_t n)
+{
+	if ((size_t) (end - p) < n)
+		corrupt();
+	const char *s = (const char *) p;
+	p += n;
+	return s;
+}
+
+Symbol *
+FaslReader::get_symbol()
+{
+	uint64_t i = get_uint();
+	if (i >= nsyms)
+		corrupt();
+	return syms[i];
+}
+
+Value
+FaslReader::get_value()
+{
+	switch (get_byte()) {
+	case V_NIL:
+		return NIL;
+	case V_TRUE:
+		return _T;
+	case V_FALSE:
+		return _F;
+	case V_EOF:
+		return _EOF;
+	case V_UNDEFINED:
+		return UNDEFINED;
+	case V_FIXNUM:
+		return make_fixnum(get_int());
+	case V_CHAR:
+		return make_char(get_uint());
+	case V_FLONUM: {
+		uint64_t bits;
+		double d;
+		memcpy(&bits, get_bytes(sizeof(bits)), sizeof(bits));
+		memcpy(&d, &bits, sizeof(d));
+		return make_flonum(d);
+		}
+	case V_BIGNUM: {
+		size_t n = get_uint();
+		StringParser parser(get_bytes(n), n);
+		return parser.parse();
+		}
+	case V_STRING: {
+		size_t n = get_uint();
+		return make_string(get_bytes(n), n);
+		}
+	case V_SYMBOL:
+		return get_symbol();
+	case V_GLOBAL:
+		return get_ref()->value;
+	case V_LIST: {
+		Value list = NIL;
+		for (uint64_t n = get_uint(); n > 0; n--)
+			list = cons(get_value(), list);
+		return reverse(list, get_value());
+		}
+	case V_LINE: {
+		unsigned line = get_uint();
+		Value x = get_value();
+		if (!is_pair(x))
+			corrupt();
+		sources->note(x, line);
+		return x;
+		}
+	case V_VECTOR: {
+		Vector *v = make_vector(get_uint(), NIL);
+		for (size_t i = 0; i < v->len; i++)
+			v->items[i] = get_value();
+		return v;
+		}
+	}
+	corrupt();
+}
+
+Expr *
+FaslReader::get_expr()
+{
+	int type = get_byte();
+	if (!(type & FASL_LINE))
+		return get_form(type);
+	unsigned line = get_uint();
+	Expr *exp = get_form(type & ~FASL_LINE);
+	note_source(exp, sources->file, line);
+	return exp;
+}
+
+Expr *
+FaslReader::get_form(int type)
+{
+	switch (type) {
+	case Expr::APP: {
+		Expr *fun = get_expr();
+		Expr *args = get_expr();
+		if (args->type != Expr::SEQ)
+			corrupt();
+		return new App(fun, (Seq *) args);
+		}
+	case Expr::ABS: {
+		int arity = get_int();
+		return new Abs(arity, get_expr());
+		}
+	case Expr::SEQ: {
+		Seq *seq = make_seq(get_uint());
+		for (unsigned i = 0; i < seq->count; i++)
+			seq->expr[i] = get_expr();
+		return seq;
+		}
+	case Expr::COND: {
+		Expr *pred = get_expr();
+		Expr *then = get_expr();
+		return new Cond(pred, then, get_expr());
+		}
+	case Expr::LIT:
+		return new Lit(get_value());
+	case Expr::LOCAL_REF: {
+		unsigned level = get_uint();
+		return new LocalRef(level, get_uint());
+		}
+	case Expr::MODULE_REF:
+	case Expr::MACRO_REF:
+		return get_ref();
+	case Expr::DEFINE: {
+		Symbol *name = get_symbol();
+		return new Define(mod, name, get_expr());
+		}
+	case Expr::DEFINE_MACRO: {
+		Symbol *name = get_symbol();
+		Expr *body = get_expr();
+		if (body->type != Expr::ABS)
+			corrupt();
+		return new DefineMacro(mod, name, (Abs *) body);
+		}
+	case Expr::SLOT_REF: {
+		ModuleRef *ref = get_ref();
+		Expr *rec = get_expr();
+		if (is_accessor(ref->value))
+			return new SlotRef(ref, as_accessor(ref->value), rec);
+		Seq *args = make_seq(1);
+		args->expr[0] = rec;
+		return new App(ref, args);
+		}
+	case Expr::SLOT_SET: {
+		ModuleRef *ref = get_ref();
+		Expr *rec = get_expr();
+		Expr *value = get_expr();
+		if (is_mutator(ref->value))
+			return new SlotSet(ref, as_mutator(ref->value), rec, value);
+		Seq *args = make_seq(2);
+		args->expr[0] = rec;
+		args->expr[1] = value;
+		return new App(ref, args);
+		}
+	case Expr::VECTOR_REF: {
+		/* a guard that never matches if the binding has changed */
+		ModuleRef *ref = get_ref();
+		Expr *vec = get_expr();
+		Expr *index = get_expr();
+		Value proc = is_vector_ref_prim(ref->value)
+		             ? ref->value : NULL_VALUE;
+		return new VectorRef(ref, proc, vec, index);
+		}
+	case Expr::LAZY: {
+		Value formals = get_value();
+		return new Lazy(mod, formals, get_value(), sources);
+		}
+	case Expr::FUSED: {
+		uint64_t n = get_uint();
+		if (n == 0 || n > 64)
+			corrupt();
+		Fused *fused = make_fused(n);
+		for (unsigned i = 0; i < n; i++) {
+			FusedOp *op = &fused->op[i];
+			op->ref = get_ref();
+			op->op = (ListOp) get_byte();
+			op->proc = list_op(op->ref->value) == op->op
+			           ? op->ref->value : NULL_VALUE;
+			op->fun = get_byte() ? get_expr() : 0;
+		}
+		Expr **parts[4] = {&fused->init, &fused->list,
+		                   &fused->from, &fused->to};
+		for (unsigned i = 0; i < NELEMS(parts); i++)
+			*parts[i] = get_byte() ? get_expr() : 0;
+		fused->unfused = unfuse(fused);
+		return fused;
+		}
+	case Expr::CASE: {
+		Expr *key = get_expr();
+		Expr *arms = get_expr();
+		if (arms->type != Expr::SEQ)
+			corrupt();
+		Value keys = get_value();
+		for (Value p = keys; is_pair(p); p = cdr(p))
+			if (!is_pair(car(p)) || !is_fixnum(cdr(car(p)))
+			    || (uintptr_t) as_fixnum(cdr(car(p)))
+			       >= ((Seq *) arms)->count)
+				corrupt();
+		return make_case(key, (Seq *) arms, keys, get_expr());
+		}
+	}
+	corrupt();
+}
+
+/* load each form just before running it, as from source */
+void
+FaslReader::run()
+{
+	nsyms = get_uint();
+	if (nsyms > (size_t) (end - p))
+		corrupt();
+	syms = (Symbol **) malloc(nsyms * sizeof(Symbol *) + 1);
+	for (size_t i = 0; i < nsyms; i++) {
+		size_t n = get_uint();
+		syms[i] = make_symbol(get_bytes(n), n);
+	}
+	for (uint64_t n = get_uint(); n > 0; n--)
+		execute(get_expr());
+}
+
+/*
+  Run filename's cached forms if the cache is up to date. Returns false,
+  having run nothing, if there is no usable cache.
+*/
+bool
+fasl_load(const char *filename, uint64_t hash, Module *mod,
+          SourceMap *sources)
+{
+	size_t n = strlen(filename);
+	malloc_ptr<char> path = (char *) malloc(n + 6);
+	sprintf(path, "%s.fasl", filename);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(FaslHeader)) {
+		close(fd);
+		return false;
+	}
+	void *m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return false;
+
+	FaslHeader h;
+	memcpy(&h, m, sizeof(h));
+	const char *payload = (const char *) m + sizeof(h);
+	size_t len = st.st_size - sizeof(h);
+	if (memcmp(h.magic, FASL_MAGIC, sizeof(FASL_MAGIC)) != 0
+	    || h.version != FASL_VERSION
+	    || h.runtime != primitives_signature()
+	    || h.source_hash != hash
+	    || h.payload_len != len
+	    || h.payload_hash != fasl_hash(payload, len)) {
+		munmap(m, st.st_size);
+		return false;
+	}
+	try {
+		FaslReader reader(payload, len, mod, sources);
+		reader.run();
+	}
+	catch (...) {
+		munmap(m, st.st_size);
+		throw;
+	}
+	munmap(m, st.st_size);
+	return true;
+}
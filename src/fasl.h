@@ -0,0 +1,45 @@
+#ifndef SRC_FASL_H
+#define SRC_FASL_H
+
+/*
+  Compiled forms of a source file, cached next to it as <file>.fasl.
+  The cache records the hash of the source it was compiled from, with
+  the sources loaded before it, and the runtime it was compiled by,
+  and is loaded in place of the source while both still match.
+*/
+class FaslWriter {
+	struct Buffer {
+		char *data;
+		size_t len, cap;
+		Buffer() : data(0), len(0), cap(0) {}
+		~Buffer() { free(data); }
+		void put(const void *p, size_t n);
+	};
+	Buffer syms, forms;
+	Module *mod;
+	SourceMap *sources;
+	HashTable *symtab;
+	Expr **pending;
+	unsigned nsyms, nforms, maxforms;
+	uint64_t hash;
+
+	void put_byte(Buffer &b, int x) { char c = x; b.put(&c, 1); }
+	void put_uint(Buffer &b, uint64_t x);
+	void put_int(Buffer &b, int64_t x);
+	void put_symbol(Buffer &b, Symbol *sym);
+	void put_value(Buffer &b, Value x);
+	void put_expr(Buffer &b, Expr *exp);
+public:
+	FaslWriter(Module *mod, uint64_t hash, SourceMap *sources);
+	void add(Expr *exp);
+	void save(const char *filename);
+};
+
+extern uint64_t
+fasl_hash(const char *s, size_t n, uint64_t seed = 0);
+
+extern bool
+fasl_load(const char *filename, uint64_t hash, Module *mod,
+          SourceMap *sources);
+
+#endif /* SRC_FASL_H */
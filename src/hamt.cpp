@@ -0,0 +1,636 @@
+/*
+  hamt.cpp - Persistent hash maps and sets
+*/
+
+#include <cstring>
+#include "lisp.h"
+#include "prim.h"
+#include "util.h"
+
+/*
+  Each node consumes five bits of the key's hash. Present positions are
+  split between datamap, for entries stored inline as key and value,
+  and nodemap, for subnodes; the entries come first in kv, followed by
+  the subnode pointers. Once the hash is used up, keys that still
+  collide go in a collision node holding a plain list of entries.
+*/
+#define HAMT_BITS 5
+#define HAMT_MASK ((1 << HAMT_BITS) - 1)
+#define HASH_BITS (sizeof(size_t) * 8)
+
+struct HamtNode : GC_object {
+	uint32_t datamap, nodemap;
+	uint16_t ndata, nnodes;
+	void *edit;
+	Value kv[0];
+	HamtNode **nodes() { return (HamtNode **)(kv + 2 * ndata); }
+};
+
+static inline unsigned
+index(uint32_t map, uint32_t bit)
+{
+	return __builtin_popcount(map & (bit - 1));
+}
+
+static inline uint32_t
+bitpos(size_t hash, unsigned shift)
+{
+	return (uint32_t) 1 << (hash >> shift & HAMT_MASK);
+}
+
+static HamtNode *
+alloc_node(void *edit, unsigned ndata, unsigned nnodes)
+{
+	HamtNode *n = (HamtNode *) HamtNode::operator new(
+		sizeof(HamtNode) + (2 * ndata + nnodes) * sizeof(Value));
+	n->datamap = n->nodemap = 0;
+	n->ndata = ndata;
+	n->nnodes = nnodes;
+	n->edit = edit;
+	return n;
+}
+
+static HamtNode *
+copy_node(HamtNode *n, void *edit)
+{
+	size_t size = (2 * n->ndata + n->nnodes) * sizeof(Value);
+	HamtNode *m = alloc_node(edit, n->ndata, n->nnodes);
+	m->datamap = n->datamap;
+	m->nodemap = n->nodemap;
+	memcpy((void *) m->kv, n->kv, size);
+	return m;
+}
+
+/* n itself if the transient owns it, otherwise a copy it owns */
+static inline HamtNode *
+editable(HamtNode *n, void *edit)
+{
+	return edit && n->edit == edit ? n : copy_node(n, edit);
+}
+
+/*
+  Copy of n with position bit holding the entry (key, val) if key is
+  given, the subnode child if given, or nothing.
+*/
+static HamtNode *
+reshape(HamtNode *n, void *edit, uint32_t bit, Value key, Value val,
+        HamtNode *child)
+{
+	uint32_t datamap = n->datamap & ~bit, nodemap = n->nodemap & ~bit;
+	if (!key._is_none())
+		datamap |= bit;
+	if (child)
+		nodemap |= bit;
+	HamtNode *m = alloc_node(edit, __builtin_popcount(datamap),
+	                         __builtin_popcount(nodemap));
+	m->datamap = datamap;
+	m->nodemap = nodemap;
+
+	unsigned j = 0;
+	for (uint32_t map = datamap; map; map &= map - 1, j++) {
+		uint32_t b = map & -map;
+		if (b == bit) {
+			m->kv[2*j] = key;
+			m->kv[2*j+1] = val;
+		}
+		else {
+			unsigned i = index(n->datamap, b);
+			m->kv[2*j] = n->kv[2*i];
+			m->kv[2*j+1] = n->kv[2*i+1];
+		}
+	}
+	j = 0;
+	for (uint32_t map = nodemap; map; map &= map - 1, j++) {
+		uint32_t b = map & -map;
+		m->nodes()[j] = b == bit ? child
+		              : n->nodes()[index(n->nodemap, b)];
+	}
+	return m;
+}
+
+/* node holding two entries whose hashes agree below shift */
+static HamtNode *
+pair_node(void *edit, unsigned shift, Value k1, Value v1, size_t h1,
+          Value k2, Value v2, size_t h2)
+{
+	if (shift >= HASH_BITS) {
+		HamtNode *n = alloc_node(edit, 2, 0);
+		n->kv[0] = k1; n->kv[1] = v1;
+		n->kv[2] = k2; n->kv[3] = v2;
+		return n;
+	}
+	uint32_t b1 = bitpos(h1, shift), b2 = bitpos(h2, shift);
+	if (b1 == b2) {
+		HamtNode *n = alloc_node(edit, 0, 1);
+		n->nodemap = b1;
+		n->nodes()[0] = pair_node(edit, shift + HAMT_BITS,
+		                          k1, v1, h1, k2, v2, h2);
+		return n;
+	}
+	HamtNode *n = alloc_node(edit, 2, 0);
+	n->datamap = b1 | b2;
+	unsigned i = b1 < b2 ? 0 : 1;
+	n->kv[2*i] = k1; n->kv[2*i+1] = v1;
+	n->kv[2*(1-i)] = k2; n->kv[2*(1-i)+1] = v2;
+	return n;
+}
+
+static Value *
+node_lookup(HamtNode *n, size_t hash, Value key)
+{
+	for (unsigned shift = 0; n; shift += HAMT_BITS) {
+		if (shift >= HASH_BITS) {
+			for (unsigned i = 0; i < n->ndata; i++)
+				if (equal(n->kv[2*i], key))
+					return &n->kv[2*i+1];
+			return 0;
+		}
+		uint32_t bit = bitpos(hash, shift);
+		if (n->datamap & bit) {
+			unsigned i = index(n->datamap, bit);
+			return equal(n->kv[2*i], key) ? &n->kv[2*i+1] : 0;
+		}
+		if (!(n->nodemap & bit))
+			return 0;
+		n = n->nodes()[index(n->nodemap, bit)];
+	}
+	return 0;
+}
+
+static HamtNode *
+collision_assoc(HamtNode *n, void *edit, Value key, Value val, bool *added)
+{
+	for (unsigned i = 0; i < n->ndata; i++)
+		if (equal(n->kv[2*i], key)) {
+			if (n->kv[2*i+1] == val)
+				return n;
+			n = editable(n, edit);
+			n->kv[2*i+1] = val;
+			return n;
+		}
+	HamtNode *m = alloc_node(edit, n->ndata + 1, 0);
+	memcpy((void *) m->kv, n->kv, 2 * n->ndata * sizeof(Value));
+	m->kv[2*n->ndata] = key;
+	m->kv[2*n->ndata+1] = val;
+	*added = true;
+	return m;
+}
+
+static HamtNode *
+node_assoc(HamtNode *n, void *edit, unsigned shift, size_t hash,
+           Value key, Value val, bool *added)
+{
+	if (shift >= HASH_BITS)
+		return collision_assoc(n, edit, key, val, added);
+
+	uint32_t bit = bitpos(hash, shift);
+	if (n->datamap & bit) {
+		unsigned i = index(n->datamap, bit);
+		Value k = n->kv[2*i], v = n->kv[2*i+1];
+		if (equal(k, key)) {
+			if (v == val)
+				return n;
+			n = editable(n, edit);
+			n->kv[2*i+1] = val;
+			return n;
+		}
+		*added = true;
+		return reshape(n, edit, bit, Value(), Value(),
+			pair_node(edit, shift + HAMT_BITS,
+			          k, v, hash_equal(k), key, val, hash));
+	}
+	if (n->nodemap & bit) {
+		unsigned j = index(n->nodemap, bit);
+		HamtNode *child = n->nodes()[j];
+		HamtNode *c = node_assoc(child, edit, shift + HAMT_BITS,
+		                         hash, key, val, added);
+		if (c == child)
+			return n;
+		n = editable(n, edit);
+		n->nodes()[j] = c;
+		return n;
+	}
+	*added = true;
+	return reshape(n, edit, bit, key, val, 0);
+}
+
+/* n without key; null once it is empty */
+static HamtNode *
+node_dissoc(HamtNode *n, void *edit, unsigned shift, size_t hash,
+            Value key, bool *removed)
+{
+	if (shift >= HASH_BITS) {
+		for (unsigned i = 0; i < n->ndata; i++)
+			if (equal(n->kv[2*i], key)) {
+				*removed = true;
+				if (n->ndata == 1)
+					return 0;
+				HamtNode *m = alloc_node(edit, n->ndata - 1, 0);
+				for (unsigned j = 0, k = 0; j < n->ndata; j++)
+					if (j != i) {
+						m->kv[2*k] = n->kv[2*j];
+						m->kv[2*k+1] = n->kv[2*j+1];
+						k++;
+					}
+				return m;
+			}
+		return n;
+	}
+
+	uint32_t bit = bitpos(hash, shift);
+	if (n->datamap & bit) {
+		if (!equal(n->kv[2*index(n->datamap, bit)], key))
+			return n;
+		*removed = true;
+		if (n->ndata == 1 && n->nnodes == 0)
+			return 0;
+		return reshape(n, edit, bit, Value(), Value(), 0);
+	}
+	if (n->nodemap & bit) {
+		unsigned j = index(n->nodemap, bit);
+		HamtNode *child = n->nodes()[j];
+		HamtNode *c = node_dissoc(child, edit, shift + HAMT_BITS,
+		                          hash, key, removed);
+		if (c == child)
+			return n;
+		if (!c) {
+			if (n->ndata == 0 && n->nnodes == 1)
+				return 0;
+			return reshape(n, edit, bit, Value(), Value(), 0);
+		}
+		/* pull a lone entry up so the trie stays compact */
+		if (c->ndata == 1 && c->nnodes == 0)
+			return reshape(n, edit, bit, c->kv[0], c->kv[1], 0);
+		n = editable(n, edit);
+		n->nodes()[j] = c;
+		return n;
+	}
+	return n;
+}
+
+static Value *
+hamt_lookup(Hamt *h, Value key)
+{
+	return node_lookup(h->root, hash_equal(key), key);
+}
+
+/* update h in place, copying only nodes the edit does not own */
+static void
+hamt_assoc(Hamt *h, void *edit, Value key, Value val)
+{
+	size_t hash = hash_equal(key);
+	bool added = false;
+	if (!h->root) {
+		HamtNode *n = alloc_node(edit, 1, 0);
+		n->datamap = bitpos(hash, 0);
+		n->kv[0] = key;
+		n->kv[1] = val;
+		h->root = n;
+		h->count = 1;
+		return;
+	}
+	h->root = node_assoc(h->root, edit, 0, hash, key, val, &added);
+	h->count += added;
+}
+
+static void
+hamt_dissoc(Hamt *h, void *edit, Value key)
+{
+	bool removed = false;
+	if (!h->root)
+		return;
+	h->root = node_dissoc(h->root, edit, 0, hash_equal(key), key, &removed);
+	h->count -= removed;
+}
+
+static Hamt *
+copy_hamt(Hamt *h)
+{
+	Hamt *r = new Hamt(h->typecode());
+	r->count = h->count;
+	r->root = h->root;
+	return r;
+}
+
+template <class F>
+static void
+each_node_entry(HamtNode *n, F &f)
+{
+	if (!n)
+		return;
+	for (unsigned i = 0; i < n->ndata; i++)
+		f(n->kv[2*i], n->kv[2*i+1]);
+	for (unsigned i = 0; i < n->nnodes; i++)
+		each_node_entry(n->nodes()[i], f);
+}
+
+struct entry_lister {
+	Value list;
+	bool pairs;
+	entry_lister(bool pairs) : list(NIL), pairs(pairs) {}
+	void operator()(Value key, Value val)
+		{ list = cons(pairs ? cons(key, val) : key, list); }
+};
+
+/* alist for a map, list of members for a set */
+Value
+hamt_entries(Hamt *h)
+{
+	entry_lister f(h->typecode() == TC_HASH_MAP);
+	each_node_entry(h->root, f);
+	return f.list;
+}
+
+struct entry_checker {
+	Hamt *other;
+	bool same;
+	entry_checker(Hamt *other) : other(other), same(true) {}
+	void operator()(Value key, Value val) {
+		Value *p;
+		if (same && (!(p = hamt_lookup(other, key)) || !equal(*p, val)))
+			same = false;
+	}
+};
+
+bool
+hamt_equal(Hamt *x, Hamt *y)
+{
+	if (x->typecode() != y->typecode() || x->count != y->count)
+		return false;
+	entry_checker f(y);
+	each_node_entry(x->root, f);
+	return f.same;
+}
+
+struct entry_hasher {
+	size_t hash;
+	entry_hasher() : hash(0) {}
+	void operator()(Value key, Value val)
+		{ hash += hash_equal(key) * 31 + hash_equal(val); }
+};
+
+/* independent of the order of entries, so equal tries hash alike */
+size_t
+hamt_hash(Hamt *h)
+{
+	entry_hasher f;
+	each_node_entry(h->root, f);
+	return f.hash;
+}
+
+/*
+  Primitives. Maps and sets share the trie; a set maps each member to
+  true. Persistent operations return a new object, transient ones
+  (ending in !) modify the transient and return it.
+*/
+
+static Hamt *
+check_hamt(Value x, TypeCode tc, bool transient, const char *op)
+{
+	if (!is_ptr(x) || as_ptr(x)->typecode() != tc)
+		type_error(op);
+	Hamt *h = as_hamt(x);
+	if (transient != (h->edit != 0))
+		errorf(Error(), "%s: %s", op,
+		       transient ? "not a transient" : "transient");
+	return h;
+}
+
+DEF_PRIM(prim_hash_map, "hash-map", ~0)
+{
+	if (nargs % 2)
+		error(Error(), "hash-map: odd number of arguments");
+	Hamt *h = new HashMap;
+	h->edit = h;
+	for (unsigned i = 0; i < nargs; i += 2)
+		hamt_assoc(h, h, arg[i], arg[i+1]);
+	h->edit = 0;
+	return h;
+}
+
+DEF_PRIM(prim_alist_to_hash_map, "alist->hash-map", 1)
+{
+	Hamt *h = new HashMap;
+	h->edit = h;
+	Value p = arg[0];
+	for (; is_pair(p) && is_pair(car(p)); p = cdr(p))
+		hamt_assoc(h, h, car(car(p)), cdr(car(p)));
+	if (!is_nil(p))
+		type_error("alist->hash-map");
+	h->edit = 0;
+	return h;
+}
+
+DEF_PRIM(prim_is_hash_map, "hash-map?", 1)
+{
+	return make_bool(is_hash_map(arg[0]));
+}
+
+/* (hash-map-ref map key [default]) */
+DEF_PRIM(prim_hash_map_ref, "hash-map-ref", ~2)
+{
+	if (!is_hash_map(arg[0]))
+		type_error("hash-map-ref");
+	if (nargs > 3)
+		error(ArityError(), "arity error: hash-map-ref");
+	Value *p = hamt_lookup(as_hamt(arg[0]), arg[1]);
+	if (p)
+		return *p;
+	if (nargs == 3)
+		return arg[2];
+	error(Error(), "hash-map-ref: key not found");
+}
+
+DEF_PRIM(prim_hash_map_contains, "hash-map-contains?", 2)
+{
+	if (!is_hash_map(arg[0]))
+		type_error("hash-map-contains?");
+	return make_bool(hamt_lookup(as_hamt(arg[0]), arg[1]) != 0);
+}
+
+DEF_PRIM(prim_hash_map_count, "hash-map-count", 1)
+{
+	if (!is_hash_map(arg[0]))
+		type_error("hash-map-count");
+	return make_fixnum(as_hamt(arg[0])->count);
+}
+
+DEF_PRIM(prim_hash_map_set, "hash-map-set", 3)
+{
+	Hamt *h = copy_hamt(check_hamt(arg[0], TC_HASH_MAP, false,
+	                               "hash-map-set"));
+	hamt_assoc(h, 0, arg[1], arg[2]);
+	return h;
+}
+
+DEF_PRIM(prim_hash_map_delete, "hash-map-delete", 2)
+{
+	Hamt *h = copy_hamt(check_hamt(arg[0], TC_HASH_MAP, false,
+	                               "hash-map-delete"));
+	hamt_dissoc(h, 0, arg[1]);
+	return h;
+}
+
+DEF_PRIM(prim_hash_map_to_alist, "hash-map->alist", 1)
+{
+	if (!is_hash_map(arg[0]))
+		type_error("hash-map->alist");
+	return hamt_entries(as_hamt(arg[0]));
+}
+
+DEF_PRIM(prim_hash_map_transient, "hash-map-transient", 1)
+{
+	Hamt *h = copy_hamt(check_hamt(arg[0], TC_HASH_MAP, false,
+	                               "hash-map-transient"));
+	h->edit = h;
+	return h;
+}
+
+DEF_PRIM(prim_hash_map_set_bang, "hash-map-set!", 3)
+{
+	Hamt *h = check_hamt(arg[0], TC_HASH_MAP, true, "hash-map-set!");
+	hamt_assoc(h, h->edit, arg[1], arg[2]);
+	return h;
+}
+
+DEF_PRIM(prim_hash_map_delete_bang, "hash-map-delete!", 2)
+{
+	Hamt *h = check_hamt(arg[0], TC_HASH_MAP, true, "hash-map-delete!");
+	hamt_dissoc(h, h->edit, arg[1]);
+	return h;
+}
+
+/* end the transient; its nodes are then shared and never changed */
+DEF_PRIM(prim_hash_map_persistent, "hash-map-persistent!", 1)
+{
+	Hamt *h = check_hamt(arg[0], TC_HASH_MAP, true,
+	                     "hash-map-persistent!");
+	h->edit = 0;
+	return h;
+}
+
+DEF_PRIM(prim_hash_set, "hash-set", ~0)
+{
+	Hamt *h = new HashSet;
+	h->edit = h;
+	for (unsigned i = 0; i < nargs; i++)
+		hamt_assoc(h, h, arg[i], _T);
+	h->edit = 0;
+	return h;
+}
+
+DEF_PRIM(prim_list_to_hash_set, "list->hash-set", 1)
+{
+	Hamt *h = new HashSet;
+	h->edit = h;
+	Value p = arg[0];
+	for (; is_pair(p); p = cdr(p))
+		hamt_assoc(h, h, car(p), _T);
+	if (!is_nil(p))
+		type_error("list->hash-set");
+	h->edit = 0;
+	return h;
+}
+
+DEF_PRIM(prim_is_hash_set, "hash-set?", 1)
+{
+	return make_bool(is_hash_set(arg[0]));
+}
+
+DEF_PRIM(prim_hash_set_contains, "hash-set-contains?", 2)
+{
+	if (!is_hash_set(arg[0]))
+		type_error("hash-set-contains?");
+	return make_bool(hamt_lookup(as_hamt(arg[0]), arg[1]) != 0);
+}
+
+DEF_PRIM(prim_hash_set_count, "hash-set-count", 1)
+{
+	if (!is_hash_set(arg[0]))
+		type_error("hash-set-count");
+	return make_fixnum(as_hamt(arg[0])->count);
+}
+
+DEF_PRIM(prim_hash_set_add, "hash-set-add", 2)
+{
+	Hamt *h = copy_hamt(check_hamt(arg[0], TC_HASH_SET, false,
+	                               "hash-set-add"));
+	hamt_assoc(h, 0, arg[1], _T);
+	return h;
+}
+
+DEF_PRIM(prim_hash_set_delete, "hash-set-delete", 2)
+{
+	Hamt *h = copy_hamt(check_hamt(arg[0], TC_HASH_SET, false,
+	                               "hash-set-delete"));
+	hamt_dissoc(h, 0, arg[1]);
+	return h;
+}
+
+DEF_PRIM(prim_hash_set_to_list, "hash-set->list", 1)
+{
+	if (!is_hash_set(arg[0]))
+		type_error("hash-set->list");
+	return hamt_entries(as_hamt(arg[0]));
+}
+
+DEF_PRIM(prim_hash_set_transient, "hash-set-transient", 1)
+{
+	Hamt *h = copy_hamt(check_hamt(arg[0], TC_HASH_SET, false,
+	                               "hash-set-transient"));
+	h->edit = h;
+	return h;
+}
+
+DEF_PRIM(prim_hash_set_add_bang, "hash-set-add!", 2)
+{
+	Hamt *h = check_hamt(arg[0], TC_HASH_SET, true, "hash-set-add!");
+	hamt_assoc(h, h->edit, arg[1], _T);
+	return h;
+}
+
+DEF_PRIM(prim_hash_set_delete_bang, "hash-set-delete!", 2)
+{
+	Hamt *h = check_hamt(arg[0], TC_HASH_SET, true, "hash-set-delete!");
+	hamt_dissoc(h, h->edit, arg[1]);
+	return h;
+}
+
+DEF_PRIM(prim_hash_set_persistent, "hash-set-persistent!", 1)
+{
+	Hamt *h = check_hamt(arg[0], TC_HASH_SET, true,
+	                     "hash-set-persistent!");
+	h->edit = 0;
+	return h;
+}
+
+const prim_info
+hamt_prims[] = {
+	_prim_hash_map,
+	_prim_alist_to_hash_map,
+	_prim_is_hash_map,
+	_prim_hash_map_ref,
+	_prim_hash_map_contains,
+	_prim_hash_map_count,
+	_prim_hash_map_set,
+	_prim_hash_map_delete,
+	_prim_hash_map_to_alist,
+	_prim_hash_map_transient,
+	_prim_hash_map_set_bang,
+	_prim_hash_map_delete_bang,
+	_prim_hash_map_persistent,
+	_prim_hash_set,
+	_prim_list_to_hash_set,
+	_prim_is_hash_set,
+	_prim_hash_set_contains,
+	_prim_hash_set_count,
+	_prim_hash_set_add,
+	_prim_hash_set_delete,
+	_prim_hash_set_to_list,
+	_prim_hash_set_transient,
+	_prim_hash_set_add_bang,
+	_prim_hash_set_delete_bang,
+	_prim_hash_set_persistent,
+};
+
+const unsigned hamt_nprims = NELEMS(hamt_prims);
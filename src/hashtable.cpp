@@ -0,0 +1,452 @@
+/*
+  hashtable.cpp - Open-addressing hash tables
+*/
+
+#include <cstring>
+#include "lisp.h"
+#include "number.h"
+#include "prim.h"
+#include "util.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+  Slots are grouped sixteen at a time. Each has a control byte: EMPTY,
+  DELETED, or the low seven bits of the key's hash when full, so one
+  group is filtered with a single SSE2 compare before any key is
+  touched. Groups are probed triangularly, which visits every group
+  of a power-of-two table.
+*/
+#define GROUP 16
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+/* slots moved from the old table per mutation while growing */
+#define MIGRATE_STEP (2 * GROUP)
+
+#define NOT_FOUND ((size_t) -1)
+
+#ifdef __SSE2__
+static inline unsigned
+match_byte(const uint8_t *g, uint8_t b)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) g);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(b)));
+}
+
+/* empty and deleted both have the top bit set */
+static inline unsigned
+match_free(const uint8_t *g)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) g));
+}
+#else
+static inline unsigned
+match_byte(const uint8_t *g, uint8_t b)
+{
+	unsigned m = 0;
+	for (unsigned i = 0; i < GROUP; i++)
+		m |= (g[i] == b) << i;
+	return m;
+}
+
+static inline unsigned
+match_free(const uint8_t *g)
+{
+	unsigned m = 0;
+	for (unsigned i = 0; i < GROUP; i++)
+		m |= (g[i] >> 7) << i;
+	return m;
+}
+#endif
+
+/* MurmurHash3 finaliser */
+static inline size_t
+mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t
+hash_bytes(const void *p, size_t n)
+{
+	const uint8_t *s = (const uint8_t *) p;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ s[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/* boxed numbers hash by content to agree with eqv? */
+static size_t
+hash_eqv(Value x)
+{
+	if (is_bignum(x))
+		return mix(hash_bytes(as_bignum(x)->digit,
+		                      as_bignum(x)->len * sizeof(uint32_t))
+		           ^ as_bignum(x)->neg);
+	if (is_flonum(x))
+		return mix(Value::double_bits(as_flonum(x)));
+	return mix(x._bits());
+}
+
+/* agrees with equal? */
+size_t
+hash_equal(Value x)
+{
+	size_t h = 0x9e3779b97f4a7c15ULL;
+	for (; is_pair(x); x = cdr(x))
+		h = mix(h + hash_equal(car(x)));
+	if (is_string(x))
+		return mix(h + hash_bytes(as_string(x)->value, as_string(x)->len));
+	if (is_vector(x)) {
+		for (size_t i = 0; i < as_vector(x)->len; i++)
+			h = mix(h + hash_equal(as_vector(x)->items[i]));
+		return h;
+	}
+	if (is_hamt(x))
+		return mix(h + hamt_hash(as_hamt(x)) + as_ptr(x)->typecode());
+	return mix(h + hash_eqv(x));
+}
+
+static size_t
+hash_string(Value x)
+{
+	if (!is_string(x) && !is_symbol(x))
+		type_error("string hash table key");
+	return mix(hash_bytes(as_string(x)->value, as_string(x)->len));
+}
+
+static inline bool
+key_equal(uint8_t kind, Value x, Value y)
+{
+	if (x == y)
+		return true;
+	if (x._is_none())
+		return false;
+	if (kind == HASH_EQV)
+		return is_ptr(x) && is_ptr(y) && num_eqv(x, y);
+	String *a = as_string(x), *b = as_string(y);
+	return a->len == b->len && !memcmp(a->value, b->value, a->len);
+}
+
+static inline size_t
+hash_key(uint8_t kind, Value key)
+{
+	return kind == HASH_EQV ? hash_eqv(key) : hash_string(key);
+}
+
+static inline uint8_t
+ctrl_hash(size_t hash)
+{
+	return hash >> (sizeof(size_t) * 8 - 7);
+}
+
+static size_t
+find(const HashTable::Slots &s, uint8_t kind, size_t hash, Value key)
+{
+	if (!s.cap)
+		return NOT_FOUND;
+	size_t gmask = s.cap / GROUP - 1;
+	size_t g = hash & gmask;
+	uint8_t h2 = ctrl_hash(hash);
+	for (size_t step = 1; ; step++) {
+		const uint8_t *grp = s.ctrl + g * GROUP;
+		for (unsigned m = match_byte(grp, h2); m; m &= m - 1) {
+			size_t i = g * GROUP + __builtin_ctz(m);
+			if (key_equal(kind, s.keys[i], key))
+				return i;
+		}
+		if (match_byte(grp, CTRL_EMPTY))
+			return NOT_FOUND;
+		g = (g + step) & gmask;
+	}
+}
+
+/* weak keys are held in atomic memory and cleared by the collector */
+static inline void
+link_key(Value *slot, Value key)
+{
+	void *base;
+	if (is_ptr(key) && (base = GC_base(as_ptr(key))))
+		GC_general_register_disappearing_link((void **) slot, base);
+}
+
+static inline void
+unlink_key(Value *slot)
+{
+	GC_unregister_disappearing_link((void **) slot);
+}
+
+static void
+alloc_slots(HashTable::Slots &s, size_t cap, bool weak)
+{
+	s.cap = cap;
+	s.used = 0;
+	s.ctrl = (uint8_t *) GC_MALLOC_ATOMIC(cap);
+	memset(s.ctrl, CTRL_EMPTY, cap);
+	if (weak) {
+		s.keys = (Value *) GC_MALLOC_ATOMIC(cap * sizeof(Value));
+		memset((void *) s.keys, 0, cap * sizeof(Value));
+	}
+	else
+		s.keys = (Value *) GC_MALLOC(cap * sizeof(Value));
+	s.vals = (Value *) GC_MALLOC(cap * sizeof(Value));
+}
+
+HashTable::HashTable(HashKind kind, bool weak)
+	: Object(TC), count(0), migrated(0), kind(kind), weak(weak)
+{
+	memset(&old, 0, sizeof(old));
+	alloc_slots(cur, GROUP, weak);
+}
+
+/* put a key known to be absent into the first free slot on its probe */
+void
+HashTable::put(Slots &s, size_t hash, Value key, Value value)
+{
+	size_t gmask = s.cap / GROUP - 1;
+	size_t g = hash & gmask;
+	for (size_t step = 1; ; step++) {
+		unsigned m = match_free(s.ctrl + g * GROUP);
+		if (m) {
+			size_t i = g * GROUP + __builtin_ctz(m);
+			if (s.ctrl[i] == CTRL_EMPTY)
+				s.used++;
+			s.ctrl[i] = ctrl_hash(hash);
+			s.keys[i] = key;
+			s.vals[i] = value;
+			if (weak)
+				link_key(&s.keys[i], key);
+			return;
+		}
+		g = (g + step) & gmask;
+	}
+}
+
+/* move up to n slots from the old table */
+void
+HashTable::migrate(size_t n)
+{
+	if (!old.cap)
+		return;
+	size_t end = migrated + n < old.cap ? migrated + n : old.cap;
+	for (size_t i = migrated; i < end; i++) {
+		if (old.ctrl[i] & 0x80)
+			continue;
+		Value key = old.keys[i];
+		if (weak)
+			unlink_key(&old.keys[i]);
+		if (key._is_none())
+			count--;
+		else
+			put(cur, hash_key(kind, key), key, old.vals[i]);
+	}
+	migrated = end;
+	if (migrated == old.cap)
+		memset(&old, 0, sizeof(old));
+}
+
+/*
+  Start a new table sized for twice the live entries; a table full of
+  tombstones is thus rebuilt at the same size. The load limit of 7/8
+  leaves room for the old entries to move over before it is reached.
+*/
+void
+HashTable::grow()
+{
+	migrate(old.cap);
+	size_t cap = GROUP;
+	while (cap * 7 / 8 < (count + 1) * 2)
+		cap *= 2;
+	old = cur;
+	migrated = 0;
+	alloc_slots(cur, cap, weak);
+}
+
+Value *
+HashTable::lookup(Value key)
+{
+	size_t hash = hash_key(kind, key);
+	size_t i = find(cur, kind, hash, key);
+	if (i != NOT_FOUND)
+		return &cur.vals[i];
+	i = find(old, kind, hash, key);
+	if (i != NOT_FOUND && i >= migrated)
+		return &old.vals[i];
+	return 0;
+}
+
+void
+HashTable::insert(Value key, Value value)
+{
+	Value *p = lookup(key);
+	if (p) {
+		*p = value;
+		return;
+	}
+	migrate(MIGRATE_STEP);
+	if (cur.used + 1 > cur.cap * 7 / 8)
+		grow();
+	put(cur, hash_key(kind, key), key, value);
+	count++;
+}
+
+bool
+HashTable::remove(Value key)
+{
+	size_t hash = hash_key(kind, key);
+	Slots *s = &cur;
+	size_t i = find(cur, kind, hash, key);
+	if (i == NOT_FOUND) {
+		s = &old;
+		i = find(old, kind, hash, key);
+		if (i == NOT_FOUND || i < migrated)
+			return false;
+	}
+	if (weak)
+		unlink_key(&s->keys[i]);
+	s->ctrl[i] = CTRL_DELETED;
+	s->keys[i] = Value();
+	s->vals[i] = Value();
+	count--;
+	migrate(MIGRATE_STEP);
+	return true;
+}
+
+/* call f on each live entry of both tables */
+template <class F>
+static void
+each_entry(HashTable *t, F &f)
+{
+	for (size_t i = 0; i < t->cur.cap; i++)
+		if (!(t->cur.ctrl[i] & 0x80) && !t->cur.keys[i]._is_none())
+			f(t->cur.keys[i], t->cur.vals[i]);
+	for (size_t i = t->migrated; i < t->old.cap; i++)
+		if (!(t->old.ctrl[i] & 0x80) && !t->old.keys[i]._is_none())
+			f(t->old.keys[i], t->old.vals[i]);
+}
+
+struct collect_entries {
+	Value list;
+	int what;
+	collect_entries(int what) : list(NIL), what(what) {}
+	void operator()(Value key, Value val) {
+		list = cons(what == 0 ? key : what == 1 ? val : cons(key, val),
+		            list);
+	}
+};
+
+static HashTable *
+check_hash_table(Value x, const char *op)
+{
+	if (!is_hash_table(x))
+		type_error(op);
+	return as_hash_table(x);
+}
+
+static Value
+check_key(HashTable *t, Value key, const char *op)
+{
+	if (t->kind == HASH_STRING && !is_string(key) && !is_symbol(key))
+		type_error(op);
+	return key;
+}
+
+DEF_PRIM(prim_make_hash_table, "make-hash-table", 0)
+{
+	return new HashTable(HASH_EQV, false);
+}
+
+DEF_PRIM(prim_make_string_hash_table, "make-string-hash-table", 0)
+{
+	return new HashTable(HASH_STRING, false);
+}
+
+/* keys are held weakly; entries go once the key is collected */
+DEF_PRIM(prim_make_weak_hash_table, "make-weak-hash-table", 0)
+{
+	return new HashTable(HASH_EQV, true);
+}
+
+DEF_PRIM(prim_is_hash_table, "hash-table?", 1)
+{
+	return make_bool(is_hash_table(arg[0]));
+}
+
+/* (hash-table-ref table key [default]) */
+DEF_PRIM(prim_hash_table_ref, "hash-table-ref", ~2)
+{
+	HashTable *t = check_hash_table(arg[0], "hash-table-ref");
+	if (nargs > 3)
+		error(ArityError(), "arity error: hash-table-ref");
+	Value *p = t->lookup(check_key(t, arg[1], "hash-table-ref"));
+	if (p)
+		return *p;
+	if (nargs == 3)
+		return arg[2];
+	error(Error(), "hash-table-ref: key not found");
+}
+
+DEF_PRIM(prim_hash_table_set, "hash-table-set!", 3)
+{
+	HashTable *t = check_hash_table(arg[0], "hash-table-set!");
+	t->insert(check_key(t, arg[1], "hash-table-set!"), arg[2]);
+	return arg[2];
+}
+
+DEF_PRIM(prim_hash_table_delete, "hash-table-delete!", 2)
+{
+	HashTable *t = check_hash_table(arg[0], "hash-table-delete!");
+	return make_bool(t->remove(check_key(t, arg[1], "hash-table-delete!")));
+}
+
+DEF_PRIM(prim_hash_table_contains, "hash-table-contains?", 2)
+{
+	HashTable *t = check_hash_table(arg[0], "hash-table-contains?");
+	return make_bool(t->lookup(check_key(t, arg[1],
+	                                     "hash-table-contains?")) != 0);
+}
+
+/* for weak tables, includes entries whose keys are not yet purged */
+DEF_PRIM(prim_hash_table_count, "hash-table-count", 1)
+{
+	return make_fixnum(check_hash_table(arg[0], "hash-table-count")->count);
+}
+
+#define DEF_COLLECT_PRIM(name, symname, what)              \
+DEF_PRIM(name, symname, 1)                                 \
+{                                                          \
+	collect_entries f(what);                           \
+	each_entry(check_hash_table(arg[0], symname), f);  \
+	return f.list;                                     \
+}
+
+DEF_COLLECT_PRIM(prim_hash_table_keys, "hash-table-keys", 0)
+DEF_COLLECT_PRIM(prim_hash_table_values, "hash-table-values", 1)
+DEF_COLLECT_PRIM(prim_hash_table_to_alist, "hash-table->alist", 2)
+
+const prim_info
+hash_prims[] = {
+	_prim_make_hash_table,
+	_prim_make_string_hash_table,
+	_prim_make_weak_hash_table,
+	_prim_is_hash_table,
+	_prim_hash_table_ref,
+	_prim_hash_table_set,
+	_prim_hash_table_delete,
+	_prim_hash_table_contains,
+	_prim_hash_table_count,
+	_prim_hash_table_keys,
+	_prim_hash_table_values,
+	_prim_hash_table_to_alist,
+};
+
+const unsigned hash_nprims = NELEMS(hash_prims);
@@ -13,6 +13,12 @@ enum Mode {
 	MACRO_REF = Expr::MACRO_REF,
 	DEFINE = Expr::DEFINE,
 	DEFINE_MACRO = Expr::DEFINE_MACRO,
+	SLOT_REF = Expr::SLOT_REF,
+	SLOT_SET = Expr::SLOT_SET,
+	LAZY = Expr::LAZY,
+	VECTOR_REF = Expr::VECTOR_REF,
+	FUSED = Expr::FUSED,
+	CASE = Expr::CASE,
 	EXIT,  // exit interpreter loop
 	THEN,  // receives predicate from COND
 	SEQ_NEXT,
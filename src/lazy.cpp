@@ -0,0 +1,272 @@
+/*
+  lazy.cpp - Promises, iterators and lazy sequences
+*/
+
+#include "lisp.h"
+#include "number.h"
+#include "prim.h"
+#include "util.h"
+
+/*
+  An iterator is a single mutable object whose kind says how to step
+  it. Lists, vectors and numeric vectors are walked in place, so no
+  closure or pair is allocated per element; the lazy operations wrap
+  their source iterator. Exhausted iterators become ITER_DONE and stay
+  that way. Generators are thunks that return #eof when they finish,
+  and input ports give the datums read from them until end of input.
+*/
+
+Iterator *
+make_iterator(Value x, const char *op)
+{
+	if (is_iterator(x))
+		return as_iterator(x);
+	if (is_pair(x) || is_nil(x))
+		return new Iterator(ITER_LIST, x);
+	if (is_vector(x))
+		return new Iterator(ITER_VECTOR, x, NIL, make_fixnum(0));
+	if (is_numvector(x))
+		return new Iterator(ITER_NUMVECTOR, x, NIL, make_fixnum(0));
+	if (is_port(x) && (as_port(x)->flags & PORT_INPUT))
+		return new Iterator(ITER_PORT, x);
+	type_error(op);
+}
+
+/* next element, or none at the end */
+Value
+iter_next(Iterator *it)
+{
+	Value x;
+
+	switch (it->kind) {
+	case ITER_LIST:
+		x = it->src;
+		if (is_pair(x)) {
+			it->src = cdr(x);
+			return car(x);
+		}
+		if (!is_nil(x))
+			type_error("iter-next!");
+		break;
+	case ITER_VECTOR: {
+		size_t i = as_fixnum(it->pos);
+		if (i < as_vector(it->src)->len) {
+			it->pos = make_fixnum(i + 1);
+			return as_vector(it->src)->items[i];
+		}
+		break;
+		}
+	case ITER_NUMVECTOR: {
+		size_t i = as_fixnum(it->pos);
+		if (i < as_numvector(it->src)->len) {
+			it->pos = make_fixnum(i + 1);
+			return numvector_ref(as_numvector(it->src), i);
+		}
+		break;
+		}
+	case ITER_RANGE:
+		x = it->pos;
+		if (is_nil(it->end) || (is_fixnum(x) && is_fixnum(it->end)
+		                        ? as_fixnum(x) <= as_fixnum(it->end)
+		                        : num_compare(x, it->end) <= 0)) {
+			it->pos = num_add(x, make_fixnum(1));
+			return x;
+		}
+		break;
+	case ITER_GENERATOR:
+		x = apply_argv(it->fun, 0, 0);
+		if (!is_eof(x))
+			return x;
+		break;
+	case ITER_PORT:
+		if (as_port(it->src)->flags & PORT_CLOSED)
+			error(Error(), "iter-next!: port is closed");
+		x = port_read(as_port(it->src));
+		if (!is_eof(x))
+			return x;
+		break;
+	case ITER_MAP:
+		x = iter_next(as_iterator(it->src));
+		if (!is_none(x))
+			return apply_argv(it->fun, 1, &x);
+		break;
+	case ITER_FILTER:
+		while (!is_none(x = iter_next(as_iterator(it->src))))
+			if (apply_argv(it->fun, 1, &x) != _F)
+				return x;
+		break;
+	case ITER_TAKE:
+		if (as_fixnum(it->pos) > 0) {
+			it->pos = make_fixnum(as_fixnum(it->pos) - 1);
+			x = iter_next(as_iterator(it->src));
+			if (!is_none(x))
+				return x;
+		}
+		break;
+	case ITER_DONE:
+		return NULL_VALUE;
+	}
+	it->kind = ITER_DONE;
+	it->src = it->fun = it->pos = it->end = NIL;
+	return NULL_VALUE;
+}
+
+/* (delay x) expands to (%make-promise (lambda () x)) */
+DEF_PRIM(prim_make_promise, "%make-promise", 1)
+{
+	return new Promise(arg[0]);
+}
+
+DEF_PRIM(prim_force, "force", 1)
+{
+	if (!is_promise(arg[0]))
+		return arg[0];
+	Promise *p = as_promise(arg[0]);
+	if (!p->done) {
+		Value x = apply_argv(p->thunk, 0, 0);
+		/* forcing may have re-entered and finished first */
+		if (!p->done) {
+			p->value = x;
+			p->done = true;
+			p->thunk = NIL;
+		}
+	}
+	return p->value;
+}
+
+DEF_PRIM(prim_is_promise, "promise?", 1)
+{
+	return make_bool(is_promise(arg[0]));
+}
+
+DEF_PRIM(prim_eof_object, "eof-object", 0)
+{
+	return _EOF;
+}
+
+DEF_PRIM(prim_is_eof_object, "eof-object?", 1)
+{
+	return make_bool(is_eof(arg[0]));
+}
+
+/* (iter x), an iterator over a list, vector or numeric vector */
+DEF_PRIM(prim_iter, "iter", 1)
+{
+	return make_iterator(arg[0], "iter");
+}
+
+DEF_PRIM(prim_is_iterator, "iterator?", 1)
+{
+	return make_bool(is_iterator(arg[0]));
+}
+
+/* next element, or #eof when there are no more */
+DEF_PRIM(prim_iter_next, "iter-next!", 1)
+{
+	if (!is_iterator(arg[0]))
+		type_error("iter-next!");
+	Value x = iter_next(as_iterator(arg[0]));
+	return is_none(x) ? _EOF : x;
+}
+
+DEF_PRIM(prim_iter_to_list, "iter->list", 1)
+{
+	Iterator *it = make_iterator(arg[0], "iter->list");
+	Value list = NIL, x;
+	while (!is_none(x = iter_next(it)))
+		list = cons(x, list);
+	return reverse(list);
+}
+
+/* (generator thunk), calling thunk for each element until it returns #eof */
+DEF_PRIM(prim_generator, "generator", 1)
+{
+	if (!is_procedure(arg[0]))
+		type_error("generator");
+	return new Iterator(ITER_GENERATOR, NIL, arg[0]);
+}
+
+/* (lazy-range from [to]), inclusive, unbounded without to */
+DEF_PRIM(prim_lazy_range, "lazy-range", ~1)
+{
+	if (nargs > 2)
+		error(ArityError(), "arity error: lazy-range");
+	Value to = nargs > 1 ? arg[1] : NIL;
+	if (!is_number(arg[0]) || (!is_nil(to) && !is_number(to)))
+		type_error("lazy-range");
+	return new Iterator(ITER_RANGE, NIL, NIL, arg[0], to);
+}
+
+DEF_PRIM(prim_lazy_map, "lazy-map", 2)
+{
+	return new Iterator(ITER_MAP, make_iterator(arg[1], "lazy-map"), arg[0]);
+}
+
+DEF_PRIM(prim_lazy_filter, "lazy-filter", 2)
+{
+	return new Iterator(ITER_FILTER, make_iterator(arg[1], "lazy-filter"),
+	                    arg[0]);
+}
+
+/* (lazy-take n seq), at most the first n elements */
+DEF_PRIM(prim_lazy_take, "lazy-take", 2)
+{
+	if (!is_fixnum(arg[0]) || as_fixnum(arg[0]) < 0)
+		type_error("lazy-take");
+	return new Iterator(ITER_TAKE, make_iterator(arg[1], "lazy-take"),
+	                    NIL, arg[0]);
+}
+
+/* (lazy-drop n seq) skips the first n elements now and returns seq */
+DEF_PRIM(prim_lazy_drop, "lazy-drop", 2)
+{
+	if (!is_fixnum(arg[0]) || as_fixnum(arg[0]) < 0)
+		type_error("lazy-drop");
+	Iterator *it = make_iterator(arg[1], "lazy-drop");
+	for (Fixnum n = as_fixnum(arg[0]); n > 0; n--)
+		if (is_none(iter_next(it)))
+			break;
+	return it;
+}
+
+/* (lazy-fold f init seq), a left fold in constant space */
+DEF_PRIM(prim_lazy_fold, "lazy-fold", 3)
+{
+	Iterator *it = make_iterator(arg[2], "lazy-fold");
+	Value argv[2] = {arg[1], NIL};
+	while (!is_none(argv[1] = iter_next(it)))
+		argv[0] = apply_argv(arg[0], 2, argv);
+	return argv[0];
+}
+
+DEF_PRIM(prim_lazy_for_each, "lazy-for-each", 2)
+{
+	Iterator *it = make_iterator(arg[1], "lazy-for-each");
+	Value x;
+	while (!is_none(x = iter_next(it)))
+		apply_argv(arg[0], 1, &x);
+	return NIL;
+}
+
+const prim_info
+lazy_prims[] = {
+	_prim_make_promise,
+	_prim_force,
+	_prim_is_promise,
+	_prim_eof_object,
+	_prim_is_eof_object,
+	_prim_iter,
+	_prim_is_iterator,
+	_prim_iter_next,
+	_prim_iter_to_list,
+	_prim_generator,
+	_prim_lazy_range,
+	_prim_lazy_map,
+	_prim_lazy_filter,
+	_prim_lazy_take,
+	_prim_lazy_drop,
+	_prim_lazy_fold,
+	_prim_lazy_for_each,
+};
+
+const unsigned lazy_nprims = NELEMS(lazy_prims);
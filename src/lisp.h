@@ -3,6 +3,7 @@
 
 #define UNUSED __attribute__((unused))
 #define NORETURN __attribute__((noreturn))
+#define NOINLINE __attribute__((noinline))
 #define INIT static __attribute__((constructor)) void __i_n_i_t__(void)
 
 #include "value.h"
@@ -16,7 +17,11 @@ public:
 };
 
 class BaseError {};
-class Error : public BaseError {};
+class Error : public BaseError {
+public:
+	bool located;  /* the source of the error has been printed */
+	Error() : located(false) {}
+};
 class FatalError : public BaseError {};
 class TypeError : public Error {};
 class ParseError : public Error {};
@@ -52,52 +57,149 @@ class ArityError : public Error {};
 extern Symbol
 	*sym_quote, *sym_quasiquote, *sym_unquote, *sym_unquote_splicing,
 	*sym_lambda, *sym_if, *sym_begin, *sym_define, *sym_define_macro,
+	*sym_and, *sym_or, *sym_cond, *sym_when, *sym_assert, *sym_case,
 	*sym_at_lambda, *sym_at_constructor, *sym_at_accessor, *sym_at_mutator,
 	*sym_this_module;
 
+extern Port *stdin_port, *stdout_port, *stderr_port;
+
+extern void
+port_write(Port *port, const char *s, size_t n);
+
+/* a byte goes straight into the buffer unless it has to be flushed */
+static inline void
+port_putc(Port *port, int c)
+{
+	if (port->len < port->cap && !(port->flags & PORT_UNBUFFERED)
+	    && (c != '\n' || !(port->flags & PORT_LINEBUF)))
+		port->buf[port->len++] = c;
+	else {
+		char ch = c;
+		port_write(port, &ch, 1);
+	}
+}
+
+extern void
+port_flush(Port *port);
+
+extern Value
+port_read(Port *port);
+
+/* what the output ports still hold, as written at exit */
 extern void
-print(Value x);
+flush_ports(void);
 
 extern void
-println(Value x);
+print(Value x, Port *port = stdout_port);
+
+extern void
+println(Value x, Port *port = stdout_port);
 
 extern unsigned
 length(Value p);
 
+extern Vector *
+make_vector(size_t len, Value fill);
+
+extern Value
+vector_ref(Value vec, Value index);
+
+extern bool
+is_vector_ref_prim(Value fun);
+
+/* list operations the compiler can fuse into a single loop */
+enum ListOp {
+	LIST_OP_NONE, LIST_OP_RANGE, LIST_OP_MAP, LIST_OP_FILTER,
+	LIST_OP_FOLDL, LIST_OP_SUM, LIST_OP_PRODUCT, LIST_OP_LENGTH
+};
+
+extern ListOp
+list_op(Value fun);
+
+extern int
+compare(Value x, Value y);
+
+extern bool
+equal(Value x, Value y);
+
+extern size_t
+hash_equal(Value x);
+
+extern bool
+hamt_equal(Hamt *x, Hamt *y);
+
+extern size_t
+hamt_hash(Hamt *h);
+
+extern Value
+hamt_entries(Hamt *h);
+
+extern Value
+numvector_ref(NumVector *v, size_t i);
+
+extern Iterator *
+make_iterator(Value x, const char *op);
+
+extern Value
+iter_next(Iterator *it);
+
 extern Value
 reverse(Value p, Value t = NIL);
 
 extern Symbol *
 make_symbol(const char *value);
 
+extern Symbol *
+make_symbol(const char *str, size_t len);
+
 extern bool
 is_symbol_list(Value p);
 
 extern int
 memq_index(Value key, Value alist);
 
+struct SourceMap;
+
 extern Expr *
-compile(Value exp, Module *mod);
+compile(Value exp, Module *mod, SourceMap *sources = 0);
 
 extern Value
 execute(Expr *exp, Frame *env=0);
 
+extern Expr *
+ast_procedure_body(AstProcedure *proc);
+
 extern void
 init_types(void);
 
 extern void
 init_primitives(void);
 
+extern void
+init_ports(void);
+
 extern void
 primitives(Module *mod);
 
+extern uint64_t
+primitives_signature(void);
+
+extern Value
+primitive(const char *name);
+
 extern Value
 eval(Value exp, Module *mod);
 
 extern Value
 apply_arglist(Value fun, Value arglist);
 
+extern Value
+apply_argv(Value fun, unsigned nargs, const Value *argv);
+
 extern TypeCode
 alloc_type_code(void);
 
+extern void
+free_type_code(TypeCode tc);
+
 #endif /* LISP_H */
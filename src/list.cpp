@@ -1,6 +1,10 @@
 /* general list operations */
 
+#include <cstdlib>
 #include "lisp.h"
+#include "number.h"
+#include "prim.h"
+#include "util.h"
 
 unsigned
 length(Value p)
@@ -44,3 +48,324 @@ memq_index(Value key, Value alist)
 			return i;
 	return -1;
 }
+
+/*
+  Native list library. Results are built front to back through a tail
+  pointer, so each takes constant stack and allocates one pair per
+  element of its result. boot.lisp binds the usual names to these.
+*/
+
+struct ListBuilder {
+	Value head, last;
+	ListBuilder() : head(NIL), last(NIL) {}
+	void add(Value x) {
+		Value p = cons(x, NIL);
+		if (is_nil(last))
+			head = p;
+		else
+			cdr(last) = p;
+		last = p;
+	}
+	/* share t as the rest of the list */
+	Value finish(Value t = NIL) {
+		if (is_nil(last))
+			return t;
+		cdr(last) = t;
+		return head;
+	}
+};
+
+static void
+check_list(Value p, const char *op)
+{
+	while (is_pair(p))
+		p = cdr(p);
+	if (!is_nil(p))
+		type_error(op);
+}
+
+/* (append xs ...), sharing the last list */
+DEF_PRIM(prim_append, "%append", ~0)
+{
+	if (nargs == 0)
+		return NIL;
+	ListBuilder b;
+	for (unsigned i = 0; i < nargs - 1; i++) {
+		Value p = arg[i];
+		for (; is_pair(p); p = cdr(p))
+			b.add(car(p));
+		if (!is_nil(p))
+			type_error("append");
+	}
+	return b.finish(arg[nargs-1]);
+}
+
+/* (list* x ... t), the xs consed onto t; quasiquote builds with this */
+DEF_PRIM(prim_list_star, "list*", ~1)
+{
+	Value p = arg[nargs-1];
+	for (unsigned i = nargs - 1; i-- > 0; )
+		p = cons(arg[i], p);
+	return p;
+}
+
+DEF_PRIM(prim_concat, "%concat", 1)
+{
+	ListBuilder b;
+	Value xss = arg[0];
+	for (; is_pair(xss) && !is_nil(cdr(xss)); xss = cdr(xss)) {
+		Value p = car(xss);
+		for (; is_pair(p); p = cdr(p))
+			b.add(car(p));
+		if (!is_nil(p))
+			type_error("concat");
+	}
+	if (!is_pair(xss)) {
+		if (!is_nil(xss))
+			type_error("concat");
+		return b.finish();
+	}
+	return b.finish(car(xss));
+}
+
+/* (map f xs ...), stopping at the end of the shortest list */
+DEF_PRIM(prim_map, "%map", ~2)
+{
+	ListBuilder b;
+	Value f = arg[0];
+	if (nargs == 2) {
+		Value p = arg[1];
+		for (; is_pair(p); p = cdr(p)) {
+			Value x = car(p);
+			b.add(apply_argv(f, 1, &x));
+		}
+		if (!is_nil(p))
+			type_error("map");
+		return b.finish();
+	}
+	unsigned n = nargs - 1;
+	Value *lists = arg + 1;
+	Value *xs = (Value *) GC_MALLOC(n * sizeof(Value));
+	while (1) {
+		for (unsigned i = 0; i < n; i++) {
+			if (!is_pair(lists[i]))
+				return b.finish();
+			xs[i] = car(lists[i]);
+			lists[i] = cdr(lists[i]);
+		}
+		b.add(apply_argv(f, n, xs));
+	}
+}
+
+DEF_PRIM(prim_filter, "%filter", 2)
+{
+	ListBuilder b;
+	Value p = arg[1];
+	for (; is_pair(p); p = cdr(p)) {
+		Value x = car(p);
+		if (apply_argv(arg[0], 1, &x) != _F)
+			b.add(x);
+	}
+	if (!is_nil(p))
+		type_error("filter");
+	return b.finish();
+}
+
+DEF_PRIM(prim_foldl, "%foldl", 3)
+{
+	Value argv[2] = {arg[1], NIL};
+	Value p = arg[2];
+	for (; is_pair(p); p = cdr(p)) {
+		argv[1] = car(p);
+		argv[0] = apply_argv(arg[0], 2, argv);
+	}
+	if (!is_nil(p))
+		type_error("foldl");
+	return argv[0];
+}
+
+/* right fold over a reversed copy of the list, so the stack stays flat
+   and the elements stay reachable whatever the procedure does */
+DEF_PRIM(prim_foldr, "%foldr", 3)
+{
+	check_list(arg[2], "foldr");
+	Value r = NIL;
+	for (Value p = arg[2]; is_pair(p); p = cdr(p))
+		r = cons(car(p), r);
+	Value argv[2] = {NIL, arg[1]};
+	for (Value p = r; is_pair(p); p = cdr(p)) {
+		argv[0] = car(p);
+		argv[1] = apply_argv(arg[0], 2, argv);
+	}
+	return argv[1];
+}
+
+/* (range i j), the numbers from i up to and including j */
+DEF_PRIM(prim_range, "%range", 2)
+{
+	if (!is_number(arg[0]) || !is_number(arg[1]))
+		type_error("range");
+	ListBuilder b;
+	if (is_fixnum(arg[0]) && is_fixnum(arg[1])) {
+		for (Fixnum i = as_fixnum(arg[0]); i <= as_fixnum(arg[1]); i++)
+			b.add(make_fixnum(i));
+		return b.finish();
+	}
+	for (Value i = arg[0]; num_compare(i, arg[1]) <= 0;
+	     i = num_add(i, make_fixnum(1)))
+		b.add(i);
+	return b.finish();
+}
+
+DEF_PRIM(prim_sum, "%sum", 1)
+{
+	Value n = make_fixnum(0), p = arg[0];
+	for (; is_pair(p); p = cdr(p))
+		n = num_add(n, car(p));
+	if (!is_nil(p))
+		type_error("sum");
+	return n;
+}
+
+DEF_PRIM(prim_product, "%product", 1)
+{
+	Value n = make_fixnum(1), p = arg[0];
+	for (; is_pair(p); p = cdr(p))
+		n = num_mul(n, car(p));
+	if (!is_nil(p))
+		type_error("product");
+	return n;
+}
+
+DEF_PRIM(prim_length, "length", 1)
+{
+	if (is_vector(arg[0]))
+		return make_fixnum(as_vector(arg[0])->len);
+	if (is_numvector(arg[0]))
+		return make_fixnum(as_numvector(arg[0])->len);
+	return make_fixnum(length(arg[0]));
+}
+
+DEF_PRIM(prim_reverse, "%reverse", 1)
+{
+	Value r = NIL, p = arg[0];
+	for (; is_pair(p); p = cdr(p))
+		r = cons(car(p), r);
+	if (!is_nil(p))
+		type_error("reverse");
+	return r;
+}
+
+DEF_PRIM(prim_list_copy, "list-copy", 1)
+{
+	ListBuilder b;
+	Value p = arg[0];
+	for (; is_pair(p); p = cdr(p))
+		b.add(car(p));
+	return b.finish(p);
+}
+
+DEF_PRIM(prim_list_tail, "list-tail", 2)
+{
+	if (!is_fixnum(arg[1]) || as_fixnum(arg[1]) < 0)
+		type_error("list-tail");
+	Value p = arg[0];
+	for (Fixnum k = as_fixnum(arg[1]); k > 0; k--) {
+		if (!is_pair(p))
+			error(Error(), "list-tail: list too short");
+		p = cdr(p);
+	}
+	return p;
+}
+
+/* last element of a non-empty list */
+DEF_PRIM(prim_last, "last", 1)
+{
+	Value p = arg[0];
+	if (!is_pair(p))
+		type_error("last");
+	while (is_pair(cdr(p)))
+		p = cdr(p);
+	return car(p);
+}
+
+DEF_PRIM(prim_memq, "memq", 2)
+{
+	for (Value p = arg[1]; is_pair(p); p = cdr(p))
+		if (car(p) == arg[0])
+			return p;
+	return _F;
+}
+
+DEF_PRIM(prim_member, "member", 2)
+{
+	for (Value p = arg[1]; is_pair(p); p = cdr(p))
+		if (equal(car(p), arg[0]))
+			return p;
+	return _F;
+}
+
+DEF_PRIM(prim_assq, "assq", 2)
+{
+	for (Value p = arg[1]; is_pair(p); p = cdr(p))
+		if (is_pair(car(p)) && car(car(p)) == arg[0])
+			return car(p);
+	return _F;
+}
+
+DEF_PRIM(prim_assoc, "assoc", 2)
+{
+	for (Value p = arg[1]; is_pair(p); p = cdr(p))
+		if (is_pair(car(p)) && equal(car(car(p)), arg[0]))
+			return car(p);
+	return _F;
+}
+
+/* lets the compiler recognise pipelines it can fuse */
+ListOp
+list_op(Value fun)
+{
+	if (!is_c_procedure(fun))
+		return LIST_OP_NONE;
+	CProcedure::proc_type *proc = as_c_procedure(fun)->proc;
+	if (proc == prim_range)
+		return LIST_OP_RANGE;
+	if (proc == prim_map)
+		return LIST_OP_MAP;
+	if (proc == prim_filter)
+		return LIST_OP_FILTER;
+	if (proc == prim_foldl)
+		return LIST_OP_FOLDL;
+	if (proc == prim_sum)
+		return LIST_OP_SUM;
+	if (proc == prim_product)
+		return LIST_OP_PRODUCT;
+	if (proc == prim_length)
+		return LIST_OP_LENGTH;
+	return LIST_OP_NONE;
+}
+
+const prim_info
+list_prims[] = {
+	_prim_append,
+	_prim_list_star,
+	_prim_concat,
+	_prim_map,
+	_prim_filter,
+	_prim_foldl,
+	_prim_foldr,
+	_prim_range,
+	_prim_sum,
+	_prim_product,
+	_prim_length,
+	_prim_reverse,
+	_prim_list_copy,
+	_prim_list_tail,
+	_prim_last,
+	_prim_memq,
+	_prim_member,
+	_prim_assq,
+	_prim_assoc,
+};
+
+const unsigned list_nprims = NELEMS(list_prims);
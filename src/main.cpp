@@ -1,36 +1,112 @@
+#include <cerrno>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "lisp.h"
+#include "ast.h"
+#include "aot.h"
+#include "fasl.h"
 #include "parse.h"
+#include "srcloc.h"
 #include "util.h"
 
+/* the sources run so far, in order, whose macros later files expand with */
+static uint64_t loaded_hash;
+
+/* run a source file, from its compiled-form cache when up to date */
 void
 eval_file(const char *filename, Module *mod)
 {
 	FileParser p(filename);
+	SourceMap *sources = new SourceMap(
+		make_string(filename, strlen(filename)));
+	uint64_t hash = fasl_hash(p.source(), p.source_size(), loaded_hash);
+	loaded_hash = hash;
+	if (fasl_load(filename, hash, mod, sources))
+		return;
+	p.track(sources);
+	FaslWriter fasl(mod, hash, sources);
+	while (!p.eof()) {
+		Expr *exp = compile(p.parse(), mod, sources);
+		fasl.add(exp);
+		execute(exp);
+	}
+	fasl.save(filename);
+}
+
+static void
+eval_all(Parser &p, Module *mod)
+{
 	while (!p.eof())
 		eval(p.parse(), mod);
 }
 
-static void
-run(void)
+/* $AMP_BOOT, else boot.lisp beside the executable, else in the cwd */
+static const char *
+boot_path(void)
+{
+	static char path[4096];
+	const char *env = getenv("AMP_BOOT");
+	if (env)
+		return env;
+	ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (n > 0) {
+		path[n] = 0;
+		char *slash = strrchr(path, '/');
+		if (slash && (size_t) (slash - path) + 11 < sizeof(path)) {
+			strcpy(slash + 1, "boot.lisp");
+			if (access(path, R_OK) == 0)
+				return path;
+		}
+	}
+	return "boot.lisp";
+}
+
+static Module *
+new_toplevel(int argc, char *argv[])
 {
 	Module *toplevel = new Module;
 	primitives(toplevel);
 
+	/* *argv*: the script or expression, then its arguments */
+	Value args = NIL;
+	for (int i = argc; i-- > 0; )
+		args = cons(make_string(argv[i], strlen(argv[i])), args);
+	toplevel->define(make_symbol("*argv*"), args);
+	return toplevel;
+}
+
+static Module *
+boot(int argc, char *argv[])
+{
+	Module *toplevel = new_toplevel(argc, argv);
 	try {
-		eval_file("boot.lisp", toplevel);
+		eval_file(boot_path(), toplevel);
 	}
 	catch (Error&) {
 	}
 
 	GC_gcollect();
+	return toplevel;
+}
 
+static void
+repl(Module *toplevel)
+{
+	static const char banner[] = "Amp (c) 2006-2007 Luke McCarthy\n";
+	port_write(stdout_port, banner, sizeof(banner) - 1);
 	while (1) {
+		port_flush(stdout_port);
 		malloc_ptr<char> line = readline(">>> ");
 		if (!line) {
-			putchar('\n');
+			port_putc(stdout_port, '\n');
 			break;
 		}
 		try {
@@ -45,18 +121,296 @@ run(void)
 	}
 }
 
+/* compile the body of every procedure defined so far */
+static void
+compile_body(void *value, UNUSED void *data)
+{
+	Value x = ((ModuleRef *) value)->value;
+	if (is_ast_procedure(x)) {
+		try {
+			ast_procedure_body(as_ast_procedure(x));
+		}
+		catch (Error&) {
+		}
+	}
+}
+
+/*
+  Load the application's files, run its warm-up procedure if it defines
+  one, and compile everything, so that forked processes start from a
+  heap which needs no further work. A last collection leaves the heap
+  without garbage, which a child's collector would otherwise sweep,
+  writing free lists into pages it shares with its parent.
+*/
+static bool
+prepare_heap(Module *toplevel, int nfiles, char *files[])
+{
+	try {
+		for (int i = 0; i < nfiles; i++)
+			eval_file(files[i], toplevel);
+		Value warm_up = toplevel->lookup(make_symbol("warm-up"))->value;
+		if (is_procedure(warm_up))
+			apply_argv(warm_up, 0, 0);
+	}
+	catch (Error&) {
+		return false;
+	}
+	toplevel->defs.each(compile_body, 0);
+	GC_gcollect();
+	GC_gcollect_and_unmap();
+	port_flush(stdout_port);
+	return true;
+}
+
+static int
+listen_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "amp: socket path too long: %s\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("amp: socket");
+		return -1;
+	}
+	unlink(path);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+	    || listen(sock, SOMAXCONN) < 0) {
+		fprintf(stderr, "amp: %s: %s\n", path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int
+accept_client(int sock)
+{
+	while (1) {
+		int fd = accept(sock, 0, 0);
+		if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED))
+			return fd;
+	}
+}
+
+/* point the standard ports at new descriptors */
+static void
+redirect(int in, int out, int err)
+{
+	dup2(in, 0);
+	dup2(out, 1);
+	dup2(err, 2);
+	stdin_port->pos = stdin_port->len = 0;
+	stdin_port->flags &= ~PORT_EOF;
+	stdout_port->flags &= ~PORT_LINEBUF;
+}
+
+/*
+  A request is the source text a client sends before shutting down its
+  side of the connection. It is evaluated in a child of the toplevel
+  module, with the standard ports going back over the connection.
+*/
+static int
+eval_request(int fd, Module *toplevel)
+{
+	int status = 0;
+	redirect(fd, fd, fd);
+	try {
+		FileParser p(fd);
+		eval_all(p, new Module(toplevel));
+	}
+	catch (Error&) {
+		status = 1;
+	}
+	catch (Exit& e) {
+		status = e.code;
+	}
+	/* the child leaves by _exit, which runs no atexit handlers */
+	flush_ports();
+	return status;
+}
+
+/* each request in a fork of the warm heap */
+static int
+serve(const char *path, Module *toplevel, int nfiles, char *files[])
+{
+	int sock = listen_socket(path);
+	if (sock < 0 || !prepare_heap(toplevel, nfiles, files))
+		return 1;
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (1) {
+		int fd = accept_client(sock);
+		if (fd < 0) {
+			perror("amp: accept");
+			return 1;
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(sock);
+			_exit(eval_request(fd, toplevel));
+		}
+		if (pid < 0)
+			perror("amp: fork");
+		close(fd);
+	}
+}
+
+/* one request, in the heap as the worker was forked with */
+static void
+worker(int sock, Module *toplevel)
+{
+	/* grow the heap rather than collect often, as each collection can
+	   dirty shared pages */
+	GC_set_free_space_divisor(1);
+	int fd = accept_client(sock);
+	if (fd < 0) {
+		perror("amp: accept");
+		_exit(1);
+	}
+	close(sock);
+	_exit(eval_request(fd, toplevel));
+}
+
+static pid_t
+spawn_worker(int sock, Module *toplevel)
+{
+	pid_t pid = fork();
+	if (pid == 0)
+		worker(sock, toplevel);
+	if (pid < 0)
+		perror("amp: fork");
+	return pid;
+}
+
+/*
+  Workers are forked from the prepared heap ahead of the requests and
+  share its pages copy-on-write. Each takes one request from the
+  listening socket and exits, and is replaced by a fresh fork, so that
+  no request sees what another left behind and none waits on a fork:
+  unlike serve(), n requests run at once in workers already made.
+*/
+static int
+prefork(int nworkers, const char *path, Module *toplevel,
+        int nfiles, char *files[])
+{
+	int sock = listen_socket(path);
+	if (sock < 0 || !prepare_heap(toplevel, nfiles, files))
+		return 1;
+	signal(SIGPIPE, SIG_IGN);
+
+	for (int i = 0; i < nworkers; i++)
+		spawn_worker(sock, toplevel);
+	while (1) {
+		pid_t pid = wait(0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("amp: wait");
+			return 1;
+		}
+		spawn_worker(sock, toplevel);
+	}
+}
+
+/* the script and boot.lisp as one program, in C++, compiled in a
+   module which boot.lisp has not yet been run in, as its definitions
+   are run with the script's */
+static int
+compile_program(const char *script, const char *output, Module *toplevel)
+{
+	if (access(script, R_OK) < 0) {
+		fprintf(stderr, "amp: %s: %s\n", script, strerror(errno));
+		return 1;
+	}
+	const char *files[] = {boot_path(), script};
+	return compile_to_cpp(toplevel, NELEMS(files), files, output) ? 0 : 1;
+}
+
+static int
+usage(void)
+{
+	fputs("usage: amp [script [arg...]]\n"
+	      "       amp -e expr [arg...]\n"
+	      "       amp --serve socket [file...]\n"
+	      "       amp --prefork n socket [file...]\n"
+	      "       amp --compile-to-cpp script output.cpp\n", stderr);
+	return 2;
+}
+
+static int
+run(int argc, char *argv[])
+{
+	if (argc < 2) {
+		repl(boot(0, argv));
+		return 0;
+	}
+	if (strcmp(argv[1], "--serve") == 0) {
+		if (argc < 3)
+			return usage();
+		return serve(argv[2], boot(0, argv), argc - 3, argv + 3);
+	}
+	if (strcmp(argv[1], "--prefork") == 0) {
+		int n = argc < 4 ? 0 : atoi(argv[2]);
+		if (n <= 0)
+			return usage();
+		return prefork(n, argv[3], boot(0, argv), argc - 4, argv + 4);
+	}
+	if (strcmp(argv[1], "--compile-to-cpp") == 0) {
+		if (argc != 4)
+			return usage();
+		return compile_program(argv[2], argv[3],
+		                       new_toplevel(1, argv + 2));
+	}
+	if (strcmp(argv[1], "-e") == 0) {
+		if (argc < 3)
+			return usage();
+		Module *toplevel = boot(argc - 2, argv + 2);
+		try {
+			StringParser p(argv[2]);
+			eval_all(p, toplevel);
+		}
+		catch (Error&) {
+			return 1;
+		}
+		return 0;
+	}
+	if (argv[1][0] == '-')
+		return usage();
+	if (access(argv[1], R_OK) < 0) {
+		fprintf(stderr, "amp: %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	Module *toplevel = boot(argc - 1, argv + 1);
+	try {
+		eval_file(argv[1], toplevel);
+	}
+	catch (Error&) {
+		return 1;
+	}
+	return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
 	GC_INIT();
 	init_types();
 	init_primitives();
+	init_ports();
 
 	try {
-		run();
+		return run(argc, argv);
 	}
 	catch (Exit& e) {
 		return e.code;
 	}
-	return 0;
 }
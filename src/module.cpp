@@ -1,7 +1,7 @@
 #include "lisp.h"
 #include "ast.h"
 
-Module::Module() : Object(TC)
+Module::Module(Module *parent) : Object(TC), parent(parent)
 {
 	define(sym_this_module, this);
 }
@@ -25,11 +25,23 @@ Module::define(Symbol *name, Value value)
 	return ref;
 }
 
+/* a definition inherited from an ancestor module */
+static ModuleRef *
+inherited(Module *mod, Symbol *name)
+{
+	for (mod = mod->parent; mod; mod = mod->parent) {
+		ModuleRef *ref = (ModuleRef *) mod->defs.lookup(name->value);
+		if (ref && ref->value != UNDEFINED)
+			return ref;
+	}
+	return 0;
+}
+
 ModuleRef *
 Module::lookup(Symbol *name)
 {
 	ModuleRef *ref = LOOKUP(name);
-	if (!ref) {
+	if (!ref && !(ref = inherited(this, name))) {
 		ref = new ModuleRef(name, UNDEFINED);
 		DEFINE(name, ref);
 	}
@@ -57,6 +69,8 @@ ModuleRef *
 Module::macro_lookup(Symbol *name)
 {
 	ModuleRef *ref = LOOKUP(name);
+	if (!ref)
+		ref = inherited(this, name);
 	if (ref && ref->type == Expr::MACRO_REF)
 		return ref;
 	return 0;
@@ -0,0 +1,113 @@
+/*
+  native.cpp - Runtime support for compiled C++
+*/
+
+#include <cstring>
+#include "lisp.h"
+#include "native.h"
+#include "parse.h"
+
+Value
+native_closure(CCProcedure::proc_type *proc, int arity,
+               unsigned ncap, const Value *cap)
+{
+	NativeProcedure *f = new (ncap) NativeProcedure(arity, proc);
+	for (unsigned i = 0; i < ncap; i++)
+		f->cap[i] = cap[i];
+	return f;
+}
+
+Value
+native_list(unsigned n, const Value *items, Value tail)
+{
+	while (n-- > 0)
+		tail = cons(items[n], tail);
+	return tail;
+}
+
+Value
+native_vector(unsigned n, const Value *items)
+{
+	Vector *v = make_vector(n, NIL);
+	for (unsigned i = 0; i < n; i++)
+		v->items[i] = items[i];
+	return v;
+}
+
+Value
+native_bignum(const char *digits)
+{
+	StringParser parser(digits);
+	return parser.parse();
+}
+
+ModuleRef *
+native_define(Module *mod, Symbol *name, Value value)
+{
+	ModuleRef *ref = mod->define(name, value);
+	if (is_procedure(value))
+		as_procedure(value)->name = name;
+	return ref;
+}
+
+Value
+native_define_macro(Module *mod, Symbol *name, Value proc)
+{
+	mod->macro_define(name, as_procedure(proc));
+	as_procedure(proc)->name = name;
+	return proc;
+}
+
+Value
+native_macro(Module *mod, Symbol *name)
+{
+	ModuleRef *ref = mod->macro_lookup(name);
+	if (!ref)
+		unbound_error(name);
+	return ref->value;
+}
+
+/* arms which give their own numbers, for case_branch() to choose from */
+Case *
+native_case(Value keys, unsigned narms)
+{
+	Seq *arms = make_seq(narms);
+	for (unsigned i = 0; i < narms; i++)
+		arms->expr[i] = new Lit(make_fixnum(i));
+	return make_case(0, arms, keys, new Lit(make_fixnum(-1)));
+}
+
+int
+native_case_arm(Case *c, Value key)
+{
+	return as_fixnum(((Lit *) case_branch(c, key))->value);
+}
+
+int
+native_main(int argc, char *argv[], void (*init)(Module *),
+            void (*run)(void))
+{
+	GC_INIT();
+	init_types();
+	init_primitives();
+	init_ports();
+
+	Module *toplevel = new Module;
+	primitives(toplevel);
+	Value args = NIL;
+	for (int i = argc; i-- > 0; )
+		args = cons(make_string(argv[i], strlen(argv[i])), args);
+	toplevel->define(make_symbol("*argv*"), args);
+
+	try {
+		init(toplevel);
+		run();
+	}
+	catch (Error&) {
+		return 1;
+	}
+	catch (Exit& e) {
+		return e.code;
+	}
+	return 0;
+}
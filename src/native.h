@@ -0,0 +1,145 @@
+#ifndef SRC_NATIVE_H
+#define SRC_NATIVE_H
+
+/*
+  Support for C++ compiled from Lisp by amp --compile-to-cpp, which
+  includes this header and links against libamp.a:
+
+    make lib && g++ -O2 -Isrc prog.cpp libamp.a -lgc -o prog
+
+  A compiled lambda is a CCProcedure whose closure holds copies of the
+  variables it uses from enclosing procedures: no variable is ever
+  assigned, so a copy is as good as the frame it came from.
+*/
+#include <cmath>
+#include <cstring>
+#include "lisp.h"
+#include "ast.h"
+#include "number.h"
+
+struct NativeProcedure : CCProcedure {
+	Value cap[0];
+	NativeProcedure(int arity, proc_type *proc)
+		: CCProcedure(sym_at_lambda, arity, proc) {}
+	inline void *operator new(size_t size, unsigned ncap)
+		{ return Object::operator new(size + ncap * sizeof(Value)); }
+	inline void operator delete(UNUSED void *ptr, UNUSED unsigned ncap)
+		{}
+};
+
+static inline bool
+native_arity_ok(int arity, unsigned nargs)
+{
+	return arity >= 0 ? nargs == (unsigned) arity : nargs >= (unsigned) ~arity;
+}
+
+/* a global resolved on first use, as the interpreter resolves it when
+   the code using it is compiled */
+static inline Value
+native_global(Module *mod, ModuleRef **ref, Symbol *name)
+{
+	if (!*ref)
+		*ref = mod->lookup(name);
+	if ((*ref)->value == UNDEFINED)
+		unbound_error(name);
+	return (*ref)->value;
+}
+
+static inline Value
+native_call(Value fun, unsigned nargs, Value *arg)
+{
+	if (is_cc_procedure(fun)
+	    && native_arity_ok(as_procedure(fun)->arity, nargs))
+		return as_cc_procedure(fun)->proc(as_ptr(fun), nargs, arg);
+	if (is_c_procedure(fun)
+	    && native_arity_ok(as_procedure(fun)->arity, nargs))
+		return as_c_procedure(fun)->proc(nargs, arg);
+	return apply_argv(fun, nargs, arg);
+}
+
+/* the arguments from the first rest argument on */
+static inline Value
+native_rest(unsigned nargs, Value *arg, unsigned from)
+{
+	Value rest = NIL;
+	while (nargs-- > from)
+		rest = cons(arg[nargs], rest);
+	return rest;
+}
+
+/* the inlined calls of execute(), tested against the procedure called
+   rather than the one bound when compiling */
+static inline Value
+native_slot_ref(Value fun, Value rec)
+{
+	if (!is_accessor(fun))
+		return native_call(fun, 1, &rec);
+	Accessor *acc = as_accessor(fun);
+	if (!is_ptr(rec) || as_ptr(rec)->typecode() != acc->typecode)
+		type_error(acc->name->value);
+	return as_record(rec)->get(acc->kind, acc->offset);
+}
+
+static inline Value
+native_slot_set(Value fun, Value rec, Value value)
+{
+	if (!is_mutator(fun)) {
+		Value arg[2] = {rec, value};
+		return native_call(fun, 2, arg);
+	}
+	Mutator *mut = as_mutator(fun);
+	if (!is_ptr(rec) || as_ptr(rec)->typecode() != mut->typecode)
+		type_error(mut->name->value);
+	if (!as_record(rec)->set(mut->kind, mut->offset, value))
+		type_error(mut->name->value);
+	return NIL;
+}
+
+static inline Value
+native_vector_ref(Value fun, Value vec, Value index)
+{
+	if (!is_vector_ref_prim(fun)) {
+		Value arg[2] = {vec, index};
+		return native_call(fun, 2, arg);
+	}
+	if (is_vector(vec) && is_fixnum(index)
+	    && (size_t) as_fixnum(index) < as_vector(vec)->len)
+		return as_vector(vec)->items[as_fixnum(index)];
+	return vector_ref(vec, index);
+}
+
+extern Value
+native_closure(CCProcedure::proc_type *proc, int arity,
+               unsigned ncap, const Value *cap);
+
+extern Value
+native_list(unsigned n, const Value *items, Value tail);
+
+extern Value
+native_vector(unsigned n, const Value *items);
+
+extern Value
+native_bignum(const char *digits);
+
+extern ModuleRef *
+native_define(Module *mod, Symbol *name, Value value);
+
+extern Value
+native_define_macro(Module *mod, Symbol *name, Value proc);
+
+extern Value
+native_macro(Module *mod, Symbol *name);
+
+/* case dispatch: the arm a key selects, numbered from 0, or -1 */
+extern Case *
+native_case(Value keys, unsigned narms);
+
+extern int
+native_case_arm(Case *c, Value key);
+
+/* boots the runtime, then runs init and run in a new toplevel module */
+extern int
+native_main(int argc, char *argv[], void (*init)(Module *),
+            void (*run)(void));
+
+#endif /* SRC_NATIVE_H */
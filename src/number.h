@@ -0,0 +1,116 @@
+#ifndef SRC_NUMBER_H
+#define SRC_NUMBER_H
+
+/*
+  Generic arithmetic. Fixnum operands are handled inline with the
+  compiler's overflow builtins, and mixed fixnum and flonum operands
+  inline in double precision; anything else, including results that
+  do not fit a fixnum, goes to the out-of-line code in bignum.cpp.
+*/
+
+extern Value num_add_slow(Value x, Value y);
+extern Value num_sub_slow(Value x, Value y);
+extern Value num_mul_slow(Value x, Value y);
+extern Value num_div_slow(Value x, Value y);
+extern Value num_rem_slow(Value x, Value y);
+extern Value num_neg_slow(Value x);
+extern int num_compare(Value x, Value y);
+extern bool num_eqv(Value x, Value y);
+extern double num_to_double(Value x);
+extern Value num_from_double(double d);
+extern Value num_from_int64(int64_t n);
+extern bool num_to_int64(Value x, int64_t *n);
+extern char *bignum_to_string(Bignum *b);
+
+/* fixnum or flonum operands, at least one flonum, as doubles */
+static inline bool
+flonum_args(Value x, Value y, double *a, double *b)
+{
+	if (!is_flonum(x) && !is_flonum(y))
+		return false;
+	if (is_fixnum(x))
+		*a = as_fixnum(x);
+	else if (is_flonum(x))
+		*a = as_flonum(x);
+	else
+		return false;
+	if (is_fixnum(y))
+		*b = as_fixnum(y);
+	else if (is_flonum(y))
+		*b = as_flonum(y);
+	else
+		return false;
+	return true;
+}
+
+/* fixnums are doubled so overflow of the builtin is fixnum overflow */
+
+static inline Value
+num_add(Value x, Value y)
+{
+	Fixnum r;
+	if (is_fixnum(x) && is_fixnum(y)
+	    && !__builtin_add_overflow(as_fixnum(x) * 2, as_fixnum(y) * 2, &r))
+		return make_fixnum(r >> 1);
+	double a, b;
+	if (flonum_args(x, y, &a, &b))
+		return make_flonum(a + b);
+	return num_add_slow(x, y);
+}
+
+static inline Value
+num_sub(Value x, Value y)
+{
+	Fixnum r;
+	if (is_fixnum(x) && is_fixnum(y)
+	    && !__builtin_sub_overflow(as_fixnum(x) * 2, as_fixnum(y) * 2, &r))
+		return make_fixnum(r >> 1);
+	double a, b;
+	if (flonum_args(x, y, &a, &b))
+		return make_flonum(a - b);
+	return num_sub_slow(x, y);
+}
+
+static inline Value
+num_mul(Value x, Value y)
+{
+	Fixnum r;
+	if (is_fixnum(x) && is_fixnum(y)
+	    && !__builtin_mul_overflow(as_fixnum(x), as_fixnum(y) * 2, &r))
+		return make_fixnum(r >> 1);
+	double a, b;
+	if (flonum_args(x, y, &a, &b))
+		return make_flonum(a * b);
+	return num_mul_slow(x, y);
+}
+
+static inline Value
+num_div(Value x, Value y)
+{
+	if (is_fixnum(x) && is_fixnum(y) && as_fixnum(y) != 0
+	    && (as_fixnum(x) != FIXNUM_MIN || as_fixnum(y) != -1))
+		return make_fixnum(as_fixnum(x) / as_fixnum(y));
+	double a, b;
+	if (flonum_args(x, y, &a, &b))
+		return make_flonum(a / b);
+	return num_div_slow(x, y);
+}
+
+static inline Value
+num_rem(Value x, Value y)
+{
+	if (is_fixnum(x) && is_fixnum(y) && as_fixnum(y) != 0
+	    && as_fixnum(y) != -1)
+		return make_fixnum(as_fixnum(x) % as_fixnum(y));
+	return num_rem_slow(x, y);
+}
+
+static inline Value
+num_neg(Value x)
+{
+	if (is_fixnum(x) && as_fixnum(x) != FIXNUM_MIN)
+		return make_fixnum(-as_fixnum(x));
+	return num_neg_slow(x);
+}
+
+#endif /* SRC_NUMBER_H */
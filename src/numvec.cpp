@@ -0,0 +1,571 @@
+/*
+  numvec.cpp - Homogeneous numeric vectors
+*/
+
+#include <cstring>
+#include "lisp.h"
+#include "number.h"
+#include "prim.h"
+#include "util.h"
+
+/*
+  Kernels are compiled once for AVX2 and once for the SSE2 baseline;
+  the loader picks a clone by CPU features on first call. Integer and
+  elementwise loops are left to the vectoriser, floating-point
+  reductions use explicit vector accumulators since the compiler may
+  not reassociate them.
+*/
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD_DISPATCH)
+#define KERNEL __attribute__((target_clones("avx2", "default"))) static
+#else
+#define KERNEL static
+#endif
+
+typedef double v4df __attribute__((vector_size(32)));
+
+/* unaligned load, kept out of a function to avoid passing v4df by value */
+#define load_v4df(v, p) memcpy(&(v), (p), sizeof(v4df))
+
+KERNEL double
+f64_sum(const double *a, size_t n)
+{
+	v4df s0 = {0, 0, 0, 0}, s1 = s0, x0, x1;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		load_v4df(x0, a + i);
+		load_v4df(x1, a + i + 4);
+		s0 += x0;
+		s1 += x1;
+	}
+	s0 += s1;
+	double s = (s0[0] + s0[1]) + (s0[2] + s0[3]);
+	for (; i < n; i++)
+		s += a[i];
+	return s;
+}
+
+KERNEL double
+f64_dot(const double *a, const double *b, size_t n)
+{
+	v4df s0 = {0, 0, 0, 0}, s1 = s0, x0, x1, y0, y1;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		load_v4df(x0, a + i);
+		load_v4df(x1, a + i + 4);
+		load_v4df(y0, b + i);
+		load_v4df(y1, b + i + 4);
+		s0 += x0 * y0;
+		s1 += x1 * y1;
+	}
+	s0 += s1;
+	double s = (s0[0] + s0[1]) + (s0[2] + s0[3]);
+	for (; i < n; i++)
+		s += a[i] * b[i];
+	return s;
+}
+
+/* min or max of a non-empty vector */
+#define DEF_F64_EXTREMUM(name, op)                            \
+KERNEL double                                                 \
+name(const double *a, size_t n)                               \
+{                                                             \
+	v4df m = {a[0], a[0], a[0], a[0]};                    \
+	size_t i = 0;                                         \
+	for (; i + 4 <= n; i += 4) {                          \
+		v4df v;                                       \
+		load_v4df(v, a + i);                          \
+		m = v op m ? v : m;                           \
+	}                                                     \
+	double r = m[0];                                      \
+	for (unsigned j = 1; j < 4; j++)                      \
+		r = m[j] op r ? m[j] : r;                     \
+	for (; i < n; i++)                                    \
+		r = a[i] op r ? a[i] : r;                     \
+	return r;                                             \
+}
+
+DEF_F64_EXTREMUM(f64_min, <)
+DEF_F64_EXTREMUM(f64_max, >)
+
+/* integers wrap, so sums are taken over the unsigned type */
+#define DEF_INT_REDUCE(tag, T, U)                                \
+KERNEL int64_t                                                   \
+tag##_sum(const T *a, size_t n)                                  \
+{                                                                \
+	uint64_t s = 0;                                          \
+	for (size_t i = 0; i < n; i++)                           \
+		s += (U) a[i];                                   \
+	return (int64_t) s;                                      \
+}                                                                \
+                                                                 \
+KERNEL int64_t                                                   \
+tag##_dot(const T *a, const T *b, size_t n)                      \
+{                                                                \
+	uint64_t s = 0;                                          \
+	for (size_t i = 0; i < n; i++)                           \
+		s += (uint64_t)(U) a[i] * (uint64_t)(U) b[i];    \
+	return (int64_t) s;                                      \
+}                                                                \
+                                                                 \
+KERNEL int64_t                                                   \
+tag##_min(const T *a, size_t n)                                  \
+{                                                                \
+	T m = a[0];                                              \
+	for (size_t i = 1; i < n; i++)                           \
+		m = a[i] < m ? a[i] : m;                         \
+	return m;                                                \
+}                                                                \
+                                                                 \
+KERNEL int64_t                                                   \
+tag##_max(const T *a, size_t n)                                  \
+{                                                                \
+	T m = a[0];                                              \
+	for (size_t i = 1; i < n; i++)                           \
+		m = a[i] > m ? a[i] : m;                         \
+	return m;                                                \
+}
+
+DEF_INT_REDUCE(s64, int64_t, uint64_t)
+DEF_INT_REDUCE(u8, uint8_t, uint8_t)
+
+#define DEF_ELEMENTWISE(name, T, U, op)                        \
+KERNEL void                                                    \
+name(T *r, const T *a, const T *b, size_t n)                   \
+{                                                              \
+	for (size_t i = 0; i < n; i++)                         \
+		r[i] = (T)((U) a[i] op (U) b[i]);              \
+}
+
+DEF_ELEMENTWISE(f64_add, double, double, +)
+DEF_ELEMENTWISE(f64_sub, double, double, -)
+DEF_ELEMENTWISE(f64_mul, double, double, *)
+DEF_ELEMENTWISE(f64_div, double, double, /)
+DEF_ELEMENTWISE(s64_add, int64_t, uint64_t, +)
+DEF_ELEMENTWISE(s64_sub, int64_t, uint64_t, -)
+DEF_ELEMENTWISE(s64_mul, int64_t, uint64_t, *)
+DEF_ELEMENTWISE(u8_add, uint8_t, unsigned, +)
+DEF_ELEMENTWISE(u8_sub, uint8_t, unsigned, -)
+DEF_ELEMENTWISE(u8_mul, uint8_t, unsigned, *)
+
+#define DEF_COMPARE(name, T, op)                               \
+KERNEL void                                                    \
+name(uint8_t *r, const T *a, const T *b, size_t n)             \
+{                                                              \
+	for (size_t i = 0; i < n; i++)                         \
+		r[i] = a[i] op b[i];                           \
+}
+
+DEF_COMPARE(f64_lt, double, <)
+DEF_COMPARE(f64_eq, double, ==)
+DEF_COMPARE(s64_lt, int64_t, <)
+DEF_COMPARE(s64_eq, int64_t, ==)
+DEF_COMPARE(u8_lt, uint8_t, <)
+DEF_COMPARE(u8_eq, uint8_t, ==)
+
+#define DEF_AXPY(name, T, U)                                   \
+KERNEL void                                                    \
+name(T *y, T alpha, const T *x, size_t n)                      \
+{                                                              \
+	for (size_t i = 0; i < n; i++)                         \
+		y[i] = (T)((U) y[i] + (U) alpha * (U) x[i]);   \
+}
+
+DEF_AXPY(f64_axpy, double, double)
+DEF_AXPY(s64_axpy, int64_t, uint64_t)
+DEF_AXPY(u8_axpy, uint8_t, unsigned)
+
+/*
+  Element types.
+*/
+
+typedef void elementwise_fn(void *r, const void *a, const void *b, size_t n);
+typedef void compare_fn(uint8_t *r, const void *a, const void *b, size_t n);
+
+struct ElemType {
+	TypeCode tc;
+	size_t size;
+	bool (*unbox)(Value x, void *p);
+	Value (*box)(const void *p);
+	elementwise_fn *add, *sub, *mul, *div;
+	compare_fn *lt, *eq;
+};
+
+static bool
+unbox_f64(Value x, void *p)
+{
+	if (!is_number(x))
+		return false;
+	*(double *) p = num_to_double(x);
+	return true;
+}
+
+static Value
+box_f64(const void *p)
+{
+	return make_flonum(*(const double *) p);
+}
+
+static bool
+unbox_s64(Value x, void *p)
+{
+	return num_to_int64(x, (int64_t *) p);
+}
+
+static Value
+box_s64(const void *p)
+{
+	return num_from_int64(*(const int64_t *) p);
+}
+
+static bool
+unbox_u8(Value x, void *p)
+{
+	if (!is_fixnum(x) || as_fixnum(x) < 0 || as_fixnum(x) > 255)
+		return false;
+	*(uint8_t *) p = as_fixnum(x);
+	return true;
+}
+
+static Value
+box_u8(const void *p)
+{
+	return make_fixnum(*(const uint8_t *) p);
+}
+
+#define ELEM_OPS(tag, div)                                 \
+	(elementwise_fn *) tag##_add,                      \
+	(elementwise_fn *) tag##_sub,                      \
+	(elementwise_fn *) tag##_mul,                      \
+	(elementwise_fn *) div,                            \
+	(compare_fn *) tag##_lt,                           \
+	(compare_fn *) tag##_eq
+
+static const ElemType elem_types[] = {
+	{TC_F64VECTOR, sizeof(double), unbox_f64, box_f64, ELEM_OPS(f64, f64_div)},
+	{TC_S64VECTOR, sizeof(int64_t), unbox_s64, box_s64, ELEM_OPS(s64, 0)},
+	{TC_U8VECTOR, sizeof(uint8_t), unbox_u8, box_u8, ELEM_OPS(u8, 0)},
+};
+
+static inline const ElemType *
+elem_type(TypeCode tc)
+{
+	return &elem_types[tc - TC_F64VECTOR];
+}
+
+static const ElemType *
+check_numvector(Value x, const char *op)
+{
+	if (!is_numvector(x))
+		type_error(op);
+	return elem_type(as_numvector(x)->typecode());
+}
+
+/* two vectors of the same type and length */
+static const ElemType *
+check_numvectors(Value x, Value y, const char *op)
+{
+	const ElemType *et = check_numvector(x, op);
+	if (check_numvector(y, op) != et)
+		type_error(op);
+	if (as_numvector(x)->len != as_numvector(y)->len)
+		errorf(Error(), "%s: vector lengths differ", op);
+	return et;
+}
+
+static size_t
+check_index(NumVector *v, Value i, const char *op)
+{
+	if (!is_fixnum(i))
+		type_error(op);
+	if (as_fixnum(i) < 0 || (size_t) as_fixnum(i) >= v->len)
+		errorf(Error(), "%s: index out of range", op);
+	return as_fixnum(i);
+}
+
+static NumVector *
+make_numvector(TypeCode tc, size_t len)
+{
+	NumVector *v = (NumVector *) Object::new_atomic(
+		sizeof(NumVector) + len * elem_type(tc)->size);
+	v->init_hdr(tc);
+	v->len = len;
+	return v;
+}
+
+Value
+numvector_ref(NumVector *v, size_t i)
+{
+	const ElemType *et = elem_type(v->typecode());
+	return et->box(v->data + i * et->size);
+}
+
+static void
+numvector_set(NumVector *v, size_t i, Value x, const char *op)
+{
+	const ElemType *et = elem_type(v->typecode());
+	if (!et->unbox(x, v->data + i * et->size))
+		type_error(op);
+}
+
+/*
+  Constructors and accessors, one set per element type.
+*/
+
+static Value
+make_prim(TypeCode tc, unsigned nargs, Value *arg, const char *op)
+{
+	if (!is_fixnum(arg[0]) || as_fixnum(arg[0]) < 0)
+		type_error(op);
+	if (nargs > 2)
+		errorf(ArityError(), "arity error: %s", op);
+	NumVector *v = make_numvector(tc, as_fixnum(arg[0]));
+	if (nargs == 2) {
+		size_t size = elem_type(tc)->size;
+		if (v->len)
+			numvector_set(v, 0, arg[1], op);
+		for (size_t i = 1; i < v->len; i++)
+			memcpy(v->data + i * size, v->data, size);
+	}
+	else
+		memset(v->data, 0, v->len * elem_type(tc)->size);
+	return v;
+}
+
+static Value
+vector_prim(TypeCode tc, unsigned nargs, Value *arg, const char *op)
+{
+	NumVector *v = make_numvector(tc, nargs);
+	for (unsigned i = 0; i < nargs; i++)
+		numvector_set(v, i, arg[i], op);
+	return v;
+}
+
+static Value
+from_list_prim(TypeCode tc, Value list, const char *op)
+{
+	NumVector *v = make_numvector(tc, length(list));
+	for (size_t i = 0; i < v->len; i++, list = cdr(list))
+		numvector_set(v, i, car(list), op);
+	if (!is_nil(list))
+		type_error(op);
+	return v;
+}
+
+static Value
+to_list(NumVector *v)
+{
+	Value list = NIL;
+	for (size_t i = v->len; i-- > 0; )
+		list = cons(numvector_ref(v, i), list);
+	return list;
+}
+
+#define DEF_NUMVECTOR_PRIMS(tag, code)                                   \
+DEF_PRIM(prim_make_##tag, "make-" #tag, ~1)                            \
+{                                                                      \
+	return make_prim(code, nargs, arg, "make-" #tag);                \
+}                                                                      \
+                                                                       \
+DEF_PRIM(prim_##tag, #tag, ~0)                                         \
+{                                                                      \
+	return vector_prim(code, nargs, arg, #tag);                      \
+}                                                                      \
+                                                                       \
+DEF_PRIM(prim_is_##tag, #tag "?", 1)                                   \
+{                                                                      \
+	return make_bool(is_ptr(arg[0]) && as_ptr(arg[0])->typecode() == code); \
+}                                                                      \
+                                                                       \
+DEF_PRIM(prim_##tag##_length, #tag "-length", 1)                       \
+{                                                                      \
+	if (check_numvector(arg[0], #tag "-length")->tc != code)         \
+		type_error(#tag "-length");                            \
+	return make_fixnum(as_numvector(arg[0])->len);                 \
+}                                                                      \
+                                                                       \
+DEF_PRIM(prim_##tag##_ref, #tag "-ref", 2)                             \
+{                                                                      \
+	if (check_numvector(arg[0], #tag "-ref")->tc != code)            \
+		type_error(#tag "-ref");                               \
+	NumVector *v = as_numvector(arg[0]);                           \
+	return numvector_ref(v, check_index(v, arg[1], #tag "-ref"));  \
+}                                                                      \
+                                                                       \
+DEF_PRIM(prim_##tag##_set, #tag "-set!", 3)                            \
+{                                                                      \
+	if (check_numvector(arg[0], #tag "-set!")->tc != code)           \
+		type_error(#tag "-set!");                              \
+	NumVector *v = as_numvector(arg[0]);                           \
+	numvector_set(v, check_index(v, arg[1], #tag "-set!"),         \
+	              arg[2], #tag "-set!");                           \
+	return arg[2];                                                 \
+}                                                                      \
+                                                                       \
+DEF_PRIM(prim_##tag##_to_list, #tag "->list", 1)                       \
+{                                                                      \
+	if (check_numvector(arg[0], #tag "->list")->tc != code)          \
+		type_error(#tag "->list");                             \
+	return to_list(as_numvector(arg[0]));                          \
+}                                                                      \
+                                                                       \
+DEF_PRIM(prim_list_to_##tag, "list->" #tag, 1)                         \
+{                                                                      \
+	return from_list_prim(code, arg[0], "list->" #tag);              \
+}
+
+DEF_NUMVECTOR_PRIMS(f64vector, TC_F64VECTOR)
+DEF_NUMVECTOR_PRIMS(s64vector, TC_S64VECTOR)
+DEF_NUMVECTOR_PRIMS(u8vector, TC_U8VECTOR)
+
+/*
+  Vectorised operations, generic over the element type.
+*/
+
+DEF_PRIM(prim_numvector_sum, "numvector-sum", 1)
+{
+	check_numvector(arg[0], "numvector-sum");
+	NumVector *v = as_numvector(arg[0]);
+	switch (v->typecode()) {
+	case TC_F64VECTOR:
+		return make_flonum(f64_sum(v->elems<double>(), v->len));
+	case TC_S64VECTOR:
+		return num_from_int64(s64_sum(v->elems<int64_t>(), v->len));
+	default:
+		return num_from_int64(u8_sum(v->elems<uint8_t>(), v->len));
+	}
+}
+
+DEF_PRIM(prim_numvector_dot, "numvector-dot", 2)
+{
+	check_numvectors(arg[0], arg[1], "numvector-dot");
+	NumVector *a = as_numvector(arg[0]), *b = as_numvector(arg[1]);
+	switch (a->typecode()) {
+	case TC_F64VECTOR:
+		return make_flonum(f64_dot(a->elems<double>(),
+		                           b->elems<double>(), a->len));
+	case TC_S64VECTOR:
+		return num_from_int64(s64_dot(a->elems<int64_t>(),
+		                              b->elems<int64_t>(), a->len));
+	default:
+		return num_from_int64(u8_dot(a->elems<uint8_t>(),
+		                             b->elems<uint8_t>(), a->len));
+	}
+}
+
+#define DEF_EXTREMUM_PRIM(name, symname, fun)                            \
+DEF_PRIM(name, symname, 1)                                               \
+{                                                                        \
+	check_numvector(arg[0], symname);                                \
+	NumVector *v = as_numvector(arg[0]);                             \
+	if (!v->len)                                                     \
+		errorf(Error(), "%s: empty vector", symname);            \
+	switch (v->typecode()) {                                         \
+	case TC_F64VECTOR:                                               \
+		return make_flonum(f64_##fun(v->elems<double>(), v->len)); \
+	case TC_S64VECTOR:                                               \
+		return num_from_int64(s64_##fun(v->elems<int64_t>(), v->len)); \
+	default:                                                         \
+		return num_from_int64(u8_##fun(v->elems<uint8_t>(), v->len)); \
+	}                                                                \
+}
+
+DEF_EXTREMUM_PRIM(prim_numvector_min, "numvector-min", min)
+DEF_EXTREMUM_PRIM(prim_numvector_max, "numvector-max", max)
+
+/* (numvector-axpy! a x y) sets y to a*x + y */
+DEF_PRIM(prim_numvector_axpy, "numvector-axpy!", 3)
+{
+	const ElemType *et = check_numvectors(arg[1], arg[2], "numvector-axpy!");
+	NumVector *x = as_numvector(arg[1]), *y = as_numvector(arg[2]);
+	union { double f64; int64_t s64; uint8_t u8; } alpha;
+	if (!et->unbox(arg[0], &alpha))
+		type_error("numvector-axpy!");
+	switch (et->tc) {
+	case TC_F64VECTOR:
+		f64_axpy(y->elems<double>(), alpha.f64, x->elems<double>(), x->len);
+		break;
+	case TC_S64VECTOR:
+		s64_axpy(y->elems<int64_t>(), alpha.s64, x->elems<int64_t>(), x->len);
+		break;
+	default:
+		u8_axpy(y->elems<uint8_t>(), alpha.u8, x->elems<uint8_t>(), x->len);
+		break;
+	}
+	return y;
+}
+
+/* elementwise arithmetic into a fresh vector */
+#define DEF_ELEMENTWISE_PRIM(name, symname, fun)                         \
+DEF_PRIM(name, symname, 2)                                               \
+{                                                                        \
+	const ElemType *et = check_numvectors(arg[0], arg[1], symname);  \
+	if (!et->fun)                                                    \
+		type_error(symname);                                     \
+	NumVector *a = as_numvector(arg[0]), *b = as_numvector(arg[1]);  \
+	NumVector *r = make_numvector(et->tc, a->len);                   \
+	et->fun(r->data, a->data, b->data, a->len);                      \
+	return r;                                                        \
+}
+
+DEF_ELEMENTWISE_PRIM(prim_numvector_add, "numvector-add", add)
+DEF_ELEMENTWISE_PRIM(prim_numvector_sub, "numvector-sub", sub)
+DEF_ELEMENTWISE_PRIM(prim_numvector_mul, "numvector-mul", mul)
+DEF_ELEMENTWISE_PRIM(prim_numvector_div, "numvector-div", div)
+
+/* elementwise comparison giving a u8vector mask of 0 and 1 */
+#define DEF_COMPARE_PRIM(name, symname, fun, swap)                       \
+DEF_PRIM(name, symname, 2)                                               \
+{                                                                        \
+	const ElemType *et = check_numvectors(arg[0], arg[1], symname);  \
+	NumVector *a = as_numvector(arg[swap]);                          \
+	NumVector *b = as_numvector(arg[!swap]);                         \
+	NumVector *r = make_numvector(TC_U8VECTOR, a->len);              \
+	et->fun(r->elems<uint8_t>(), a->data, b->data, a->len);          \
+	return r;                                                        \
+}
+
+DEF_COMPARE_PRIM(prim_numvector_lt, "numvector<", lt, 0)
+DEF_COMPARE_PRIM(prim_numvector_gt, "numvector>", lt, 1)
+DEF_COMPARE_PRIM(prim_numvector_eq, "numvector=", eq, 0)
+
+const prim_info
+numvec_prims[] = {
+	_prim_make_f64vector,
+	_prim_f64vector,
+	_prim_is_f64vector,
+	_prim_f64vector_length,
+	_prim_f64vector_ref,
+	_prim_f64vector_set,
+	_prim_f64vector_to_list,
+	_prim_list_to_f64vector,
+	_prim_make_s64vector,
+	_prim_s64vector,
+	_prim_is_s64vector,
+	_prim_s64vector_length,
+	_prim_s64vector_ref,
+	_prim_s64vector_set,
+	_prim_s64vector_to_list,
+	_prim_list_to_s64vector,
+	_prim_make_u8vector,
+	_prim_u8vector,
+	_prim_is_u8vector,
+	_prim_u8vector_length,
+	_prim_u8vector_ref,
+	_prim_u8vector_set,
+	_prim_u8vector_to_list,
+	_prim_list_to_u8vector,
+	_prim_numvector_sum,
+	_prim_numvector_dot,
+	_prim_numvector_min,
+	_prim_numvector_max,
+	_prim_numvector_axpy,
+	_prim_numvector_add,
+	_prim_numvector_sub,
+	_prim_numvector_mul,
+	_prim_numvector_div,
+	_prim_numvector_lt,
+	_prim_numvector_gt,
+	_prim_numvector_eq,
+};
+
+const unsigned numvec_nprims = NELEMS(numvec_prims);
@@ -10,7 +10,9 @@ struct GenericTable;
 enum {
 	TC_PAIR = __TC_OBJECTS, TC_STRING, TC_SYMBOL, TC_MODULE,
 	TC_AST_PROCEDURE, TC_C_PROCEDURE, TC_CC_PROCEDURE, TC_RECORD_TYPE,
-	TC_GENERIC, TC_USER
+	TC_GENERIC, TC_RECORD_TABLE, TC_BIGNUM, TC_F64VECTOR, TC_S64VECTOR,
+	TC_U8VECTOR, TC_VECTOR, TC_HASH_TABLE, TC_HASH_MAP, TC_HASH_SET,
+	TC_PROMISE, TC_ITERATOR, TC_BYTEVECTOR, TC_PORT, TC_USER
 };
 
 struct Pair : Object {
@@ -39,6 +41,8 @@ public:
 	Dict() : root(0) {}
 	void define(const char *key, const void *value);
 	void *lookup(const char *key);
+	void *lookup(const char *key, size_t len);
+	void each(void (*fn)(void *value, void *data), void *data);
 };
 
 struct Procedure : Object {
@@ -72,10 +76,12 @@ struct CCProcedure : Procedure {
 		: Procedure(name, arity, TC), proc(proc) {}
 };
 
+/* a child module sees its parent's definitions until it shadows them */
 struct Module : Object {
 	enum { TC = TC_MODULE };
 	Dict defs;
-	Module();
+	Module *parent;
+	Module(Module *parent = 0);
 	ModuleRef *define(Symbol *name, Value value);
 	ModuleRef *lookup(Symbol *name);
 	void undefine(Symbol *name);
@@ -83,17 +89,85 @@ struct Module : Object {
 	ModuleRef *macro_lookup(Symbol *name);
 };
 
+struct Accessor;
+struct Mutator;
+
+/* slot representations for typed record slots */
+enum SlotKind {
+	SLOT_ANY, SLOT_FIXNUM, SLOT_POINTER, SLOT_I32, SLOT_U8, SLOT_F64,
+	NUM_SLOT_KINDS
+};
+
+struct SlotLayout {
+	uint32_t offset;
+	uint8_t kind;
+};
+
 struct RecordType : Type {
 	enum { TC = TC_RECORD_TYPE };
 	Value slots;
 	unsigned nslots;
+	SlotLayout *layout;
+	size_t size;
 	Procedure *_cons;
+	Accessor **_accessors;
+	Mutator **_mutators;
 	RecordType(TypeCode typecode, Symbol *name, Value slots);
+	unsigned slot_index(Symbol *slot);
 	Procedure *constructor();
 	Procedure *accessor(Symbol *slot);
 	Procedure *mutator(Symbol *slot);
 };
 
+struct Record : Object {
+	Value slots[0];
+	inline void *at(unsigned offset)
+		{ return (char *)this + offset; }
+	inline Value get(unsigned kind, unsigned offset) {
+		if (kind == SLOT_ANY)
+			return *(Value *)at(offset);
+		return get_raw(kind, offset);
+	}
+	inline bool set(unsigned kind, unsigned offset, Value value) {
+		if (kind == SLOT_ANY) {
+			*(Value *)at(offset) = value;
+			return true;
+		}
+		return set_raw(kind, offset, value);
+	}
+	Value get_raw(unsigned kind, unsigned offset);
+	bool set_raw(unsigned kind, unsigned offset, Value value);
+};
+
+struct Accessor : CCProcedure {
+	TypeCode typecode;
+	unsigned offset, kind;
+	RecordType *type;
+	static proc_type access;
+	Accessor(RecordType *type, unsigned index);
+};
+
+struct Mutator : CCProcedure {
+	TypeCode typecode;
+	unsigned offset, kind;
+	RecordType *type;
+	static proc_type mutate;
+	Mutator(RecordType *type, unsigned index);
+};
+
+/* records of one type stored column-wise */
+struct RecordTable : Object {
+	enum { TC = TC_RECORD_TABLE };
+	RecordType *type;
+	size_t len, cap;
+	char **columns;
+	RecordTable(RecordType *type);
+	void add(Record *rec);
+	Value ref(size_t i);
+	Value get(unsigned slot, size_t i);
+	bool set(unsigned slot, size_t i, Value value);
+};
+
 struct Generic : Procedure {
 	enum { TC = TC_GENERIC };
 private:
@@ -107,6 +181,152 @@ public:
 	void *lookup(uint16_t *types);
 };
 
+/* sign and magnitude, least significant digit first, no leading zeros */
+struct Bignum : Object {
+	enum { TC = TC_BIGNUM };
+	size_t len;
+	bool neg;
+	uint32_t digit[0];
+};
+
+struct Flonum : Object {
+	enum { TC = TC_FLONUM };
+	double value;
+};
+
+static inline Value
+make_flonum(double d)
+{
+	if (Value::_flonum_fits(d))
+		return Value::_from_flonum(d);
+	Flonum *f = (Flonum *) Object::new_atomic(sizeof(Flonum));
+	f->init_hdr(TC_FLONUM);
+	f->value = d;
+	return f;
+}
+
+struct Vector : Object {
+	enum { TC = TC_VECTOR };
+	size_t len;
+	Value items[0];
+};
+
+enum HashKind { HASH_EQV, HASH_STRING };
+
+/*
+  Open-addressing hash table with SwissTable-style control bytes. On
+  growth the old slots are kept and moved a few at a time by later
+  mutations; lookups search both until the move completes.
+*/
+struct HashTable : Object {
+	enum { TC = TC_HASH_TABLE };
+	struct Slots {
+		uint8_t *ctrl;
+		Value *keys, *vals;
+		size_t cap, used;
+	};
+	Slots cur, old;
+	size_t count, migrated;
+	uint8_t kind;
+	bool weak;
+	HashTable(HashKind kind, bool weak);
+	Value *lookup(Value key);
+	void insert(Value key, Value value);
+	bool remove(Value key);
+private:
+	void grow();
+	void migrate(size_t n);
+	void put(Slots &s, size_t hash, Value key, Value value);
+};
+
+/*
+  Persistent hash array mapped trie. While edit is set the object is a
+  transient: nodes tagged with the same edit are updated in place.
+*/
+struct Hamt : Object {
+	size_t count;
+	struct HamtNode *root;
+	void *edit;
+	Hamt(TypeCode tc) : Object(tc), count(0), root(0), edit(0) {}
+};
+
+struct HashMap : Hamt {
+	enum { TC = TC_HASH_MAP };
+	HashMap() : Hamt(TC) {}
+};
+
+struct HashSet : Hamt {
+	enum { TC = TC_HASH_SET };
+	HashSet() : Hamt(TC) {}
+};
+
+struct Promise : Object {
+	enum { TC = TC_PROMISE };
+	Value thunk, value;
+	bool done;
+	Promise(Value thunk) : Object(TC), thunk(thunk), value(NIL),
+		done(false) {}
+};
+
+enum IterKind {
+	ITER_LIST, ITER_VECTOR, ITER_NUMVECTOR, ITER_RANGE, ITER_GENERATOR,
+	ITER_PORT, ITER_MAP, ITER_FILTER, ITER_TAKE, ITER_DONE
+};
+
+/* stepped by iter_next according to kind; see lazy.cpp */
+struct Iterator : Object {
+	enum { TC = TC_ITERATOR };
+	uint8_t kind;
+	Value src, fun, pos, end;
+	Iterator(IterKind kind, Value src, Value fun = NIL,
+	         Value pos = NIL, Value end = NIL)
+		: Object(TC), kind(kind), src(src), fun(fun), pos(pos),
+		end(end) {}
+};
+
+/* bytes in a heap block, a file mapping or a parent's buffer */
+struct Bytevector : Object {
+	enum { TC = TC_BYTEVECTOR };
+	uint8_t *data;
+	size_t len;
+	Value parent;
+	bool readonly;
+	Bytevector() : Object(TC), data(0), len(0), parent(NIL),
+		readonly(false) {}
+};
+
+enum PortFlags {
+	PORT_INPUT = 1, PORT_OUTPUT = 2, PORT_STRING = 4, PORT_OWNED = 8,
+	PORT_LINEBUF = 16, PORT_UNBUFFERED = 32, PORT_EOF = 64,
+	PORT_CLOSED = 128
+};
+
+/*
+  Buffered stream over a file descriptor or a string; see port.cpp.
+  Input is buffered in [pos,len), output in [0,len).
+*/
+struct Port : Object {
+	enum { TC = TC_PORT };
+	int fd;
+	unsigned flags;
+	char *buf;
+	size_t pos, len, cap;
+	Value source;
+	Port(int fd, unsigned flags) : Object(TC), fd(fd), flags(flags),
+		buf(0), pos(0), len(0), cap(0), source(NIL) {}
+};
+
+/* homogeneous numeric vector, elements stored inline after len */
+struct NumVector : Object {
+	size_t len;
+	char data[0];
+	template <class T> T *elems() { return (T *) data; }
+};
+
+struct F64Vector : NumVector { enum { TC = TC_F64VECTOR }; };
+struct S64Vector : NumVector { enum { TC = TC_S64VECTOR }; };
+struct U8Vector : NumVector { enum { TC = TC_U8VECTOR }; };
+
 #define make_string(value, len) new String(value, len)
 #define make_c_procedure(name, arity, fun) \
 	new CProcedure(name, arity, fun)
@@ -124,6 +344,29 @@ public:
 #define is_cc_procedure(x) _Value_is(x, CCProcedure)
 #define is_type(x) (_Value_is(x, Type) || is_record_type(x))
 #define is_record_type(x) _Value_is(x, RecordType)
+#define is_record_table(x) _Value_is(x, RecordTable)
+#define is_bignum(x) _Value_is(x, Bignum)
+#define is_vector(x) _Value_is(x, Vector)
+#define is_hash_table(x) _Value_is(x, HashTable)
+#define is_hash_map(x) _Value_is(x, HashMap)
+#define is_hash_set(x) _Value_is(x, HashSet)
+#define is_hamt(x) (is_hash_map(x) || is_hash_set(x))
+#define is_promise(x) _Value_is(x, Promise)
+#define is_iterator(x) _Value_is(x, Iterator)
+#define is_bytevector(x) _Value_is(x, Bytevector)
+#define is_port(x) _Value_is(x, Port)
+#define is_f64vector(x) _Value_is(x, F64Vector)
+#define is_s64vector(x) _Value_is(x, S64Vector)
+#define is_u8vector(x) _Value_is(x, U8Vector)
+#define is_numvector(x) (is_f64vector(x) || is_s64vector(x) \
+                         || is_u8vector(x))
+#define is_integer(x) (is_fixnum(x) || is_bignum(x))
+#define is_flonum(x) ((x)._is_flonum() || _Value_is(x, Flonum))
+#define is_number(x) (is_integer(x) || is_flonum(x))
+#define is_accessor(x) (is_cc_procedure(x) \
+                        && as_cc_procedure(x)->proc == Accessor::access)
+#define is_mutator(x) (is_cc_procedure(x) \
+                       && as_cc_procedure(x)->proc == Mutator::mutate)
 
 #define as_pair(x) _Value_as(x, Pair)
 #define as_string(x) _Value_as(x, String)
@@ -135,6 +378,21 @@ public:
 #define as_cc_procedure(x) _Value_as(x, CCProcedure)
 #define as_type(x) _Value_as(x, Type)
 #define as_record_type(x) _Value_as(x, RecordType)
+#define as_record(x) _Value_as(x, Record)
+#define as_record_table(x) _Value_as(x, RecordTable)
+#define as_vector(x) _Value_as(x, Vector)
+#define as_hash_table(x) _Value_as(x, HashTable)
+#define as_hamt(x) _Value_as(x, Hamt)
+#define as_numvector(x) _Value_as(x, NumVector)
+#define as_promise(x) _Value_as(x, Promise)
+#define as_iterator(x) _Value_as(x, Iterator)
+#define as_bytevector(x) _Value_as(x, Bytevector)
+#define as_port(x) _Value_as(x, Port)
+#define as_bignum(x) _Value_as(x, Bignum)
+#define as_flonum(x) ((x)._is_flonum() ? (x)._as_flonum() \
+                      : _Value_as(x, Flonum)->value)
+#define as_accessor(x) _Value_as(x, Accessor)
+#define as_mutator(x) _Value_as(x, Mutator)
 
 #define cons(x,y) (new Pair(x,y))
 #define car(x) (as_pair(x)->fst)
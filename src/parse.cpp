@@ -1,92 +1,236 @@
 #include <ctype.h>
+#include <cerrno>
 #include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "lisp.h"
 #include "parse.h"
+#include "srcloc.h"
+#include "number.h"
+#include "util.h"
 
-static inline int
-isdelim(int c)
-{
-	return isspace(c) || strchr("()", c);
-}
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static inline int
 issymchar(int c)
 {
-	return isalnum(c) || strchr("_-+*/&?!|<>=~%#", c);
+	return isalnum(c) || (c && strchr("_-+*/&?!|<>=~%#", c));
 }
 
 #define parse_error(s) \
-	errorf(ParseError(), "parse error: at %d,%d: " s, line, col)
+	errorf(ParseError(), "parse error: at %d,%d: " s, line(), column())
+
+#define check_incomplete() \
+	do { if (partial) throw ParseIncomplete(); } while (0)
+
+/*
+  Whitespace and the alphanumeric runs that make up most of a symbol
+  are skipped sixteen bytes at a time; the rarer symbol characters and
+  the tail of the buffer are handled a byte at a time.
+*/
+#ifdef __SSE2__
+#define SCAN_WIDTH 16
+
+static inline __m128i
+in_range(__m128i v, char lo, char hi)
+{
+	return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+	                     _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+/* bits set for the bytes at p which are not spaces */
+static inline unsigned
+nonspace_mask(const char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+	__m128i m = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+		             _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+		             _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+	return ~_mm_movemask_epi8(m) & 0xFFFF;
+}
+
+/* bits set for the bytes at p which are not letters, digits or '-' */
+static inline unsigned
+nonword_mask(const char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+	__m128i m = _mm_or_si128(
+		_mm_or_si128(in_range(v, '0', '9'),
+		             in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)),
+		                      'a', 'z')),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+	return ~_mm_movemask_epi8(m) & 0xFFFF;
+}
+
+static const char *
+skip_space(const char *p, const char *end)
+{
+	for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH)
+		if (unsigned m = nonspace_mask(p))
+			return p + __builtin_ctz(m);
+	while (p < end && isspace((unsigned char) *p))
+		p++;
+	return p;
+}
+
+static const char *
+skip_word(const char *p, const char *end)
+{
+	for (; end - p >= SCAN_WIDTH; p += SCAN_WIDTH)
+		if (unsigned m = nonword_mask(p))
+			return p + __builtin_ctz(m);
+	while (p < end && (isalnum((unsigned char) *p) || *p == '-'))
+		p++;
+	return p;
+}
+#else
+static const char *
+skip_space(const char *p, const char *end)
+{
+	while (p < end && isspace((unsigned char) *p))
+		p++;
+	return p;
+}
 
-Parser::Parser() : c(0), c1(0), line(1), col(-1) {}
+static const char *
+skip_word(const char *p, const char *end)
+{
+	while (p < end && (isalnum((unsigned char) *p) || *p == '-'))
+		p++;
+	return p;
+}
+#endif
+
+Parser::Parser()
+	: buf(0), p(0), end(0), sources(0), counted(0), nlines(1),
+	partial(false) {}
 Parser::~Parser() {}
-void Parser::init() { read(); read(); }
 
-bool
-Parser::eof()
+void
+Parser::init(const char *s, size_t n)
 {
-	eats();
-	return c == EOF;
+	buf = p = s;
+	end = s + n;
+	counted = s;
+	nlines = 1;
 }
 
+/* the position is only needed for errors, so it is found by counting */
 int
-Parser::read()
+Parser::line() const
 {
-	int c0 = c;
-	if (c1 == EOF) {
-		c = EOF;
-		return c0;
-	}
-	c = c1;
-	c1 = getc();
-	if (c == '\n') {
-		line++;
-		col = 0;
-	}
-	else
-		col++;
-	return c0;
+	int n = 1;
+	for (const char *q = buf; (q = (const char *) memchr(q, '\n', p - q));
+	     q++)
+		n++;
+	return n;
+}
+
+int
+Parser::column() const
+{
+	const char *q = p;
+	while (q > buf && q[-1] != '\n')
+		q--;
+	return p - q + 1;
+}
+
+/* lists are recorded in the order they start, so the lines before one
+   are only counted once */
+unsigned
+Parser::line_at(const char *q)
+{
+	const char *nl;
+	for (; (nl = (const char *) memchr(counted, '\n', q - counted));
+	     counted = nl + 1)
+		nlines++;
+	counted = q;
+	return nlines;
+}
+
+bool
+Parser::eof()
+{
+	return eats() == EOF;
 }
 
 int
 Parser::eats()
 {
 	while (1) {
-		while (isspace(c)) read();
-		if (c != ';') break;
-		while (c != '\n' && c != EOF) read();
+		p = skip_space(p, end);
+		if (p == end)
+			return EOF;
+		if (isspace((unsigned char) *p))
+			p++;
+		else if (*p == ';') {
+			const char *nl = (const char *) memchr(p, '\n', end - p);
+			p = nl ? nl : end;
+		}
+		else
+			return (unsigned char) *p;
 	}
-	return c;
 }
 
 int
 Parser::next()
 {
-	read();
+	p++;
 	return eats();
 }
 
+/* quoted data is not code, so the lines of its lists are not noted;
+   the parser's map comes back however the datum ends */
+struct Untracked {
+	SourceMap *&sources, *saved;
+	Untracked(SourceMap *&sources, bool now = true)
+		: sources(sources), saved(sources) { if (now) sources = 0; }
+	~Untracked() { sources = saved; }
+};
+
 Value
 Parser::parse()
 {
 	switch (eats()) {
-	case '(':
-		read(); return list();
+	case '(': {
+		unsigned line = sources ? line_at(p) : 0;
+		p++;
+		Value x = list();
+		if (line && is_pair(x))
+			sources->note(x, line);
+		return x;
+		}
 	case '\'':
-		read(); return quoted(sym_quote);
+		p++; return quoted(sym_quote);
 	case '`':
-		read(); return quoted(sym_quasiquote);
+		p++; return quoted(sym_quasiquote);
 	case ',':
-		read();
-		if (c == '@') {
-			read();
+		p++;
+		if (peek() == '@') {
+			p++;
 			return quoted(sym_unquote_splicing);
 		}
 		else
 			return quoted(sym_unquote);
+	case '#':
+		if (peek(1) == EOF)
+			check_incomplete();
+		if (peek(1) == '(') {
+			p += 2;
+			return vector();
+		}
+		break;
 	case ')':
 		parse_error("too many right-parens");
 	case EOF:
+		check_incomplete();
 		parse_error("unexpected end of file");
 	}
 	return atom();
@@ -95,9 +239,10 @@ Parser::parse()
 Value
 Parser::atom()
 {
+	int c = peek();
 	if (c == '"')
 		return string();
-	if (isdigit(c) || (c == '-' && isdigit(c1)))
+	if (isdigit(c) || (c == '-' && isdigit(peek(1))))
 		return number();
 	if (issymchar(c))
 		return symbol();
@@ -108,9 +253,12 @@ Value
 Parser::list()
 {
 	Value p = NIL, t = NIL, x;
+	Untracked data(sources, false);
 
 	while (eats() != ')') {
 		x = parse();
+		if (is_nil(p) && x == sym_quote)
+			sources = 0;
 		p = cons(x, p);
 		if (eats() == '.') {
 			if (next() == ')')
@@ -120,80 +268,197 @@ Parser::list()
 				parse_error("after dot terminator");
 		}
 	}
-	read();
+	this->p++;
 	return reverse(p, t);
 }
 
 Value
-Parser::symbol()
+Parser::vector()
 {
-	char buf[256];
-	unsigned len = 0;
+	Untracked data(sources);
+	Value p = list();
+	Vector *v = make_vector(length(p), NIL);
+	for (size_t i = 0; is_pair(p); p = cdr(p))
+		v->items[i++] = car(p);
+	if (!is_nil(p))
+		parse_error("dot in vector");
+	return v;
+}
 
-	while (len < sizeof(buf) && issymchar(c))
-		buf[len++] = read();
-	if (len == sizeof(buf))
-		parse_error("symbol too long");
-	buf[len] = 0;
+Value
+Parser::symbol()
+{
+	const char *start = p;
+	while (1) {
+		p = skip_word(p, end);
+		if (p < end && issymchar((unsigned char) *p))
+			p++;
+		else
+			break;
+	}
+	/* the symbol may go on in the input still to come */
+	if (p == end)
+		check_incomplete();
+	size_t len = p - start;
 
-	if (strcmp(buf, "true") == 0)
+	if (len == 4 && memcmp(start, "true", 4) == 0)
 		return _T;
-	if (strcmp(buf, "false") == 0)
+	if (len == 5 && memcmp(start, "false", 5) == 0)
 		return _F;
-	if (strcmp(buf, "nil") == 0)
+	if (len == 3 && memcmp(start, "nil", 3) == 0)
 		return NIL;
 
-	return make_symbol(buf);
+	return make_symbol(start, len);
 }
 
 Value
 Parser::string()
 {
-	char buf[256];
-	unsigned len = 0;
-
-	read();
-	while (len < sizeof(buf) && c != '"')
-		buf[len++] = read();
-	read();
-	if (len == sizeof(buf))
-		parse_error("string too long");
-	buf[len] = 0;
-	return make_string(buf, len);
+	const char *start = ++p;
+	const char *q = (const char *) memchr(p, '"', end - p);
+	if (!q) {
+		check_incomplete();
+		p = end;
+		parse_error("unterminated string");
+	}
+	p = q + 1;
+	return make_string(start, q - start);
 }
 
+/*
+  Integers are accumulated nine digits at a time, promoting to a bignum.
+  A fraction or exponent makes the literal a flonum.
+*/
 Value
 Parser::number()
 {
-	Fixnum n = 0;
-	int sign = 1;
-	if (c == '-') {
-		sign = -sign;
-		read();
+	const char *start = p;
+	bool flo = false;
+
+#define DIGITS() while (isdigit(peek())) p++
+	if (peek() == '-')
+		p++;
+	DIGITS();
+	if (peek() == '.' && isdigit(peek(1))) {
+		flo = true;
+		p++;
+		DIGITS();
 	}
-	while (isdigit(c))
-		n = n * 10 + (read() - '0');
-	return make_fixnum(n * sign);
+	if ((peek() == 'e' || peek() == 'E')
+	    && (isdigit(peek(1)) || peek(1) == '-' || peek(1) == '+')) {
+		flo = true;
+		p++;
+		if (peek() == '-' || peek() == '+')
+			p++;
+		DIGITS();
+	}
+#undef DIGITS
+	if (p == end)
+		check_incomplete();
+	if (flo) {
+		/* strtod needs a terminator, which the mapping may not have */
+		malloc_ptr<char> s = strndup(start, p - start);
+		return make_flonum(strtod(s, 0));
+	}
+
+	Value n = make_fixnum(0);
+	Fixnum chunk = 0, scale = 1;
+	const char *q = start + (*start == '-');
+	while (q < p) {
+		chunk = chunk * 10 + (*q++ - '0');
+		scale *= 10;
+		if (scale == 1000000000 || q == p) {
+			n = num_add(num_mul(n, make_fixnum(scale)),
+			            make_fixnum(chunk));
+			chunk = 0;
+			scale = 1;
+		}
+	}
+	return *start == '-' ? num_neg(n) : n;
 }
 
 Value
 Parser::quoted(Symbol *quote)
 {
+	Untracked data(sources, quote == sym_quote);
 	return cons(quote, cons(parse(), NIL));
 }
 
+/*
+  Regular files are mapped; anything else, or a file that cannot be
+  mapped, is read whole. A file that cannot be opened parses as empty.
+*/
 FileParser::FileParser(const char *filename)
-	: file(filename) { init(); }
-int FileParser::getc()
-	{ return file.get(); }
-bool FileParser::_eof()
-	{ return file.eof(); }
+	: data(0), size(0), mapped(false)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd >= 0) {
+		load(fd);
+		close(fd);
+	}
+	init(data, size);
+}
+
+/* everything up to the end of a descriptor, which is left open */
+FileParser::FileParser(int fd)
+	: data(0), size(0), mapped(false)
+{
+	load(fd);
+	init(data, size);
+}
+
+void
+FileParser::load(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED) {
+			madvise(m, st.st_size, MADV_SEQUENTIAL);
+			data = (char *) m;
+			size = st.st_size;
+			mapped = true;
+		}
+	}
+	if (!mapped)
+		read_all(fd);
+}
+
+FileParser::~FileParser()
+{
+	if (mapped)
+		munmap(data, size);
+	else
+		free(data);
+}
+
+#define READ_BLOCK 65536
+
+void
+FileParser::read_all(int fd)
+{
+	size_t cap = 0;
+	while (1) {
+		if (cap - size < READ_BLOCK) {
+			cap = cap ? cap * 2 : READ_BLOCK;
+			data = (char *) realloc(data, cap);
+		}
+		ssize_t n = ::read(fd, data + size, cap - size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		size += n;
+	}
+}
 
 StringParser::StringParser(const char *s, size_t n)
-	: p(s), n(n) { init(); }
+	{ init(s, n); }
 StringParser::StringParser(const char *s)
-	: p(s), n(strlen(s)) { init(); }
-int StringParser::getc()
-	{ return n ? (n--, *p++) : EOF; }
-bool StringParser::_eof()
-	{ return n == 0; }
+	{ init(s, strlen(s)); }
+
+PartialParser::PartialParser(const char *s, size_t n)
+{
+	init(s, n);
+	partial = true;
+}
@@ -1,50 +1,75 @@
 #ifndef SRC_PARSE_H
 #define SRC_PARSE_H
 
-#include <fstream>
+/* raised in place of an error when a partial parse runs out of input */
+class ParseIncomplete {};
 
+struct SourceMap;
+
+/*
+  Parsers scan a whole buffer held in memory: a file is mapped, or read
+  in large blocks when it cannot be, so that tokens are taken straight
+  from the source span.
+*/
 class Parser {
-	int c, c1;
-	int line, col;
+	const char *buf, *p, *end;
+	SourceMap *sources;
+	const char *counted;
+	unsigned nlines;
 
-	int read();
+	int peek(size_t i = 0) const
+		{ return p + i < end ? (unsigned char) p[i] : EOF; }
+	int line() const;
+	int column() const;
+	unsigned line_at(const char *q);
 	int eats();
 	int next();
 	Value atom();
 	Value list();
+	Value vector();
 	Value symbol();
 	Value string();
 	Value number();
 	Value quoted(Symbol *quote);
 protected:
-	void init();
-	virtual int getc() = 0;
-	virtual bool _eof() = 0;
+	bool partial;
+	void init(const char *s, size_t n);
 public:
 	Parser();
 	virtual ~Parser();
 	Value parse();
 	bool eof();
+	const char *source() const { return buf; }
+	size_t source_size() const { return end - buf; }
+	size_t offset() const { return p - buf; }
+	void track(SourceMap *map) { sources = map; }
 };
 
 class FileParser : public Parser {
-	std::ifstream file;
-protected:
-	int getc();
-	bool _eof();
+	char *data;
+	size_t size;
+	bool mapped;
+	void load(int fd);
+	void read_all(int fd);
 public:
 	FileParser(const char *filename);
+	FileParser(int fd);
+	~FileParser();
 };
 
 class StringParser : public Parser {
-	const char *p;
-	size_t n;
-protected:
-	int getc();
-	bool _eof();
 public:
 	StringParser(const char *s, size_t n);
 	StringParser(const char *s);
 };
 
+/*
+  Parses from a buffer which more input may follow, as a port's does:
+  a datum that reaches the end of the buffer raises ParseIncomplete.
+*/
+class PartialParser : public Parser {
+public:
+	PartialParser(const char *s, size_t n);
+};
+
 #endif /* SRC_PARSE_H */
@@ -0,0 +1,637 @@
+/*
+  port.cpp - Buffered input and output over file descriptors and strings
+*/
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "lisp.h"
+#include "parse.h"
+#include "prim.h"
+#include "util.h"
+
+/*
+  Each port has one large buffer: output collects there until it fills,
+  and a write larger than the buffer goes out together with what is
+  pending in a single writev. Input is read a buffer at a time, and a
+  long read takes what it needs straight into the destination while
+  refilling the buffer in the same readv. String ports use the buffer
+  alone: an input string port's buffer is the string itself, and an
+  output string port's buffer grows instead of being flushed.
+
+  The standard output is line buffered when it is a terminal, and the
+  standard error is unbuffered. Whatever the output ports over
+  descriptors still hold is written at exit.
+*/
+
+#define PORT_BUFSIZE 65536
+
+Port *stdin_port, *stdout_port, *stderr_port;
+
+static Port *
+make_port(int fd, unsigned flags, size_t cap = PORT_BUFSIZE)
+{
+	Port *port = new Port(fd, flags);
+	port->buf = (char *) GC_MALLOC_ATOMIC(cap);
+	port->cap = cap;
+	return port;
+}
+
+static void
+grow(Port *port, size_t need)
+{
+	size_t cap = port->cap * 2;
+	while (cap - port->len < need)
+		cap *= 2;
+	char *buf = (char *) GC_MALLOC_ATOMIC(cap);
+	memcpy(buf, port->buf, port->len);
+	port->buf = buf;
+	port->cap = cap;
+}
+
+/* write all of iov, resuming after short writes; false with errno set */
+static bool
+write_all(int fd, struct iovec *iov, int n)
+{
+	while (n > 0) {
+		ssize_t k = writev(fd, iov, n);
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		for (; n > 0 && (size_t) k >= iov->iov_len; iov++, n--)
+			k -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + k;
+			iov->iov_len -= k;
+		}
+	}
+	return true;
+}
+
+/* pending output followed by s, which is written without copying */
+static void
+write_through(Port *port, const char *s, size_t n)
+{
+	struct iovec iov[2];
+	iov[0].iov_base = port->buf;
+	iov[0].iov_len = port->len;
+	iov[1].iov_base = (void *) s;
+	iov[1].iov_len = n;
+	port->len = 0;
+	if (!write_all(port->fd, iov, 2))
+		errorf(Error(), "write error: %s", strerror(errno));
+}
+
+void
+port_flush(Port *port)
+{
+	if (port->len && (port->flags & (PORT_OUTPUT|PORT_STRING))
+	                 == PORT_OUTPUT)
+		write_through(port, 0, 0);
+}
+
+void
+port_write(Port *port, const char *s, size_t n)
+{
+	if (n > port->cap - port->len) {
+		if (port->flags & PORT_STRING)
+			grow(port, n);
+		else if (n >= port->cap) {
+			write_through(port, s, n);
+			return;
+		}
+		else
+			port_flush(port);
+	}
+	memcpy(port->buf + port->len, s, n);
+	port->len += n;
+	if ((port->flags & PORT_UNBUFFERED)
+	    || ((port->flags & PORT_LINEBUF) && memchr(s, '\n', n)))
+		port_flush(port);
+}
+
+/*
+  Read more input after what is buffered, moving the unread bytes to
+  the front and growing the buffer if they fill it. False at the end.
+*/
+static bool
+port_fill(Port *port)
+{
+	if (port->flags & PORT_EOF)
+		return false;
+	if (port->pos) {
+		memmove(port->buf, port->buf + port->pos,
+		        port->len - port->pos);
+		port->len -= port->pos;
+		port->pos = 0;
+	}
+	if (port->len == port->cap)
+		grow(port, 1);
+	while (1) {
+		ssize_t n = read(port->fd, port->buf + port->len,
+		                 port->cap - port->len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			errorf(Error(), "read error: %s", strerror(errno));
+		}
+		if (n == 0) {
+			port->flags |= PORT_EOF;
+			return false;
+		}
+		port->len += n;
+		return true;
+	}
+}
+
+/*
+  Read up to n bytes into dst. Once the buffer is drained the rest is
+  read directly into dst, with any surplus landing in the buffer.
+*/
+static size_t
+port_read(Port *port, char *dst, size_t n)
+{
+	size_t got = port->len - port->pos;
+	if (got > n)
+		got = n;
+	memcpy(dst, port->buf + port->pos, got);
+	port->pos += got;
+	if (got == n || (port->flags & PORT_EOF))
+		return got;
+
+	port->pos = port->len = 0;
+	while (got < n) {
+		struct iovec iov[2];
+		iov[0].iov_base = dst + got;
+		iov[0].iov_len = n - got;
+		iov[1].iov_base = port->buf;
+		iov[1].iov_len = port->cap;
+		ssize_t k = readv(port->fd, iov, 2);
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			errorf(Error(), "read error: %s", strerror(errno));
+		}
+		if (k == 0) {
+			port->flags |= PORT_EOF;
+			break;
+		}
+		if ((size_t) k > n - got) {
+			port->len = k - (n - got);
+			got = n;
+		}
+		else
+			got += k;
+	}
+	return got;
+}
+
+static void
+finalize_port(void *obj, UNUSED void *data)
+{
+	Port *port = (Port *) ((uintptr_t *) obj + 1);
+	if (port->flags & PORT_CLOSED)
+		return;
+	if (port->flags & PORT_OUTPUT) {
+		struct iovec iov = {port->buf, port->len};
+		write_all(port->fd, &iov, 1);
+	}
+	port->flags |= PORT_CLOSED;
+	close(port->fd);
+}
+
+/*
+  The output ports over descriptors, whose buffers are written at exit.
+  The slots are not scanned, and each is cleared when its port becomes
+  unreachable, after which the port's finalizer writes it instead.
+*/
+static Port **out_ports;
+static size_t out_nports, out_cap;
+
+static void
+track_output_port(Port *port)
+{
+	size_t i = 0;
+	for (; i < out_nports; i++) {
+		if (!out_ports[i])
+			break;
+		if (out_ports[i]->flags & PORT_CLOSED) {
+			GC_unregister_disappearing_link((void **) &out_ports[i]);
+			break;
+		}
+	}
+	if (i == out_nports) {
+		if (out_nports == out_cap) {
+			Port **ports = out_ports;
+			out_cap = out_cap ? out_cap * 2 : 16;
+			out_ports = (Port **) GC_MALLOC_ATOMIC(out_cap
+			                                       * sizeof(Port *));
+			for (size_t j = 0; j < out_nports; j++) {
+				out_ports[j] = ports[j];
+				if (!ports[j])
+					continue;
+				GC_unregister_disappearing_link((void **) &ports[j]);
+				GC_general_register_disappearing_link(
+					(void **) &out_ports[j], ports[j]->_hdr());
+			}
+		}
+		out_nports++;
+	}
+	out_ports[i] = port;
+	GC_general_register_disappearing_link((void **) &out_ports[i],
+	                                      port->_hdr());
+}
+
+static Port *
+fd_port(int fd, unsigned flags)
+{
+	Port *port = make_port(fd, flags);
+	if (flags & PORT_OWNED)
+		GC_register_finalizer_no_order(port->_hdr(), finalize_port,
+		                               0, 0, 0);
+	if (flags & PORT_OUTPUT)
+		track_output_port(port);
+	return port;
+}
+
+/* what is still buffered, in open ports and in ports whose finalizers
+   are pending */
+void
+flush_ports(void)
+{
+	GC_invoke_finalizers();
+	for (size_t i = 0; i < out_nports; i++) {
+		Port *port = out_ports[i];
+		if (!port || (port->flags & PORT_CLOSED) || !port->len)
+			continue;
+		struct iovec iov = {port->buf, port->len};
+		port->len = 0;
+		write_all(port->fd, &iov, 1);
+	}
+}
+
+void
+init_ports(void)
+{
+	stdin_port = fd_port(0, PORT_INPUT);
+	stdout_port = fd_port(1, PORT_OUTPUT
+	                         | (isatty(1) ? PORT_LINEBUF : 0));
+	stderr_port = make_port(2, PORT_OUTPUT|PORT_UNBUFFERED, 4096);
+	atexit(flush_ports);
+}
+
+static Port *
+check_port(Value x, unsigned dir, const char *op)
+{
+	if (!is_port(x) || !(as_port(x)->flags & dir))
+		type_error(op);
+	Port *port = as_port(x);
+	if (port->flags & PORT_CLOSED)
+		errorf(Error(), "%s: port is closed", op);
+	return port;
+}
+
+/* the optional port at arg[i], defaulting to a standard port */
+static Port *
+port_arg(unsigned nargs, Value *arg, unsigned i, unsigned dir,
+         const char *op)
+{
+	if (nargs > i + 1)
+		errorf(ArityError(), "arity error: %s", op);
+	if (nargs > i)
+		return check_port(arg[i], dir, op);
+	return dir == PORT_INPUT ? stdin_port : stdout_port;
+}
+
+#define input_port_arg(i, op) \
+	port_arg(nargs, arg, i, PORT_INPUT, op)
+#define output_port_arg(i, op) \
+	port_arg(nargs, arg, i, PORT_OUTPUT, op)
+
+static Port *
+open_file(Value path, int flags, unsigned dir, const char *op)
+{
+	if (!is_string(path))
+		type_error(op);
+	int fd = open(as_string(path)->value, flags|O_CLOEXEC, 0666);
+	if (fd < 0)
+		errorf(Error(), "%s: %s: %s", op, as_string(path)->value,
+		       strerror(errno));
+	return fd_port(fd, dir|PORT_OWNED);
+}
+
+DEF_PRIM(prim_open_input_file, "open-input-file", 1)
+{
+	return open_file(arg[0], O_RDONLY, PORT_INPUT, "open-input-file");
+}
+
+/* (open-output-file path [append]) */
+DEF_PRIM(prim_open_output_file, "open-output-file", ~1)
+{
+	if (nargs > 2)
+		error(ArityError(), "arity error: open-output-file");
+	int flags = O_WRONLY|O_CREAT;
+	flags |= nargs > 1 && arg[1] != _F ? O_APPEND : O_TRUNC;
+	return open_file(arg[0], flags, PORT_OUTPUT, "open-output-file");
+}
+
+static Port *
+check_fd_port(Value fd, unsigned dir, const char *op)
+{
+	if (!is_fixnum(fd) || as_fixnum(fd) < 0)
+		type_error(op);
+	return fd_port(as_fixnum(fd), dir);
+}
+
+/* ports over descriptors the caller owns, which are left open */
+DEF_PRIM(prim_fd_to_input_port, "fd->input-port", 1)
+{
+	return check_fd_port(arg[0], PORT_INPUT, "fd->input-port");
+}
+
+DEF_PRIM(prim_fd_to_output_port, "fd->output-port", 1)
+{
+	return check_fd_port(arg[0], PORT_OUTPUT, "fd->output-port");
+}
+
+DEF_PRIM(prim_open_input_string, "open-input-string", 1)
+{
+	if (!is_string(arg[0]))
+		type_error("open-input-string");
+	String *s = as_string(arg[0]);
+	Port *port = new Port(-1, PORT_INPUT|PORT_STRING|PORT_EOF);
+	port->buf = (char *) s->value;
+	port->len = port->cap = s->len;
+	port->source = s;
+	return port;
+}
+
+DEF_PRIM(prim_open_output_string, "open-output-string", 0)
+{
+	return make_port(-1, PORT_OUTPUT|PORT_STRING, 64);
+}
+
+DEF_PRIM(prim_get_output_string, "get-output-string", 1)
+{
+	Port *port = check_port(arg[0], PORT_OUTPUT, "get-output-string");
+	if (!(port->flags & PORT_STRING))
+		type_error("get-output-string");
+	return make_string(port->buf, port->len);
+}
+
+DEF_PRIM(prim_is_port, "port?", 1)
+{
+	return make_bool(is_port(arg[0]));
+}
+
+DEF_PRIM(prim_is_input_port, "input-port?", 1)
+{
+	return make_bool(is_port(arg[0])
+	                 && (as_port(arg[0])->flags & PORT_INPUT));
+}
+
+DEF_PRIM(prim_is_output_port, "output-port?", 1)
+{
+	return make_bool(is_port(arg[0])
+	                 && (as_port(arg[0])->flags & PORT_OUTPUT));
+}
+
+DEF_PRIM(prim_current_input_port, "current-input-port", 0)
+{
+	return stdin_port;
+}
+
+DEF_PRIM(prim_current_output_port, "current-output-port", 0)
+{
+	return stdout_port;
+}
+
+DEF_PRIM(prim_current_error_port, "current-error-port", 0)
+{
+	return stderr_port;
+}
+
+DEF_PRIM(prim_close_port, "close-port", 1)
+{
+	if (!is_port(arg[0]))
+		type_error("close-port");
+	Port *port = as_port(arg[0]);
+	if (port->flags & PORT_CLOSED)
+		return NIL;
+	if (port->flags & PORT_OUTPUT)
+		port_flush(port);
+	port->flags |= PORT_CLOSED;
+	if ((port->flags & PORT_OWNED) && close(port->fd) < 0)
+		errorf(Error(), "close-port: %s", strerror(errno));
+	return NIL;
+}
+
+DEF_PRIM(prim_flush_output_port, "flush-output-port", ~0)
+{
+	port_flush(output_port_arg(0, "flush-output-port"));
+	return NIL;
+}
+
+/* (read-char [port]) */
+DEF_PRIM(prim_read_char, "read-char", ~0)
+{
+	Port *port = input_port_arg(0, "read-char");
+	if (port->pos == port->len && !port_fill(port))
+		return _EOF;
+	return make_char((unsigned char) port->buf[port->pos++]);
+}
+
+DEF_PRIM(prim_peek_char, "peek-char", ~0)
+{
+	Port *port = input_port_arg(0, "peek-char");
+	if (port->pos == port->len && !port_fill(port))
+		return _EOF;
+	return make_char((unsigned char) port->buf[port->pos]);
+}
+
+/* (read-line [port]), the next line without its newline */
+DEF_PRIM(prim_read_line, "read-line", ~0)
+{
+	Port *port = input_port_arg(0, "read-line");
+	size_t scanned = 0;
+	do {
+		char *start = port->buf + port->pos;
+		char *nl = (char *) memchr(start + scanned, '\n',
+		                           port->len - port->pos - scanned);
+		if (nl) {
+			port->pos = nl + 1 - port->buf;
+			return make_string(start, nl - start);
+		}
+		scanned = port->len - port->pos;
+	} while (port_fill(port));
+
+	if (port->pos == port->len)
+		return _EOF;
+	String *s = make_string(port->buf + port->pos,
+	                        port->len - port->pos);
+	port->pos = port->len;
+	return s;
+}
+
+static size_t
+count_arg(Value n, const char *op)
+{
+	if (!is_fixnum(n) || as_fixnum(n) < 0)
+		type_error(op);
+	return as_fixnum(n);
+}
+
+/* (read-string k [port]), up to k bytes */
+DEF_PRIM(prim_read_string, "read-string", ~1)
+{
+	size_t n = count_arg(arg[0], "read-string");
+	Port *port = input_port_arg(1, "read-string");
+	malloc_ptr<char> buf = (char *) malloc(n ? n : 1);
+	size_t got = port_read(port, buf, n);
+	if (!got && n)
+		return _EOF;
+	return make_string(buf, got);
+}
+
+/* (read-bytevector k [port]), up to k bytes */
+DEF_PRIM(prim_read_bytevector, "read-bytevector", ~1)
+{
+	size_t n = count_arg(arg[0], "read-bytevector");
+	Port *port = input_port_arg(1, "read-bytevector");
+	Bytevector *bv = new Bytevector;
+	bv->data = (uint8_t *) GC_MALLOC_ATOMIC(n ? n : 1);
+	bv->len = port_read(port, (char *) bv->data, n);
+	if (!bv->len && n)
+		return _EOF;
+	return bv;
+}
+
+/*
+  The next datum, or #eof. The buffered input is parsed as far as it
+  goes; a datum cut off by the end of the buffer is parsed again once
+  more has been read.
+*/
+Value
+port_read(Port *port)
+{
+	while (!(port->flags & PORT_EOF)) {
+		try {
+			PartialParser p(port->buf + port->pos,
+			                port->len - port->pos);
+			if (!p.eof()) {
+				Value x = p.parse();
+				port->pos += p.offset();
+				return x;
+			}
+		}
+		catch (ParseIncomplete&) {
+		}
+		port_fill(port);
+	}
+	StringParser p(port->buf + port->pos, port->len - port->pos);
+	if (p.eof()) {
+		port->pos = port->len;
+		return _EOF;
+	}
+	Value x = p.parse();
+	port->pos += p.offset();
+	return x;
+}
+
+DEF_PRIM(prim_read, "read", ~0)
+{
+	return port_read(input_port_arg(0, "read"));
+}
+
+DEF_PRIM(prim_write_char, "write-char", ~1)
+{
+	if (!is_char(arg[0]))
+		type_error("write-char");
+	port_putc(output_port_arg(1, "write-char"), as_char(arg[0]));
+	return NIL;
+}
+
+/* (write-string s [port]) */
+DEF_PRIM(prim_write_string, "write-string", ~1)
+{
+	if (!is_string(arg[0]))
+		type_error("write-string");
+	String *s = as_string(arg[0]);
+	port_write(output_port_arg(1, "write-string"), s->value, s->len);
+	return NIL;
+}
+
+DEF_PRIM(prim_write_bytevector, "write-bytevector", ~1)
+{
+	if (!is_bytevector(arg[0]))
+		type_error("write-bytevector");
+	Bytevector *bv = as_bytevector(arg[0]);
+	port_write(output_port_arg(1, "write-bytevector"),
+	           (const char *) bv->data, bv->len);
+	return NIL;
+}
+
+/* (write x [port]), x as it would be read back */
+DEF_PRIM(prim_write, "write", ~1)
+{
+	print(arg[0], output_port_arg(1, "write"));
+	return NIL;
+}
+
+/* (display x [port]), strings and characters as their contents */
+DEF_PRIM(prim_display, "display", ~1)
+{
+	Port *port = output_port_arg(1, "display");
+	if (is_string(arg[0]))
+		port_write(port, as_string(arg[0])->value,
+		           as_string(arg[0])->len);
+	else if (is_char(arg[0]))
+		port_putc(port, as_char(arg[0]));
+	else
+		print(arg[0], port);
+	return NIL;
+}
+
+DEF_PRIM(prim_newline, "newline", ~0)
+{
+	port_putc(output_port_arg(0, "newline"), '\n');
+	return NIL;
+}
+
+const prim_info
+port_prims[] = {
+	_prim_open_input_file,
+	_prim_open_output_file,
+	_prim_fd_to_input_port,
+	_prim_fd_to_output_port,
+	_prim_open_input_string,
+	_prim_open_output_string,
+	_prim_get_output_string,
+	_prim_is_port,
+	_prim_is_input_port,
+	_prim_is_output_port,
+	_prim_current_input_port,
+	_prim_current_output_port,
+	_prim_current_error_port,
+	_prim_close_port,
+	_prim_flush_output_port,
+	_prim_read_char,
+	_prim_peek_char,
+	_prim_read_line,
+	_prim_read_string,
+	_prim_read_bytevector,
+	_prim_read,
+	_prim_write_char,
+	_prim_write_string,
+	_prim_write_bytevector,
+	_prim_write,
+	_prim_display,
+	_prim_newline,
+};
+
+const unsigned port_nprims = NELEMS(port_prims);
@@ -0,0 +1,39 @@
+#ifndef SRC_PRIM_H
+#define SRC_PRIM_H
+
+/* static primitive information */
+struct prim_info {
+	const char *name;
+	int arity;
+	Value (*proc)(unsigned, Value *);
+};
+
+#define DEF_PRIM(name, symname, arity)              \
+static Value name(unsigned, Value *);               \
+static prim_info _##name = {symname, arity, name};  \
+static Value \
+name(UNUSED const unsigned nargs, UNUSED Value *const arg)
+
+/* primitive tables defined outside primitives.cpp */
+extern const prim_info numvec_prims[];
+extern const unsigned numvec_nprims;
+extern const prim_info vector_prims[];
+extern const unsigned vector_nprims;
+extern const prim_info hash_prims[];
+extern const unsigned hash_nprims;
+extern const prim_info hamt_prims[];
+extern const unsigned hamt_nprims;
+extern const prim_info sort_prims[];
+extern const unsigned sort_nprims;
+extern const prim_info list_prims[];
+extern const unsigned list_nprims;
+extern const prim_info lazy_prims[];
+extern const unsigned lazy_nprims;
+extern const prim_info bytevector_prims[];
+extern const unsigned bytevector_nprims;
+extern const prim_info port_prims[];
+extern const unsigned port_nprims;
+extern const prim_info srcloc_prims[];
+extern const unsigned srcloc_nprims;
+
+#endif /* SRC_PRIM_H */
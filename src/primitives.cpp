@@ -1,21 +1,11 @@
 #include <cstdlib>
 #include <cstring>
+#include <cmath>
 #include "lisp.h"
+#include "number.h"
+#include "prim.h"
 #include "util.h"
 
-/* static primitive information */
-struct prim_info {
-	const char *name;
-	int arity;
-	Value (*proc)(unsigned, Value *);
-};
-
-#define DEF_PRIM(name, symname, arity)              \
-static Value name(unsigned, Value *);               \
-static prim_info _##name = {symname, arity, name};  \
-static Value \
-name(UNUSED const unsigned nargs, UNUSED Value *const arg)
-
 DEF_PRIM(prim_exit, "exit", 1)
 {
 	if (!is_fixnum(arg[0]))
@@ -25,9 +15,16 @@ DEF_PRIM(prim_exit, "exit", 1)
 
 DEF_PRIM(prim_make_record_type, "make-record-type", 2)
 {
-	if (!is_symbol(arg[0]) || !is_symbol_list(arg[1]))
+	if (!is_symbol(arg[0]) || length(arg[1]) == 0)
 		type_error("make-record-type");
-	return new RecordType(alloc_type_code(), as_symbol(arg[0]), arg[1]);
+	TypeCode tc = alloc_type_code();
+	try {
+		return new RecordType(tc, as_symbol(arg[0]), arg[1]);
+	}
+	catch (Error&) {
+		free_type_code(tc);
+		throw;
+	}
 }
 
 DEF_PRIM(prim_constructor, "constructor", 1)
@@ -51,6 +48,82 @@ DEF_PRIM(prim_mutator, "mutator", 2)
 	return as_record_type(arg[0])->mutator(as_symbol(arg[1]));
 }
 
+DEF_PRIM(prim_make_record_table, "make-record-table", 1)
+{
+	if (!is_record_type(arg[0]))
+		type_error("make-record-table");
+	return new RecordTable(as_record_type(arg[0]));
+}
+
+DEF_PRIM(prim_record_table_length, "record-table-length", 1)
+{
+	if (!is_record_table(arg[0]))
+		type_error("record-table-length");
+	return make_fixnum(as_record_table(arg[0])->len);
+}
+
+DEF_PRIM(prim_record_table_add, "record-table-add!", 2)
+{
+	if (!is_record_table(arg[0]) || !is_ptr(arg[1]))
+		type_error("record-table-add!");
+	RecordTable *tbl = as_record_table(arg[0]);
+	if (as_ptr(arg[1])->typecode() != tbl->type->typecode)
+		type_error("record-table-add!");
+	tbl->add(as_record(arg[1]));
+	return NIL;
+}
+
+/* row index in range? */
+static inline bool
+is_row(RecordTable *tbl, Value i)
+{
+	return is_fixnum(i) && (size_t)as_fixnum(i) < tbl->len;
+}
+
+DEF_PRIM(prim_record_table_ref, "record-table-ref", 2)
+{
+	if (!is_record_table(arg[0]) || !is_row(as_record_table(arg[0]), arg[1]))
+		type_error("record-table-ref");
+	return as_record_table(arg[0])->ref(as_fixnum(arg[1]));
+}
+
+DEF_PRIM(prim_record_table_slot_ref, "record-table-slot-ref", 3)
+{
+	if (!is_record_table(arg[0]) || !is_symbol(arg[1])
+	    || !is_row(as_record_table(arg[0]), arg[2]))
+		type_error("record-table-slot-ref");
+	RecordTable *tbl = as_record_table(arg[0]);
+	return tbl->get(tbl->type->slot_index(as_symbol(arg[1])),
+	                as_fixnum(arg[2]));
+}
+
+DEF_PRIM(prim_record_table_slot_set, "record-table-slot-set!", 4)
+{
+	if (!is_record_table(arg[0]) || !is_symbol(arg[1])
+	    || !is_row(as_record_table(arg[0]), arg[2]))
+		type_error("record-table-slot-set!");
+	RecordTable *tbl = as_record_table(arg[0]);
+	if (!tbl->set(tbl->type->slot_index(as_symbol(arg[1])),
+	              as_fixnum(arg[2]), arg[3]))
+		type_error("record-table-slot-set!");
+	return NIL;
+}
+
+/* (record-table-fold f init table slot) folds over one column */
+DEF_PRIM(prim_record_table_fold, "record-table-fold", 4)
+{
+	if (!is_record_table(arg[2]) || !is_symbol(arg[3]))
+		type_error("record-table-fold");
+	RecordTable *tbl = as_record_table(arg[2]);
+	unsigned slot = tbl->type->slot_index(as_symbol(arg[3]));
+	Value argv[2] = { arg[1] };
+	for (size_t i = 0; i < tbl->len; i++) {
+		argv[1] = tbl->get(slot, i);
+		argv[0] = apply_argv(arg[0], 2, argv);
+	}
+	return argv[0];
+}
+
 DEF_PRIM(prim_make_symbol, "make-symbol", ~1)
 {
 	size_t len = 0;
@@ -75,7 +148,39 @@ DEF_PRIM(prim_make_symbol, "make-symbol", ~1)
 
 DEF_PRIM(prim_eqv, "eqv?", 2)
 {
-	return make_bool(arg[0] == arg[1]);
+	return make_bool(arg[0] == arg[1] || num_eqv(arg[0], arg[1]));
+}
+
+/* structural equality on lists, strings, vectors, maps and sets */
+bool
+equal(Value x, Value y)
+{
+	for (; is_pair(x) && is_pair(y); x = cdr(x), y = cdr(y))
+		if (!equal(car(x), car(y)))
+			return false;
+	if (x == y)
+		return true;
+	if (is_string(x) && is_string(y))
+		return as_string(x)->len == as_string(y)->len
+		    && !memcmp(as_string(x)->value, as_string(y)->value,
+		               as_string(x)->len);
+	if (is_vector(x) && is_vector(y)) {
+		Vector *a = as_vector(x), *b = as_vector(y);
+		if (a->len != b->len)
+			return false;
+		for (size_t i = 0; i < a->len; i++)
+			if (!equal(a->items[i], b->items[i]))
+				return false;
+		return true;
+	}
+	if (is_hamt(x) && is_hamt(y))
+		return hamt_equal(as_hamt(x), as_hamt(y));
+	return num_eqv(x, y);
+}
+
+DEF_PRIM(prim_equal, "equal?", 2)
+{
+	return make_bool(equal(arg[0], arg[1]));
 }
 
 DEF_PRIM(prim_not, "not", 1)
@@ -86,10 +191,10 @@ DEF_PRIM(prim_not, "not", 1)
 int
 compare(Value x, Value y)
 {
-	if (is_fixnum(x)) {
-		if (!is_fixnum(y))
+	if (is_number(x)) {
+		if (!is_number(y))
 			goto err;
-		return as_fixnum(x) - as_fixnum(y);
+		return num_compare(x, y);
 	}
 	else if (is_string(x)) {
 		if (!is_string(y))
@@ -110,35 +215,47 @@ DEF_PRIM(prim_gt, ">", 2)
 	return make_bool(compare(arg[0], arg[1]) > 0);
 }
 
-#define DEF_FIXNUM_OP(name, symname, op)        \
+#define DEF_ARITH_OP(name, symname, fun)        \
 DEF_PRIM(name, symname, ~2)                     \
 {                                               \
-	if (!is_fixnum(arg[0]))                 \
-		type_error(#op);                \
-	Fixnum n = as_fixnum(arg[0]);           \
-	for (unsigned i = 1; i < nargs; i++) {  \
-		if (!is_fixnum(arg[i]))         \
-			type_error(#op);        \
-		n = n op as_fixnum(arg[i]);     \
-	}                                       \
-	return make_fixnum(n);                  \
-}
-
-DEF_FIXNUM_OP(prim_add, "+", +)
-DEF_FIXNUM_OP(prim_sub, "-", -)  // TODO: accept 1 argument
-DEF_FIXNUM_OP(prim_mul, "*", *)
-DEF_FIXNUM_OP(prim_div, "/", /)
+	Value n = arg[0];                       \
+	for (unsigned i = 1; i < nargs; i++)    \
+		n = fun(n, arg[i]);             \
+	return n;                               \
+}
+
+DEF_ARITH_OP(prim_add, "+", num_add)
+DEF_ARITH_OP(prim_sub, "-", num_sub)  // TODO: accept 1 argument
+DEF_ARITH_OP(prim_mul, "*", num_mul)
+DEF_ARITH_OP(prim_div, "/", num_div)
+
+DEF_PRIM(prim_remainder, "remainder", 2)
+{
+	return num_rem(arg[0], arg[1]);
+}
 
 DEF_PRIM(prim_negate, "negate", 1)
 {
-	if (is_fixnum(arg[0]))
-		return make_fixnum(-as_fixnum(arg[0]));
-	type_error("negate");
+	return num_neg(arg[0]);
+}
+
+DEF_PRIM(prim_exact_to_inexact, "exact->inexact", 1)
+{
+	return make_flonum(num_to_double(arg[0]));
 }
 
-DEF_PRIM(prim_length, "length", 1)
+DEF_PRIM(prim_inexact_to_exact, "inexact->exact", 1)
 {
-	return make_fixnum(length(arg[0]));
+	if (is_integer(arg[0]))
+		return arg[0];
+	if (!is_flonum(arg[0]))
+		type_error("inexact->exact");
+	return num_from_double(as_flonum(arg[0]));
+}
+
+DEF_PRIM(prim_sqrt, "sqrt", 1)
+{
+	return make_flonum(sqrt(num_to_double(arg[0])));
 }
 
 DEF_PRIM(prim_apply, "apply", 2)
@@ -146,17 +263,33 @@ DEF_PRIM(prim_apply, "apply", 2)
 	return apply_arglist(arg[0], arg[1]);
 }
 
-DEF_PRIM(prim_println, "println", 1)
+/* compile a procedure's body now, reporting any syntax errors */
+DEF_PRIM(prim_force_compile, "force-compile", 1)
 {
-	println(arg[0]);
+	if (!is_procedure(arg[0]))
+		type_error("force-compile");
+	if (is_ast_procedure(arg[0]))
+		ast_procedure_body(as_ast_procedure(arg[0]));
+	return arg[0];
+}
+
+/* (println x [port]) */
+DEF_PRIM(prim_println, "println", ~1)
+{
+	if (nargs > 2)
+		error(ArityError(), "arity error: println");
+	if (nargs > 1 && !is_port(arg[1]))
+		type_error("println");
+	println(arg[0], nargs > 1 ? as_port(arg[1]) : stdout_port);
 	return NIL;
 }
 
-#define PUTS1(x) do {                                \
-	if (is_string(x))                            \
-		fputs(as_string(x)->value, stdout);  \
-	else                                         \
-		print(x);                            \
+#define PUTS1(x) do {                                       \
+	if (is_string(x))                                   \
+		port_write(stdout_port, as_string(x)->value, \
+		           as_string(x)->len);               \
+	else                                                \
+		print(x);                                   \
 } while (0)
 
 DEF_PRIM(prim_puts, "puts", ~0)
@@ -164,11 +297,11 @@ DEF_PRIM(prim_puts, "puts", ~0)
 	if (nargs > 0) {
 		PUTS1(arg[0]);
 		for (unsigned i = 1; i < nargs; i++) {
-			putchar(' ');
+			port_putc(stdout_port, ' ');
 			PUTS1(arg[i]);
 		}
 	}
-	putchar('\n');
+	port_putc(stdout_port, '\n');
 	return NIL;
 }
 
@@ -178,37 +311,6 @@ DEF_PRIM(prim_error, "error", ~0)
 	throw Error();
 }
 
-static int
-compare_callback(const void *x, const void *y)
-{
-	return compare(car(Value(*(Object **) x)),
-	               car(Value(*(Object **) y)));
-}
-
-DEF_PRIM(prim_sort_bang, "sort!", 1)
-{
-	if (is_nil(arg[0]))
-		return NIL;
-
-	/* copy pointers to consecutive pairs into array */
-	unsigned n = length(arg[0]);
-	malloc_ptr<Value> arr = (Value *) calloc(n, sizeof(Value));
-	Value p = arg[0];
-	for (unsigned i = 0; is_pair(p); p = cdr(p), i++)
-		arr[i] = p;
-	if (!is_nil(p))
-		type_error("sort!");
-
-	/* let stdlib do the dirty work */
-	qsort(arr, n, sizeof(arr[0]), compare_callback);
-
-	/* fix up cdrs */
-	for (unsigned i = 0; i < n-1; i++)
-		cdr(arr[i]) = arr[i+1];
-	cdr(arr[n-1]) = NIL;
-	return arr[0];
-}
-
 #define DEF_TYPE_PRED(name, symname, pred)  \
 DEF_PRIM(name, symname, 1)                  \
 {                                           \
@@ -217,6 +319,9 @@ DEF_PRIM(name, symname, 1)                  \
 
 DEF_TYPE_PRED(prim_is_pair, "pair?", is_pair)
 DEF_TYPE_PRED(prim_is_symbol, "symbol?", is_symbol)
+DEF_TYPE_PRED(prim_is_number, "number?", is_number)
+DEF_TYPE_PRED(prim_is_integer, "integer?", is_integer)
+DEF_TYPE_PRED(prim_is_flonum, "flonum?", is_flonum)
 
 static const struct prim_info
 prim_table[] = {
@@ -225,8 +330,16 @@ prim_table[] = {
 	_prim_constructor,
 	_prim_accessor,
 	_prim_mutator,
+	_prim_make_record_table,
+	_prim_record_table_length,
+	_prim_record_table_add,
+	_prim_record_table_ref,
+	_prim_record_table_slot_ref,
+	_prim_record_table_slot_set,
+	_prim_record_table_fold,
 	_prim_make_symbol,
 	_prim_eqv,
+	_prim_equal,
 	_prim_not,
 	_prim_lt,
 	_prim_gt,
@@ -234,34 +347,95 @@ prim_table[] = {
 	_prim_sub,
 	_prim_mul,
 	_prim_div,
+	_prim_remainder,
 	_prim_negate,
-	_prim_length,
+	_prim_exact_to_inexact,
+	_prim_inexact_to_exact,
+	_prim_sqrt,
 	_prim_apply,
+	_prim_force_compile,
 	_prim_println,
 	_prim_puts,
 	_prim_error,
-	_prim_sort_bang,
 	_prim_is_pair,
 	_prim_is_symbol,
+	_prim_is_number,
+	_prim_is_integer,
+	_prim_is_flonum,
+};
+
+static const unsigned prim_count = NELEMS(prim_table);
+
+static const struct {
+	const prim_info *prims;
+	const unsigned *count;
+} prim_tables[] = {
+	{prim_table, &prim_count},
+	{numvec_prims, &numvec_nprims},
+	{vector_prims, &vector_nprims},
+	{hash_prims, &hash_nprims},
+	{hamt_prims, &hamt_nprims},
+	{sort_prims, &sort_nprims},
+	{list_prims, &list_nprims},
+	{lazy_prims, &lazy_nprims},
+	{bytevector_prims, &bytevector_nprims},
+	{port_prims, &port_nprims},
+	{srcloc_prims, &srcloc_nprims},
 };
 
-static Procedure *prim_objs[NELEMS(prim_table)];
+static Value prim_objs = NIL;
 
 void
 init_primitives(void)
 {
-	for (unsigned i = 0; i < NELEMS(prim_table); i++)
-		prim_objs[i] = new CProcedure(
-			make_symbol(prim_table[i].name),
-			prim_table[i].arity,
-			prim_table[i].proc);
+	for (unsigned t = NELEMS(prim_tables); t-- > 0; ) {
+		const prim_info *prims = prim_tables[t].prims;
+		for (unsigned i = *prim_tables[t].count; i-- > 0; )
+			prim_objs = cons(new CProcedure(
+				make_symbol(prims[i].name),
+				prims[i].arity,
+				prims[i].proc), prim_objs);
+	}
+}
+
+/* a primitive by its own name, which definitions may since have changed */
+Value
+primitive(const char *name)
+{
+	for (unsigned t = 0; t < NELEMS(prim_tables); t++) {
+		const prim_info *prims = prim_tables[t].prims;
+		for (unsigned i = 0; i < *prim_tables[t].count; i++) {
+			if (strcmp(prims[i].name, name) != 0)
+				continue;
+			for (Value p = prim_objs; is_pair(p); p = cdr(p))
+				if (as_c_procedure(car(p))->proc
+				    == prims[i].proc)
+					return car(p);
+		}
+	}
+	return UNDEFINED;
+}
+
+/* identifies the set of primitives, which compiled code depends on */
+uint64_t
+primitives_signature(void)
+{
+	uint64_t h = sizeof(Value);
+	for (unsigned t = 0; t < NELEMS(prim_tables); t++) {
+		const prim_info *prims = prim_tables[t].prims;
+		for (unsigned i = 0; i < *prim_tables[t].count; i++) {
+			h = hash64(prims[i].name, strlen(prims[i].name), h);
+			h = hash64(&prims[i].arity, sizeof(int), h);
+		}
+	}
+	return h;
 }
 
 void
 primitives(Module *mod)
 {
-	for (unsigned i = 0; i < NELEMS(prim_objs); i++)
-		mod->define(prim_objs[i]->name, prim_objs[i]);
+	for (Value p = prim_objs; is_pair(p); p = cdr(p))
+		mod->define(as_procedure(car(p))->name, car(p));
 
 	mod->define(make_symbol("<pair>"), type_table[TC_PAIR]);
 }
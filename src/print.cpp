@@ -1,67 +1,279 @@
 #include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include "lisp.h"
+#include "number.h"
+#include "util.h"
 
-#define prints(s) fputs(s, stdout)
+/*
+  The printer writes straight into the port's buffer and never calls
+  itself: cdr chains are followed in a loop, and each list or vector
+  being printed is a frame on an explicit stack. A port that flushes
+  per write or per line is left to fill its buffer while a value is
+  printed and is flushed once at the end.
+*/
+
+static inline void
+prints(Port *port, const char *s)
+{
+	port_write(port, s, strlen(s));
+}
+
+static const char digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"6869707172737475767778798081828384858687888990919293949596979899";
 
 static void
-print_list(Value x)
+print_fixnum(Fixnum n, Port *port)
 {
-	putchar('(');
-	print(car(x));
-	x = cdr(x);
-	for (; is_pair(x); x = cdr(x)) {
-		putchar(' ');
-		print(car(x));
+	char buf[24], *p = buf + sizeof(buf);
+	uintptr_t u = n < 0 ? -(uintptr_t) n : n;
+
+	for (; u >= 100; u /= 100) {
+		p -= 2;
+		memcpy(p, digit_pairs + u % 100 * 2, 2);
 	}
-	if (x != NIL) {
-		prints(" . ");
-		print(x);
+	if (u >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + u * 2, 2);
 	}
-	putchar(')');
+	else
+		*--p = '0' + u;
+	if (n < 0)
+		*--p = '-';
+	port_write(port, p, buf + sizeof(buf) - p);
+}
+
+static void
+print_hex(uintptr_t u, Port *port)
+{
+	char buf[2 + 2 * sizeof(u)], *p = buf + sizeof(buf);
+	do
+		*--p = "0123456789abcdef"[u & 15];
+	while (u >>= 4);
+	*--p = 'x';
+	*--p = '0';
+	port_write(port, p, buf + sizeof(buf) - p);
+}
+
+/* shortest representation which reads back as the same double */
+static void
+print_flonum(double d, Port *port)
+{
+	char buf[32];
+
+	if (isnan(d)) {
+		prints(port, "+nan.0");
+		return;
+	}
+	if (isinf(d)) {
+		prints(port, d < 0 ? "-inf.0" : "+inf.0");
+		return;
+	}
+	for (int prec = 1; prec <= 17; prec++) {
+		snprintf(buf, sizeof(buf), "%.*g", prec, d);
+		if (strtod(buf, 0) == d)
+			break;
+	}
+	/* %g goes to an exponent once it passes the precision */
+	if (fabs(d) >= 1 && fabs(d) < 1e16 && strchr(buf, 'e'))
+		snprintf(buf, sizeof(buf), "%.0f", d);
+	prints(port, buf);
+	if (!strpbrk(buf, ".e"))
+		prints(port, ".0");
+}
+
+static void
+print_named(const char *kind, String *name, Port *port)
+{
+	prints(port, kind);
+	port_write(port, name->value, name->len);
+	port_putc(port, '>');
 }
 
 static void
-print_string(String *x)
+print_count(const char *kind, size_t n, Port *port)
 {
-	putchar('"');
-	prints(x->value);
-	putchar('"');
+	prints(port, kind);
+	print_fixnum(n, port);
+	port_putc(port, '>');
 }
 
-void print(Value x)
+/* anything but a pair, vector or hash map or set */
+static void
+print_atom(Value x, Port *port)
 {
 	if (is_nil(x))
-		prints("nil");
+		prints(port, "nil");
 	else if (is_eof(x))
-		printf("#eof");
+		prints(port, "#eof");
 	else if (is_fixnum(x))
-		printf("%d", as_fixnum(x));
+		print_fixnum(as_fixnum(x), port);
 	else if (is_bool(x))
-		printf("%s", as_bool(x) ? "true" : "false");
-	else if (is_char(x))
-		printf("'%c'", as_char(x));
-	else if (is_pair(x))
-		print_list(x);
+		prints(port, as_bool(x) ? "true" : "false");
+	else if (is_char(x)) {
+		char s[3] = {'\'', (char) as_char(x), '\''};
+		port_write(port, s, 3);
+	}
+	else if (is_bignum(x))
+		prints(port, bignum_to_string(as_bignum(x)));
+	else if (is_flonum(x))
+		print_flonum(as_flonum(x), port);
 	else if (is_symbol(x))
-		prints(as_symbol(x)->value);
-	else if (is_string(x))
-		print_string(as_string(x));
+		port_write(port, as_symbol(x)->value, as_symbol(x)->len);
+	else if (is_string(x)) {
+		port_putc(port, '"');
+		port_write(port, as_string(x)->value, as_string(x)->len);
+		port_putc(port, '"');
+	}
+	else if (is_numvector(x)) {
+		NumVector *v = as_numvector(x);
+		prints(port, v->typecode() == TC_F64VECTOR ? "#f64("
+		           : v->typecode() == TC_S64VECTOR ? "#s64(" : "#u8(");
+		for (size_t i = 0; i < v->len; i++) {
+			if (i)
+				port_putc(port, ' ');
+			print_atom(numvector_ref(v, i), port);
+		}
+		port_putc(port, ')');
+	}
+	else if (is_hash_table(x))
+		print_count("#<hash-table ", as_hash_table(x)->count, port);
+	else if (is_bytevector(x))
+		print_count("#<bytevector ", as_bytevector(x)->len, port);
+	else if (is_port(x))
+		prints(port, "#<port>");
+	else if (is_promise(x))
+		prints(port, "#<promise>");
+	else if (is_iterator(x))
+		prints(port, "#<iterator>");
 	else if (is_procedure(x))
-		printf("#<procedure %s>", as_procedure(x)->name->value);
+		print_named("#<procedure ", as_procedure(x)->name, port);
 	else if (is_module(x))
-		printf("#<module>");
+		prints(port, "#<module>");
 	else if (is_type(x))
-		printf("#<type %s>", as_type(x)->name->value);
-	else if (is_ptr(x))
-		printf("#<object %p>", as_ptr(x));
+		print_named("#<type ", as_type(x)->name, port);
+	else if (is_ptr(x)) {
+		prints(port, "#<object ");
+		print_hex((uintptr_t) as_ptr(x), port);
+		port_putc(port, '>');
+	}
 	else if (is_undefined(x))
-		printf("#undefined");
+		prints(port, "#undefined");
 	else
-		printf("#ufo");
+		prints(port, "#ufo");
+}
+
+/* the rest of a list, or a vector and the index of its next item */
+struct PrintFrame {
+	Value rest;
+	Vector *vec;
+	size_t i;
+};
+
+class PrintStack {
+	PrintFrame local[32], *frames;
+	size_t n, cap;
+public:
+	PrintStack() : frames(local), n(0), cap(NELEMS(local)) {}
+	bool empty() const { return n == 0; }
+	PrintFrame &top() { return frames[n-1]; }
+	void pop() { n--; }
+	void push(Value rest, Vector *vec)
+	{
+		if (n == cap) {
+			/* collectable, so the frames' values stay reachable */
+			PrintFrame *p = (PrintFrame *)
+				GC_MALLOC(2 * cap * sizeof(PrintFrame));
+			memcpy(p, frames, n * sizeof(PrintFrame));
+			frames = p;
+			cap *= 2;
+		}
+		frames[n].rest = rest;
+		frames[n].vec = vec;
+		frames[n].i = 1;
+		n++;
+	}
+};
+
+/* buffers a port fully while a value is printed to it */
+class HoldFlush {
+	Port *port;
+	unsigned held;
+public:
+	HoldFlush(Port *port) : port(port),
+		held(port->flags & (PORT_LINEBUF|PORT_UNBUFFERED))
+		{ port->flags &= ~held; }
+	~HoldFlush()
+	{
+		port->flags |= held;
+		if (held & PORT_UNBUFFERED)
+			port_flush(port);
+	}
+};
+
+void print(Value x, Port *port)
+{
+	HoldFlush hold(port);
+	PrintStack stack;
+
+	while (1) {
+		if (is_pair(x)) {
+			port_putc(port, '(');
+			stack.push(cdr(x), 0);
+			x = car(x);
+			continue;
+		}
+		if (is_vector(x) && as_vector(x)->len) {
+			prints(port, "#(");
+			stack.push(NIL, as_vector(x));
+			x = as_vector(x)->items[0];
+			continue;
+		}
+		if (is_hamt(x)) {
+			prints(port, is_hash_map(x) ? "#hash-map" : "#hash-set");
+			x = hamt_entries(as_hamt(x));
+			continue;
+		}
+		if (is_vector(x))
+			prints(port, "#()");
+		else
+			print_atom(x, port);
+
+		/* close finished frames, then move on to the next item */
+		while (1) {
+			if (stack.empty())
+				return;
+			PrintFrame &f = stack.top();
+			if (f.vec) {
+				if (f.i < f.vec->len) {
+					port_putc(port, ' ');
+					x = f.vec->items[f.i++];
+					break;
+				}
+			}
+			else if (is_pair(f.rest)) {
+				port_putc(port, ' ');
+				x = car(f.rest);
+				f.rest = cdr(f.rest);
+				break;
+			}
+			else if (f.rest != NIL) {
+				prints(port, " . ");
+				x = f.rest;
+				f.rest = NIL;
+				break;
+			}
+			port_putc(port, ')');
+			stack.pop();
+		}
+	}
 }
 
-void println(Value x)
+void println(Value x, Port *port)
 {
-	print(x);
-	putchar('\n');
+	print(x, port);
+	port_putc(port, '\n');
 }
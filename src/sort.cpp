@@ -0,0 +1,238 @@
+/*
+  sort.cpp - Stable in-place list sorting
+*/
+
+#include <cstring>
+#include "lisp.h"
+#include "prim.h"
+#include "util.h"
+
+/*
+  Lists are sorted by relinking their pairs, so nothing is allocated.
+  The general case is a bottom-up merge sort holding sorted runs of
+  power-of-two lengths in a fixed array of bins. Lists whose keys are
+  all fixnums are radix sorted a byte at a time instead, skipping the
+  bytes in which no two keys differ. Both are stable.
+*/
+#define RADIX_MIN 64
+
+struct identity_key {
+	Value operator()(Value x) { return x; }
+};
+
+struct fun_key {
+	Value fun;
+	fun_key(Value fun) : fun(fun) {}
+	Value operator()(Value x) { return apply_argv(fun, 1, &x); }
+};
+
+struct natural_less {
+	bool operator()(Value x, Value y) { return compare(x, y) < 0; }
+};
+
+/* memcmp on the common prefix, so embedded nulls are ordered too */
+struct string_less {
+	bool operator()(Value x, Value y) {
+		String *a = as_string(x), *b = as_string(y);
+		size_t n = a->len < b->len ? a->len : b->len;
+		int c = memcmp(a->value, b->value, n);
+		return c < 0 || (c == 0 && a->len < b->len);
+	}
+};
+
+struct fixnum_less {
+	bool operator()(Value x, Value y)
+		{ return as_fixnum(x) < as_fixnum(y); }
+};
+
+struct fun_less {
+	Value fun;
+	fun_less(Value fun) : fun(fun) {}
+	bool operator()(Value x, Value y) {
+		Value argv[2] = {x, y};
+		return apply_argv(fun, 2, argv) != _F;
+	}
+};
+
+/* merge two sorted lists, taking from a on ties */
+template <class Key, class Less>
+static Value
+merge(Value a, Value b, Key &key, Less &less)
+{
+	Value head = NIL, last = NIL;
+	while (is_pair(a) && is_pair(b)) {
+		Value p;
+		if (less(key(car(b)), key(car(a)))) {
+			p = b;
+			b = cdr(b);
+		}
+		else {
+			p = a;
+			a = cdr(a);
+		}
+		if (is_nil(last))
+			head = p;
+		else
+			cdr(last) = p;
+		last = p;
+	}
+	Value rest = is_pair(a) ? a : b;
+	if (is_nil(last))
+		return rest;
+	cdr(last) = rest;
+	return head;
+}
+
+template <class Key, class Less>
+static Value
+merge_sort(Value list, Key &key, Less &less)
+{
+	Value bins[sizeof(size_t) * 8];
+	unsigned fill = 0;
+
+	while (is_pair(list)) {
+		Value run = list;
+		list = cdr(list);
+		cdr(run) = NIL;
+		unsigned i = 0;
+		for (; i < fill && !is_nil(bins[i]); i++) {
+			run = merge(bins[i], run, key, less);
+			bins[i] = NIL;
+		}
+		if (i == fill)
+			fill++;
+		bins[i] = run;
+	}
+	Value result = NIL;
+	for (unsigned i = 0; i < fill; i++)
+		if (!is_nil(bins[i]))
+			result = merge(bins[i], result, key, less);
+	return result;
+}
+
+/* fixnum biased so that unsigned order is numeric order */
+static inline uintptr_t
+radix_key(Value k)
+{
+	const uintptr_t sign = (uintptr_t) 1 << (sizeof(uintptr_t) * 8 - 1);
+	return (uintptr_t) as_fixnum(k) ^ sign;
+}
+
+template <class Key>
+static Value
+radix_sort(Value list, Key &key, uintptr_t diff)
+{
+	Value head[256], tail[256];
+
+	for (unsigned shift = 0; shift < sizeof(uintptr_t) * 8; shift += 8) {
+		if (!(diff >> shift & 0xFF))
+			continue;
+		for (unsigned b = 0; b < 256; b++)
+			head[b] = NIL;
+		for (Value p = list, next; is_pair(p); p = next) {
+			next = cdr(p);
+			unsigned b = radix_key(key(car(p))) >> shift & 0xFF;
+			if (is_nil(head[b]))
+				head[b] = p;
+			else
+				cdr(tail[b]) = p;
+			tail[b] = p;
+		}
+		Value last = NIL;
+		for (unsigned b = 0; b < 256; b++) {
+			if (is_nil(head[b]))
+				continue;
+			if (is_nil(last))
+				list = head[b];
+			else
+				cdr(last) = head[b];
+			last = tail[b];
+		}
+		cdr(last) = NIL;
+	}
+	return list;
+}
+
+/* sort by natural order, choosing the path from the kinds of key */
+template <class Key>
+static Value
+sort_natural(Value list, Key &key, const char *op)
+{
+	size_t n = 0;
+	bool fixnums = true, strings = true;
+	uintptr_t first = 0, diff = 0;
+
+	Value p = list;
+	for (; is_pair(p); p = cdr(p), n++) {
+		Value k = key(car(p));
+		if (is_fixnum(k)) {
+			uintptr_t u = radix_key(k);
+			if (!n)
+				first = u;
+			diff |= u ^ first;
+		}
+		else
+			fixnums = false;
+		if (!is_string(k))
+			strings = false;
+	}
+	if (!is_nil(p))
+		type_error(op);
+
+	if (fixnums && n >= RADIX_MIN)
+		return radix_sort(list, key, diff);
+	if (fixnums) {
+		fixnum_less less;
+		return merge_sort(list, key, less);
+	}
+	if (strings) {
+		string_less less;
+		return merge_sort(list, key, less);
+	}
+	natural_less less;
+	return merge_sort(list, key, less);
+}
+
+template <class Key>
+static Value
+sort_with(Value list, Key &key, unsigned nargs, Value less_fun,
+          const char *op)
+{
+	if (nargs == 0)
+		return sort_natural(list, key, op);
+	Value p = list;
+	while (is_pair(p))
+		p = cdr(p);
+	if (!is_nil(p))
+		type_error(op);
+	fun_less less(less_fun);
+	return merge_sort(list, key, less);
+}
+
+/* (sort! list [less?]) */
+DEF_PRIM(prim_sort_bang, "sort!", ~1)
+{
+	if (nargs > 2)
+		error(ArityError(), "arity error: sort!");
+	identity_key key;
+	return sort_with(arg[0], key, nargs - 1, nargs > 1 ? arg[1] : NIL,
+	                 "sort!");
+}
+
+/* (sort-by! list key [less?]), comparing (key x) */
+DEF_PRIM(prim_sort_by_bang, "sort-by!", ~2)
+{
+	if (nargs > 3)
+		error(ArityError(), "arity error: sort-by!");
+	fun_key key(arg[1]);
+	return sort_with(arg[0], key, nargs - 2, nargs > 2 ? arg[2] : NIL,
+	                 "sort-by!");
+}
+
+const prim_info
+sort_prims[] = {
+	_prim_sort_bang,
+	_prim_sort_by_bang,
+};
+
+const unsigned sort_nprims = NELEMS(sort_prims);
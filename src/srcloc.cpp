@@ -0,0 +1,145 @@
+/*
+  srcloc.cpp - Source lines of lists and compiled expressions
+*/
+
+#include "lisp.h"
+#include "ast.h"
+#include "prim.h"
+#include "srcloc.h"
+#include "util.h"
+
+SourceMap::SourceMap(String *file)
+	: file(file), lines(new HashTable(HASH_EQV, true)) {}
+
+void
+SourceMap::note(Value form, unsigned line)
+{
+	lines->insert(form, make_fixnum(line));
+}
+
+/* 0 if the form was not read from this file */
+unsigned
+SourceMap::line(Value form)
+{
+	Value *p = lines->lookup(form);
+	return p ? as_fixnum(*p) : 0;
+}
+
+/*
+  Expressions are found by address with linear probing. The keys are
+  held in memory the collector does not scan, and each is cleared when
+  its expression is collected; the slot then stays in use, so probes
+  pass over it, until the table is next rebuilt.
+*/
+struct SourceLine {
+	String *file;
+	unsigned line;
+};
+
+static Expr **src_keys;
+static uint8_t *src_used;
+static SourceLine *src_lines;
+static size_t src_cap, src_nused;
+
+static inline size_t
+expr_hash(Expr *exp)
+{
+	size_t h = (uintptr_t) exp / sizeof(void *) * 2654435761u;
+	return h ^ h >> 16;
+}
+
+static void
+place(Expr *exp, String *file, unsigned line)
+{
+	size_t i = expr_hash(exp) & (src_cap - 1);
+	for (; src_used[i]; i = (i + 1) & (src_cap - 1))
+		if (src_keys[i] == exp)
+			goto found;
+	src_used[i] = 1;
+	src_keys[i] = exp;
+	GC_general_register_disappearing_link((void **) &src_keys[i], exp);
+	src_nused++;
+found:
+	src_lines[i].file = file;
+	src_lines[i].line = line;
+}
+
+/* at twice the live entries, kept under three quarters full */
+static void
+rebuild(void)
+{
+	Expr **keys = src_keys;
+	uint8_t *used = src_used;
+	SourceLine *lines = src_lines;
+	size_t cap = src_cap, live = 0;
+
+	for (size_t i = 0; i < cap; i++)
+		if (used[i] && keys[i])
+			live++;
+	src_cap = 64;
+	while (src_cap * 3 / 4 < 2 * (live + 1))
+		src_cap *= 2;
+	src_keys = (Expr **) GC_MALLOC_ATOMIC(src_cap * sizeof(Expr *));
+	src_used = (uint8_t *) GC_MALLOC_ATOMIC(src_cap);
+	memset(src_used, 0, src_cap);
+	src_lines = (SourceLine *) GC_MALLOC(src_cap * sizeof(SourceLine));
+	src_nused = 0;
+
+	for (size_t i = 0; i < cap; i++) {
+		Expr *exp = keys[i];
+		if (!used[i] || !exp)
+			continue;
+		GC_unregister_disappearing_link((void **) &keys[i]);
+		place(exp, lines[i].file, lines[i].line);
+	}
+}
+
+void
+note_source(Expr *exp, String *file, unsigned line)
+{
+	if (src_nused + 1 > src_cap * 3 / 4)
+		rebuild();
+	place(exp, file, line);
+}
+
+bool
+source_of(Expr *exp, String **file, unsigned *line)
+{
+	if (!src_cap)
+		return false;
+	size_t i = expr_hash(exp) & (src_cap - 1);
+	for (; src_used[i]; i = (i + 1) & (src_cap - 1)) {
+		if (src_keys[i] == exp) {
+			*file = src_lines[i].file;
+			*line = src_lines[i].line;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* follows an error's message */
+void
+print_source(String *file, unsigned line)
+{
+	fprintf(stderr, "  at %.*s:%u\n", (int) file->len, file->value, line);
+}
+
+/* (file . line) of a procedure's definition, or false */
+DEF_PRIM(prim_procedure_source, "procedure-source", 1)
+{
+	if (!is_procedure(arg[0]))
+		type_error("procedure-source");
+	String *file;
+	unsigned line;
+	if (is_ast_procedure(arg[0])
+	    && source_of(as_ast_procedure(arg[0])->body, &file, &line))
+		return cons(file, make_fixnum(line));
+	return _F;
+}
+
+const prim_info srcloc_prims[] = {
+	_prim_procedure_source,
+};
+
+const unsigned srcloc_nprims = NELEMS(srcloc_prims);
@@ -0,0 +1,33 @@
+#ifndef SRC_SRCLOC_H
+#define SRC_SRCLOC_H
+
+/*
+  Source lines are kept in side tables, so that neither the values the
+  reader makes nor the compiled expressions carry them. A SourceMap
+  holds the line of each list read from one file, keyed by its first
+  pair; compiling with it notes the line of each expression compiled
+  from such a list, keyed by the expression. Both tables hold their
+  keys weakly. Code read without a map, as at the prompt, is not
+  recorded at all.
+*/
+struct Expr;
+
+struct SourceMap : GC_object {
+	String *file;
+	HashTable *lines;
+	explicit SourceMap(String *file);
+	void note(Value form, unsigned line);
+	unsigned line(Value form);
+};
+
+extern void
+note_source(Expr *exp, String *file, unsigned line);
+
+/* false if exp was not compiled from a recorded form */
+extern bool
+source_of(Expr *exp, String **file, unsigned *line);
+
+extern void
+print_source(String *file, unsigned line);
+
+#endif /* SRC_SRCLOC_H */
@@ -1,15 +1,24 @@
 #include <cstring>
 #include <cassert>
 #include "lisp.h"
+#include "util.h"
 
+/*
+  type_table is not scanned by the collector, so that record types
+  can be reclaimed. Built-in types are kept alive by permanent_types,
+  record types by their instances, constructor, accessors and mutators.
+*/
 Type *type_table[NUM_TYPE_CODES];
+static Type *permanent_types[TC_USER];
 
 #define init_type(code, name) \
-type_table[code] = new Type(code, make_symbol(name))
+permanent_types[code] = type_table[code] = new Type(code, make_symbol(name))
 
 void
 init_types(void)
 {
+	GC_exclude_static_roots(type_table, type_table + NUM_TYPE_CODES);
+
 	init_type(TC_CONST, "const");
 	init_type(TC_BOOL, "bool");
 	init_type(TC_TYPE, "type");
@@ -20,41 +29,213 @@ init_types(void)
 	init_type(TC_AST_PROCEDURE, "ast-procedure");
 	init_type(TC_C_PROCEDURE, "c-procedure");
 	init_type(TC_CC_PROCEDURE, "cc-procedure");
+	init_type(TC_RECORD_TABLE, "record-table");
+	init_type(TC_BIGNUM, "bignum");
+	init_type(TC_F64VECTOR, "f64vector");
+	init_type(TC_S64VECTOR, "s64vector");
+	init_type(TC_U8VECTOR, "u8vector");
+	init_type(TC_VECTOR, "vector");
+	init_type(TC_HASH_TABLE, "hash-table");
+	init_type(TC_HASH_MAP, "hash-map");
+	init_type(TC_HASH_SET, "hash-set");
+	init_type(TC_PROMISE, "promise");
+	init_type(TC_ITERATOR, "iterator");
+	init_type(TC_BYTEVECTOR, "bytevector");
+	init_type(TC_PORT, "port");
 
-	type_table[TC_PAIR] = new RecordType(TC_PAIR,
+	permanent_types[TC_PAIR] = new RecordType(TC_PAIR,
 		make_symbol("pair"),
 		cons(make_symbol("car"),
 		     cons(make_symbol("cdr"), NIL)));
 }
 
+/*
+  Type codes are allocated from a two-level bit tree: one bit per code
+  in used_codes, and one bit per word of used_codes in full_words which
+  is set when that word has no free codes left.
+*/
+#define WORD_BITS (8 * sizeof(uintptr_t))
+#define NUM_CODE_WORDS (NUM_TYPE_CODES / WORD_BITS)
+
+static uintptr_t used_codes[NUM_CODE_WORDS];
+static uintptr_t full_words[(NUM_CODE_WORDS + WORD_BITS - 1) / WORD_BITS];
+
+static inline unsigned
+first_zero(uintptr_t word)
+{
+	return __builtin_ctzl(~word);
+}
+
+static void
+use_type_code(TypeCode tc)
+{
+	unsigned w = tc / WORD_BITS;
+	used_codes[w] |= (uintptr_t)1 << tc % WORD_BITS;
+	if (used_codes[w] == ~(uintptr_t)0)
+		full_words[w / WORD_BITS] |= (uintptr_t)1 << w % WORD_BITS;
+}
+
 TypeCode
 alloc_type_code(void)
 {
-	static TypeCode tc = TC_USER;
-	return tc++;
-	/* TODO: bit-tree type id allocator */
+	static bool init = false;
+	if (!init) {
+		for (TypeCode tc = 0; tc < TC_USER; tc++)
+			use_type_code(tc);
+		init = true;
+	}
+	for (unsigned i = 0; i < NELEMS(full_words); i++) {
+		if (full_words[i] == ~(uintptr_t)0)
+			continue;
+		unsigned w = i * WORD_BITS + first_zero(full_words[i]);
+		if (w >= NUM_CODE_WORDS)
+			break;
+		TypeCode tc = w * WORD_BITS + first_zero(used_codes[w]);
+		use_type_code(tc);
+		return tc;
+	}
+	error(Error(), "out of type codes");
+}
+
+void
+free_type_code(TypeCode tc)
+{
+	unsigned w = tc / WORD_BITS;
+	assert(tc >= TC_USER && (used_codes[w] >> tc % WORD_BITS & 1));
+	used_codes[w] &= ~((uintptr_t)1 << tc % WORD_BITS);
+	full_words[w / WORD_BITS] &= ~((uintptr_t)1 << w % WORD_BITS);
+}
+
+static void
+finalize_record_type(void *obj, UNUSED void *data)
+{
+	RecordType *type = (RecordType *)((uintptr_t *)obj + 1);
+	type_table[type->typecode] = 0;
+	free_type_code(type->typecode);
+}
+
+static const char *const slot_kind_names[NUM_SLOT_KINDS] = {
+	"any", "fixnum", "pointer", "i32", "u8", "f64"
+};
+
+static const size_t slot_kind_size[NUM_SLOT_KINDS] = {
+	sizeof(Value), sizeof(Fixnum), sizeof(Object *), 4, 1, sizeof(double)
+};
+
+/* slot spec is either a name or (name kind) */
+static Symbol *
+parse_slot(Value spec, uint8_t *kind)
+{
+	*kind = SLOT_ANY;
+	if (is_symbol(spec))
+		return as_symbol(spec);
+	if (!is_pair(spec) || !is_symbol(car(spec)) || !is_pair(cdr(spec))
+	    || !is_symbol(car(cdr(spec))) || !is_nil(cdr(cdr(spec))))
+		error(Error(), "record slot must be name or (name kind)");
+	Symbol *kname = as_symbol(car(cdr(spec)));
+	if (kname == make_symbol("flonum"))
+		kname = make_symbol("f64");
+	for (unsigned k = 0; k < NUM_SLOT_KINDS; k++) {
+		if (kname == make_symbol(slot_kind_names[k])) {
+			*kind = k;
+			return as_symbol(car(spec));
+		}
+	}
+	errorf(Error(), "unknown slot kind: %s", kname->value);
 }
 
-RecordType::RecordType(TypeCode typecode, Symbol *name, Value slots)
-	: Type(typecode, name, TC), slots(slots), nslots(length(slots)),
-	_cons(0)
+RecordType::RecordType(TypeCode typecode, Symbol *name, Value specs)
+	: Type(typecode, name, TC), slots(NIL), nslots(length(specs)),
+	_cons(0), _accessors(0), _mutators(0)
 {
+	layout = (SlotLayout *) GC_MALLOC_ATOMIC(
+		nslots * sizeof(SlotLayout));
+	for (unsigned i = 0; i < nslots; i++, specs = cdr(specs))
+		slots = cons(parse_slot(car(specs), &layout[i].kind), slots);
+	slots = reverse(slots);
+
+	/* place slots largest first so every slot is naturally aligned */
+	size = 0;
+	for (size_t sz = sizeof(double); sz > 0; sz >>= 1)
+		for (unsigned i = 0; i < nslots; i++)
+			if (slot_kind_size[layout[i].kind] == sz) {
+				layout[i].offset = size;
+				size += sz;
+			}
+	size = (size + sizeof(Value) - 1) & ~(sizeof(Value) - 1);
+	/* records of reclaimable types keep their type alive */
+	if (typecode >= TC_USER)
+		size += sizeof(Value);
+
 	type_table[typecode] = this;
+	/* accessors and instances point back here, so ignore cycles */
+	if (typecode >= TC_USER)
+		GC_register_finalizer_no_order(_hdr(),
+			finalize_record_type, 0, 0, 0);
 	/*
 	  TODO:
-	  check for non-nil slot list
 	  check all slots names are unique
 	  type extension
 	*/
 }
 
-struct Record : Object {
-	Value slots[];
-};
+Value
+Record::get_raw(unsigned kind, unsigned offset)
+{
+	switch (kind) {
+	case SLOT_FIXNUM:
+		return make_fixnum(*(Fixnum *)at(offset));
+	case SLOT_POINTER:
+		return *(Object **)at(offset);
+	case SLOT_I32:
+		return make_fixnum(*(int32_t *)at(offset));
+	case SLOT_U8:
+		return make_fixnum(*(uint8_t *)at(offset));
+	case SLOT_F64:
+		return make_flonum(*(double *)at(offset));
+	}
+	return *(Value *)at(offset);
+}
 
-#define as_product_value(x) _Value_as(x, Record)
+/* false if value is not representable in the slot */
+bool
+Record::set_raw(unsigned kind, unsigned offset, Value value)
+{
+	switch (kind) {
+	case SLOT_FIXNUM:
+		if (!is_fixnum(value))
+			return false;
+		*(Fixnum *)at(offset) = as_fixnum(value);
+		return true;
+	case SLOT_POINTER:
+		if (!is_ptr(value))
+			return false;
+		*(Object **)at(offset) = as_ptr(value);
+		return true;
+	case SLOT_I32:
+		if (!is_fixnum(value) || as_fixnum(value) != (int32_t)as_fixnum(value))
+			return false;
+		*(int32_t *)at(offset) = as_fixnum(value);
+		return true;
+	case SLOT_U8:
+		if (!is_fixnum(value) || as_fixnum(value) != (uint8_t)as_fixnum(value))
+			return false;
+		*(uint8_t *)at(offset) = as_fixnum(value);
+		return true;
+	case SLOT_F64:
+		if (is_flonum(value))
+			*(double *)at(offset) = as_flonum(value);
+		else if (is_fixnum(value))
+			*(double *)at(offset) = as_fixnum(value);
+		else
+			return false;
+		return true;
+	}
+	*(Value *)at(offset) = value;
+	return true;
+}
 
-static CCProcedure::proc_type constructor, accessor, mutator;
+static CCProcedure::proc_type constructor;
 
 struct Constructor : CCProcedure {
 	RecordType *type;
@@ -63,54 +244,61 @@ struct Constructor : CCProcedure {
 		type(type) {}
 };
 
-struct Accessor : CCProcedure {
-	TypeCode typecode;
-	unsigned index;
-	inline Accessor(TypeCode typecode, unsigned index)
-		: CCProcedure(sym_at_accessor, 1, accessor),
-		typecode(typecode), index(index) {}
-};
+Accessor::Accessor(RecordType *type, unsigned index)
+	: CCProcedure(sym_at_accessor, 1, access),
+	typecode(type->typecode), offset(type->layout[index].offset),
+	kind(type->layout[index].kind), type(type) {}
 
-struct Mutator : CCProcedure {
-	TypeCode typecode;
-	unsigned index;
-	inline Mutator(TypeCode typecode, unsigned index)
-		: CCProcedure(sym_at_mutator, 2, mutator),
-		typecode(typecode), index(index) {}
-};
+Mutator::Mutator(RecordType *type, unsigned index)
+	: CCProcedure(sym_at_mutator, 2, mutate),
+	typecode(type->typecode), offset(type->layout[index].offset),
+	kind(type->layout[index].kind), type(type) {}
+
+static Record *
+make_record(RecordType *type)
+{
+	Record *p = (Record *) Object::operator new(
+		sizeof(Record) + type->size);
+	p->init_hdr(type->typecode);
+	if (type->typecode >= TC_USER)
+		*(Value *)p->at(type->size - sizeof(Value)) = type;
+	return p;
+}
 
 static Value
 constructor(void *_self, UNUSED unsigned nargs, Value *args)
 {
 	Constructor *self = (Constructor *)_self;
+	RecordType *type = self->type;
 
-	assert(nargs == self->type->nslots);
-	size_t slotsize = self->type->nslots * sizeof(Value);
-	Record *p = (Record *) Object::operator new(
-		sizeof(Record) + slotsize);
-	p->init_hdr(self->type->typecode);
-	memcpy(p->slots, args, slotsize);
+	assert(nargs == type->nslots);
+	Record *p = make_record(type);
+	for (unsigned i = 0; i < nargs; i++)
+		if (!p->set(type->layout[i].kind, type->layout[i].offset,
+		            args[i]))
+			type_error(type->name->value);
 	return p;
 }
 
-static Value
-accessor(void *_self, UNUSED unsigned nargs, Value *args)
+Value
+Accessor::access(void *_self, UNUSED unsigned nargs, Value *args)
 {
 	Accessor *self = (Accessor *)_self;
 
 	if (!is_ptr(args[0]) || as_ptr(args[0])->typecode() != self->typecode)
 		type_error(self->name->value);
-	return as_product_value(args[0])->slots[self->index];
+	return as_record(args[0])->get(self->kind, self->offset);
 }
 
-static Value
-mutator(void *_self, UNUSED unsigned nargs, Value *args)
+Value
+Mutator::mutate(void *_self, UNUSED unsigned nargs, Value *args)
 {
 	Mutator *self = (Mutator *)_self;
 
 	if (!is_ptr(args[0]) || as_ptr(args[0])->typecode() != self->typecode)
 		type_error(self->name->value);
-	as_product_value(args[0])->slots[self->index] = args[1];
+	if (!as_record(args[0])->set(self->kind, self->offset, args[1]))
+		type_error(self->name->value);
 	return NIL;
 }
 
@@ -120,22 +308,116 @@ RecordType::constructor()
 	return _cons ? _cons : (_cons = new Constructor(this));
 }
 
-/* TODO: cache accessor */
-Procedure *
-RecordType::accessor(Symbol *slot)
+unsigned
+RecordType::slot_index(Symbol *slot)
 {
 	int index = memq_index(slot, slots);
 	if (index < 0)
 		errorf(Error(), "slot not found: %s", slot->value);
-	return new Accessor(typecode, index);
+	return index;
+}
+
+/* accessors and mutators are cached per slot, allocated on first use */
+template <class T> static T **
+alloc_slot_cache(unsigned nslots)
+{
+	return (T **) GC_object::operator new(nslots * sizeof(T *));
+}
+
+Procedure *
+RecordType::accessor(Symbol *slot)
+{
+	unsigned index = slot_index(slot);
+	if (!_accessors)
+		_accessors = alloc_slot_cache<Accessor>(nslots);
+	if (!_accessors[index])
+		_accessors[index] = new Accessor(this, index);
+	return _accessors[index];
 }
 
-/* TODO: cache mutator */
 Procedure *
 RecordType::mutator(Symbol *slot)
 {
-	int index = memq_index(slot, slots);
-	if (index < 0)
-		errorf(Error(), "slot not found: %s", slot->value);
-	return new Mutator(typecode, index);
+	unsigned index = slot_index(slot);
+	if (!_mutators)
+		_mutators = alloc_slot_cache<Mutator>(nslots);
+	if (!_mutators[index])
+		_mutators[index] = new Mutator(this, index);
+	return _mutators[index];
+}
+
+/*
+  A record table keeps one array per slot, so that scanning a slot
+  of every record touches contiguous memory. Columns of untyped and
+  pointer slots are scanned by the collector, raw columns are atomic.
+*/
+RecordTable::RecordTable(RecordType *type)
+	: Object(TC), type(type), len(0), cap(0), columns(0)
+{
+	columns = (char **) GC_object::operator new(
+		type->nslots * sizeof(char *));
+}
+
+static char *
+alloc_column(unsigned kind, size_t n)
+{
+	size_t size = n * slot_kind_size[kind];
+	if (kind == SLOT_ANY || kind == SLOT_POINTER)
+		return (char *) GC_MALLOC(size);
+	return (char *) GC_MALLOC_ATOMIC(size);
+}
+
+static inline unsigned
+column_offset(RecordType *type, unsigned slot, size_t i)
+{
+	return i * slot_kind_size[type->layout[slot].kind];
+}
+
+void
+RecordTable::add(Record *rec)
+{
+	if (len == cap) {
+		size_t ncap = cap ? cap * 2 : 16;
+		for (unsigned j = 0; j < type->nslots; j++) {
+			unsigned kind = type->layout[j].kind;
+			char *col = alloc_column(kind, ncap);
+			memcpy(col, columns[j], len * slot_kind_size[kind]);
+			columns[j] = col;
+		}
+		cap = ncap;
+	}
+	for (unsigned j = 0; j < type->nslots; j++) {
+		size_t sz = slot_kind_size[type->layout[j].kind];
+		memcpy(columns[j] + len * sz,
+		       rec->at(type->layout[j].offset), sz);
+	}
+	len++;
+}
+
+Value
+RecordTable::ref(size_t i)
+{
+	Record *rec = make_record(type);
+	for (unsigned j = 0; j < type->nslots; j++) {
+		size_t sz = slot_kind_size[type->layout[j].kind];
+		memcpy(rec->at(type->layout[j].offset),
+		       columns[j] + i * sz, sz);
+	}
+	return rec;
+}
+
+/* columns are accessed as records whose slot sits at the row offset */
+Value
+RecordTable::get(unsigned slot, size_t i)
+{
+	Record *col = (Record *) columns[slot];
+	return col->get(type->layout[slot].kind, column_offset(type, slot, i));
+}
+
+bool
+RecordTable::set(unsigned slot, size_t i, Value value)
+{
+	Record *col = (Record *) columns[slot];
+	return col->set(type->layout[slot].kind,
+		column_offset(type, slot, i), value);
 }
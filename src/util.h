@@ -1,6 +1,9 @@
 #ifndef SRC_UTIL_H
 #define SRC_UTIL_H
 
+#include <cstring>
+#include <stdint.h>
+
 #define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
 
 /* pointer to statically-allocated memory? */
@@ -22,4 +25,33 @@ public:
 	operator T *() const { return p; }
 };
 
+/* MurmurHash64A, for hashing file contents and other byte strings */
+static inline uint64_t
+hash64(const void *key, size_t len, uint64_t seed)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+	const unsigned char *p = (const unsigned char *) key;
+	uint64_t h = seed ^ (len * m);
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t k;
+		memcpy(&k, p, 8);
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+	if (len) {
+		while (len--)
+			h ^= (uint64_t) p[len] << (8 * len);
+		h *= m;
+	}
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
+
 #endif /* SRC_UTIL_H */
@@ -8,15 +8,43 @@ typedef uintptr_t Char, TypeCode, TagCode;
 class Object;
 class Type;
 
+/*
+  Type codes occupy bits 3..TYPE_CODE_BITS+2 of a tagged value or object
+  header, tag codes the bits above. Build with -DTYPE_CODE_BITS=16 for a
+  larger type-code space; typecode() stays a single shift and mask.
+*/
+#ifndef TYPE_CODE_BITS
 #define TYPE_CODE_BITS 10
-#define TAG_CODE_BITS 19
+#endif
+#if TYPE_CODE_BITS > 16
+#error "TYPE_CODE_BITS must fit the uint16_t type codes used by Generic"
+#endif
+#define TAG_CODE_SHIFT (TYPE_CODE_BITS + 3)
+#define TAG_CODE_BITS (32 - TAG_CODE_SHIFT)
 #define NUM_TYPE_CODES (1 << TYPE_CODE_BITS)
 #define NUM_TAG_CODES (1 << TAG_CODE_BITS)
 #define TYPE_CODE_MASK (NUM_TYPE_CODES-1)
 #define TAG_CODE_MASK (NUM_TAG_CODES-1)
 
+#define FIXNUM_MAX ((Fixnum)(UINTPTR_MAX >> 2))
+#define FIXNUM_MIN (-FIXNUM_MAX - 1)
+
+/*
+  On 64-bit targets, doubles whose exponent lies within 127 of 1.0 (and
+  zero) are immediate: the bits are rotated to put the sign in bit 0,
+  the exponent is rebased to 8 bits and the result tagged 100. Other
+  doubles, and all doubles on 32-bit targets, are boxed Flonum objects.
+*/
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define IMMEDIATE_FLONUMS
+#define PTR_TAG_MASK 0x7
+#define FLONUM_EXP_BIAS ((uint64_t)896 << 53)
+#else
+#define PTR_TAG_MASK 0x3
+#endif
+
 enum {
-	TC_CONST, TC_BOOL, TC_TYPE, TC_FIXNUM, TC_CHAR, __TC_OBJECTS
+	TC_CONST, TC_BOOL, TC_TYPE, TC_FIXNUM, TC_CHAR, TC_FLONUM, __TC_OBJECTS
 };
 
 enum { CONST_NIL, CONST_EOF, CONST_UNDEFINED };
@@ -29,7 +57,7 @@ public:
 	inline Value(Object *obj)
 		: val((uintptr_t)obj) {}
 	inline Value(TypeCode typecode, TagCode tagcode)
-		: val(tagcode << 13 | typecode << 3 | 0x6) {}
+		: val(tagcode << TAG_CODE_SHIFT | typecode << 3 | 0x6) {}
 	inline Value()
 		: val(0) {}
 
@@ -42,19 +70,57 @@ public:
 	static inline Value from_const(TagCode tag)
 		{ return Value(TC_CONST, tag); }
 
+	static inline uint64_t double_bits(double d)
+		{ union { double d; uint64_t u; } x; x.d = d; return x.u; }
+	static inline double bits_double(uint64_t u)
+		{ union { double d; uint64_t u; } x; x.u = u; return x.d; }
+#ifdef IMMEDIATE_FLONUMS
+	static inline bool _flonum_fits(double d) {
+		uint64_t u = double_bits(d);
+		return (uint64_t)((u >> 52 & 0x7FF) - 897) < 255 || !(u << 1);
+	}
+	static inline Value _from_flonum(double d) {
+		uint64_t u = double_bits(d);
+		u = u << 1 | u >> 63;
+		if (u > 1)
+			u -= FLONUM_EXP_BIAS;
+		return Value(u << 3 | 0x4);
+	}
+	inline bool _is_flonum() const
+		{ return (val & 0x7) == 0x4; }
+	inline double _as_flonum() const {
+		uint64_t u = val >> 3;
+		if (u > 1)
+			u += FLONUM_EXP_BIAS;
+		return bits_double(u >> 1 | u << 63);
+	}
+#else
+	static inline bool _flonum_fits(double)
+		{ return false; }
+	static inline Value _from_flonum(double)
+		{ return Value(); }
+	inline bool _is_flonum() const
+		{ return false; }
+	inline double _as_flonum() const
+		{ return 0; }
+#endif
+
 	inline bool _is_ptr() const
-		{ return (val & 0x3) == 0x0 && val; }
+		{ return (val & PTR_TAG_MASK) == 0x0 && val; }
 	inline bool _is_fixnum() const
 		{ return (val & 0x1) == 0x1; }
 	inline bool _is_char() const
 		{ return (val & 0x7) == 0x2; }
 	inline bool is_tagged(TypeCode type) const
-		{ return (val & 0x1FFF) == (type << 3 | 0x6); }
+		{ return (val & (((uintptr_t)1 << TAG_CODE_SHIFT) - 1))
+		         == (type << 3 | 0x6); }
 	inline bool _is_bool() const
 		{ return is_tagged(TC_BOOL); }
 	inline bool _is_none() const
 		{ return val == 0; }
 
+	inline uintptr_t _bits() const
+		{ return val; }
 	inline Object *_as_ptr() const
 		{ return (Object *)val; }
 	inline Fixnum _as_fixnum() const
@@ -62,7 +128,7 @@ public:
 	inline Char _as_char() const
 		{ return (Char)val >> 3; }
 	inline TagCode tagcode() const
-		{ return val >> 13; }
+		{ return val >> TAG_CODE_SHIFT; }
 	inline bool _as_bool() const
 		{ return tagcode() != 0; }
 
@@ -82,6 +148,12 @@ public:
 
 extern Type *type_table[NUM_TYPE_CODES];
 
+/*
+  The header is written once, when the object is made. The collector
+  keeps its marks outside the heap, so a live object's page is never
+  written by tracing it: pages shared copy-on-write with a forked
+  worker stay shared through the worker's collections.
+*/
 class Object : public GC_object {
 protected:
 	inline Object(TypeCode typecode)
@@ -92,19 +164,13 @@ public:
 	inline void init_hdr(TypeCode typecode)
 		{ set_hdr(typecode << 3); }
 	inline void init_hdr(TypeCode typecode, TagCode tagcode)
-		{ set_hdr(tagcode << 13 | typecode << 3); }
+		{ set_hdr(tagcode << TAG_CODE_SHIFT | typecode << 3); }
 	inline TypeCode typecode() const
-		{ return hdr() >> 3 & 0x3FF; }
+		{ return hdr() >> 3 & TYPE_CODE_MASK; }
 	inline TagCode tagcode() const
-		{ return hdr() >> 13 & 0x7FFFF; }
+		{ return hdr() >> TAG_CODE_SHIFT & TAG_CODE_MASK; }
 	inline Type *type() const
 		{ return type_table[typecode()]; }
-	inline bool is_marked() const
-		{ return (hdr() & 1) != 0; }
-	inline const Object *loc() const
-		{ return !is_marked() ? this : (const Object *)(hdr() & ~1); }
-	inline void mark(Object *newloc)
-		{ set_hdr((uintptr_t)newloc | 1); }
 	template <class T> inline bool is_type() const
 		{ return T::TC == typecode(); }
 	template <class T> inline const T *unsafe_cast() const
@@ -129,6 +195,11 @@ public:
 		void *p = GC_object::operator new(sizeof(uintptr_t) + size);
 		return (uintptr_t *)p + 1;
 	}
+	/* for objects which contain no pointers */
+	static inline void *new_atomic(size_t size) {
+		void *p = GC_MALLOC_ATOMIC(sizeof(uintptr_t) + size);
+		return (uintptr_t *)p + 1;
+	}
 #endif
 };
 
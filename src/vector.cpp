@@ -0,0 +1,195 @@
+/*
+  vector.cpp - Vectors of values
+*/
+
+#include <cstring>
+#include "lisp.h"
+#include "prim.h"
+#include "util.h"
+
+Vector *
+make_vector(size_t len, Value fill)
+{
+	Vector *v = (Vector *) Object::operator new(
+		sizeof(Vector) + len * sizeof(Value));
+	v->init_hdr(TC_VECTOR);
+	v->len = len;
+	for (size_t i = 0; i < len; i++)
+		v->items[i] = fill;
+	return v;
+}
+
+static Vector *
+check_vector(Value x, const char *op)
+{
+	if (!is_vector(x))
+		type_error(op);
+	return as_vector(x);
+}
+
+static size_t
+check_index(Vector *v, Value i, const char *op)
+{
+	if (!is_fixnum(i))
+		type_error(op);
+	if (as_fixnum(i) < 0 || (size_t) as_fixnum(i) >= v->len)
+		errorf(Error(), "%s: index out of range", op);
+	return as_fixnum(i);
+}
+
+/* optional start and end arguments from arg[first] on */
+static void
+check_range(size_t len, unsigned nargs, Value *arg, unsigned first,
+            size_t *start, size_t *end, const char *op)
+{
+	if (nargs > first + 2)
+		errorf(ArityError(), "arity error: %s", op);
+	*start = 0;
+	*end = len;
+	if (nargs > first) {
+		if (!is_fixnum(arg[first]))
+			type_error(op);
+		*start = as_fixnum(arg[first]);
+	}
+	if (nargs > first + 1) {
+		if (!is_fixnum(arg[first+1]))
+			type_error(op);
+		*end = as_fixnum(arg[first+1]);
+	}
+	if (*end > len || *start > *end)
+		errorf(Error(), "%s: index out of range", op);
+}
+
+/* out-of-line vector-ref, also used by the inlined form when it misses */
+Value
+vector_ref(Value vec, Value index)
+{
+	Vector *v = check_vector(vec, "vector-ref");
+	return v->items[check_index(v, index, "vector-ref")];
+}
+
+DEF_PRIM(prim_make_vector, "make-vector", ~1)
+{
+	if (!is_fixnum(arg[0]) || as_fixnum(arg[0]) < 0)
+		type_error("make-vector");
+	if (nargs > 2)
+		error(ArityError(), "arity error: make-vector");
+	return make_vector(as_fixnum(arg[0]), nargs == 2 ? arg[1] : NIL);
+}
+
+DEF_PRIM(prim_vector, "vector", ~0)
+{
+	Vector *v = make_vector(nargs, NIL);
+	for (unsigned i = 0; i < nargs; i++)
+		v->items[i] = arg[i];
+	return v;
+}
+
+DEF_PRIM(prim_is_vector, "vector?", 1)
+{
+	return make_bool(is_vector(arg[0]));
+}
+
+DEF_PRIM(prim_vector_length, "vector-length", 1)
+{
+	return make_fixnum(check_vector(arg[0], "vector-length")->len);
+}
+
+DEF_PRIM(prim_vector_ref, "vector-ref", 2)
+{
+	return vector_ref(arg[0], arg[1]);
+}
+
+DEF_PRIM(prim_vector_set, "vector-set!", 3)
+{
+	Vector *v = check_vector(arg[0], "vector-set!");
+	v->items[check_index(v, arg[1], "vector-set!")] = arg[2];
+	return arg[2];
+}
+
+/* (vector-fill! v x [start end]) */
+DEF_PRIM(prim_vector_fill, "vector-fill!", ~2)
+{
+	Vector *v = check_vector(arg[0], "vector-fill!");
+	size_t start, end;
+	check_range(v->len, nargs, arg, 2, &start, &end, "vector-fill!");
+	for (size_t i = start; i < end; i++)
+		v->items[i] = arg[1];
+	return v;
+}
+
+/* (vector-copy v [start end]) also serves for slicing */
+DEF_PRIM(prim_vector_copy, "vector-copy", ~1)
+{
+	Vector *v = check_vector(arg[0], "vector-copy");
+	size_t start, end;
+	check_range(v->len, nargs, arg, 1, &start, &end, "vector-copy");
+	Vector *r = make_vector(end - start, NIL);
+	memcpy(r->items, v->items + start, r->len * sizeof(Value));
+	return r;
+}
+
+/* (vector-copy! to at from [start end]) */
+DEF_PRIM(prim_vector_copy_bang, "vector-copy!", ~3)
+{
+	Vector *to = check_vector(arg[0], "vector-copy!");
+	Vector *from = check_vector(arg[2], "vector-copy!");
+	size_t start, end;
+	check_range(from->len, nargs, arg, 3, &start, &end, "vector-copy!");
+	if (!is_fixnum(arg[1]))
+		type_error("vector-copy!");
+	size_t at = as_fixnum(arg[1]);
+	if (at > to->len || end - start > to->len - at)
+		error(Error(), "vector-copy!: index out of range");
+	memmove(to->items + at, from->items + start,
+	        (end - start) * sizeof(Value));
+	return to;
+}
+
+/* (vector->list v [start end]) */
+DEF_PRIM(prim_vector_to_list, "vector->list", ~1)
+{
+	Vector *v = check_vector(arg[0], "vector->list");
+	size_t start, end;
+	check_range(v->len, nargs, arg, 1, &start, &end, "vector->list");
+	Value list = NIL;
+	while (end > start)
+		list = cons(v->items[--end], list);
+	return list;
+}
+
+DEF_PRIM(prim_list_to_vector, "list->vector", 1)
+{
+	Value p = arg[0];
+	Vector *v = make_vector(length(p), NIL);
+	for (size_t i = 0; i < v->len; i++, p = cdr(p))
+		v->items[i] = car(p);
+	if (!is_nil(p))
+		type_error("list->vector");
+	return v;
+}
+
+/* lets the compiler recognise calls to be inlined */
+bool
+is_vector_ref_prim(Value fun)
+{
+	return is_c_procedure(fun)
+	    && as_c_procedure(fun)->proc == prim_vector_ref;
+}
+
+const prim_info
+vector_prims[] = {
+	_prim_make_vector,
+	_prim_vector,
+	_prim_is_vector,
+	_prim_vector_length,
+	_prim_vector_ref,
+	_prim_vector_set,
+	_prim_vector_fill,
+	_prim_vector_copy,
+	_prim_vector_copy_bang,
+	_prim_vector_to_list,
+	_prim_list_to_vector,
+};
+
+const unsigned vector_nprims = NELEMS(vector_prims);